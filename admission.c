@@ -0,0 +1,90 @@
+/**
+ * @file admission.c
+ * @brief Admission control of the proxy's connections
+ *
+ * The counters and the average are updated with atomics, so that admitting
+ * a request takes no lock. The limits are soft by as many connections or
+ * fetches as are being admitted at the same moment.
+ */
+
+#include "admission.h"
+
+#include <stdint.h>
+
+static unsigned connection_limit = MAX_CONNECTIONS;
+static unsigned fetch_limit = MAX_FETCHES;
+static unsigned connections = 0; // admitted connections not yet closed
+static unsigned fetches = 0;     // admitted fetches not yet done
+static uint64_t queue_delay = 0; // moving average, in microseconds
+
+/*
+ * loaded - whether the proxy is loaded enough to serve only hits
+ */
+static bool loaded(void) {
+    unsigned n = __atomic_load_n(&connections, __ATOMIC_RELAXED);
+    uint64_t delay = __atomic_load_n(&queue_delay, __ATOMIC_RELAXED);
+
+    if (connection_limit > 0 &&
+        (uint64_t)n * 100 > (uint64_t)connection_limit * HITS_ONLY_PERCENT) {
+        return true;
+    }
+    return delay > (uint64_t)MAX_QUEUE_DELAY_MS * 1000;
+}
+
+void admission_set_limits(unsigned max_connections, unsigned max_fetches) {
+    connection_limit = max_connections;
+    fetch_limit = max_fetches;
+}
+
+bool admission_connect(void) {
+    unsigned n = __atomic_add_fetch(&connections, 1, __ATOMIC_RELAXED);
+    if (connection_limit > 0 && n > connection_limit) {
+        __atomic_sub_fetch(&connections, 1, __ATOMIC_RELAXED);
+        return false;
+    }
+    return true;
+}
+
+void admission_start(const struct timespec *accepted) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    int64_t us = (int64_t)(now.tv_sec - accepted->tv_sec) * 1000000 +
+                 (now.tv_nsec - accepted->tv_nsec) / 1000;
+    if (us < 0) {
+        us = 0;
+    }
+
+    // exponentially weighted, each sample counting for an eighth; samples
+    // racing with each other may be lost, which an average can afford
+    uint64_t avg = __atomic_load_n(&queue_delay, __ATOMIC_RELAXED);
+    avg = avg - avg / 8 + (uint64_t)us / 8;
+    __atomic_store_n(&queue_delay, avg, __ATOMIC_RELAXED);
+}
+
+void admission_disconnect(void) {
+    __atomic_sub_fetch(&connections, 1, __ATOMIC_RELAXED);
+}
+
+bool admission_fetch_begin(void) {
+    if (loaded()) {
+        return false;
+    }
+    unsigned n = __atomic_add_fetch(&fetches, 1, __ATOMIC_RELAXED);
+    if (fetch_limit > 0 && n > fetch_limit) {
+        __atomic_sub_fetch(&fetches, 1, __ATOMIC_RELAXED);
+        return false;
+    }
+    return true;
+}
+
+void admission_fetch_end(void) {
+    __atomic_sub_fetch(&fetches, 1, __ATOMIC_RELAXED);
+}
+
+unsigned admission_connections(void) {
+    return __atomic_load_n(&connections, __ATOMIC_RELAXED);
+}
+
+unsigned admission_fetches(void) {
+    return __atomic_load_n(&fetches, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,88 @@
+/**
+ * @file admission.h
+ * @brief Interface for admission control of the proxy's connections
+ *
+ * Connections and fetches from web servers are counted as they come and go,
+ * and the delay between accepting a connection and its thread starting to
+ * serve it is tracked as a moving average. Once the proxy is loaded, cache
+ * misses are turned away with a 503 while hits, which cost little, are still
+ * served; once it is overloaded, connections are turned away as they are
+ * accepted, before a thread is spent on them.
+ */
+
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <stdbool.h>
+#include <time.h>
+
+/*
+ * Default limits on connections in flight and fetches from web servers
+ */
+#define MAX_CONNECTIONS 1024
+#define MAX_FETCHES 256
+
+/*
+ * Share of MAX_CONNECTIONS, in percent, above which only hits are served
+ */
+#define HITS_ONLY_PERCENT 75
+
+/*
+ * Average queueing delay, in milliseconds, above which only hits are served
+ */
+#define MAX_QUEUE_DELAY_MS 500
+
+/**
+ * @brief Set the limits
+ * @param[in] max_connections Connections in flight, 0 for no limit
+ * @param[in] max_fetches Fetches from web servers in flight, 0 for no limit
+ */
+void admission_set_limits(unsigned max_connections, unsigned max_fetches);
+
+/**
+ * @brief Admit a connection that has just been accepted
+ *
+ * An admitted connection is counted until admission_disconnect().
+ *
+ * @return true if the connection is admitted, false if it is to be shed
+ */
+bool admission_connect(void);
+
+/**
+ * @brief Record that an admitted connection has started being served
+ * @param[in] accepted When the connection was accepted, on CLOCK_MONOTONIC
+ */
+void admission_start(const struct timespec *accepted);
+
+/**
+ * @brief Stop counting an admitted connection once it is closed
+ */
+void admission_disconnect(void);
+
+/**
+ * @brief Admit a fetch from a web server, for a cache miss
+ *
+ * An admitted fetch is counted until admission_fetch_end().
+ *
+ * @return true if the fetch is admitted, false if the request is to be shed
+ */
+bool admission_fetch_begin(void);
+
+/**
+ * @brief Stop counting an admitted fetch once it is done
+ */
+void admission_fetch_end(void);
+
+/**
+ * @brief Number of admitted connections not yet closed
+ * @return The number of connections
+ */
+unsigned admission_connections(void);
+
+/**
+ * @brief Number of admitted fetches not yet done
+ * @return The number of fetches
+ */
+unsigned admission_fetches(void);
+
+#endif /* ADMISSION_H */
@@ -0,0 +1,113 @@
+/**
+ * @file arena.c
+ * @brief Per-connection arena allocation
+ *
+ * Every arena is one malloc'd block of ARENA_SIZE bytes behind its header.
+ * Allocations that do not fit in what is left get an extra block of their
+ * own, chained to the arena and freed when it is reset.
+ *
+ * Released arenas are kept on a free list, up to ARENA_MAX_FREE of them. The
+ * proxy runs each connection on a thread of its own, which exits with the
+ * connection, so the list is shared by all threads rather than kept per
+ * thread; it is only locked to push or pop one arena.
+ */
+
+#include "arena.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+
+/* Alignment of every allocation, enough for any type */
+#define ARENA_ALIGN 16
+
+/* Block of memory for allocations that did not fit in the arena's own */
+typedef struct arena_extra {
+    struct arena_extra *next;
+} arena_extra_t;
+
+struct arena {
+    size_t used;          // bytes of the block handed out
+    arena_extra_t *extra; // blocks of allocations that did not fit
+    arena_t *next_free;   // next arena on the free list
+};
+
+/* Header sizes rounded up, so that blocks stay aligned */
+#define ARENA_HEADER                                                           \
+    ((sizeof(arena_t) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+#define EXTRA_HEADER                                                           \
+    ((sizeof(arena_extra_t) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+static arena_t *free_arenas = NULL;
+static int nfree_arenas = 0;
+static pthread_mutex_t arena_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+arena_t *arena_acquire(void) {
+    pthread_mutex_lock(&arena_mutex);
+    arena_t *arena = free_arenas;
+    if (arena != NULL) {
+        free_arenas = arena->next_free;
+        nfree_arenas--;
+    }
+    pthread_mutex_unlock(&arena_mutex);
+
+    if (arena == NULL) {
+        arena = (arena_t *)malloc(ARENA_HEADER + ARENA_SIZE);
+        if (arena == NULL) {
+            return NULL;
+        }
+        arena->used = 0;
+        arena->extra = NULL;
+    }
+    arena->next_free = NULL;
+    return arena;
+}
+
+void arena_release(arena_t *arena) {
+    if (arena == NULL) {
+        return;
+    }
+    arena_reset(arena);
+
+    pthread_mutex_lock(&arena_mutex);
+    if (nfree_arenas < ARENA_MAX_FREE) {
+        arena->next_free = free_arenas;
+        free_arenas = arena;
+        nfree_arenas++;
+        arena = NULL;
+    }
+    pthread_mutex_unlock(&arena_mutex);
+
+    // the free list is full
+    free(arena);
+}
+
+void *arena_alloc(arena_t *arena, size_t size) {
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if (size <= ARENA_SIZE - arena->used) {
+        void *p = (char *)arena + ARENA_HEADER + arena->used;
+        arena->used += size;
+        return p;
+    }
+
+    // too large for what is left, give it a block of its own
+    arena_extra_t *extra = (arena_extra_t *)malloc(EXTRA_HEADER + size);
+    if (extra == NULL) {
+        return NULL;
+    }
+    extra->next = arena->extra;
+    arena->extra = extra;
+    return (char *)extra + EXTRA_HEADER;
+}
+
+void arena_reset(arena_t *arena) {
+    while (arena->extra != NULL) {
+        arena_extra_t *next = arena->extra->next;
+        free(arena->extra);
+        arena->extra = next;
+    }
+    arena->used = 0;
+}
+
+void *arena_alloc_cb(void *arena, size_t size) {
+    return arena_alloc((arena_t *)arena, size);
+}
@@ -0,0 +1,76 @@
+/**
+ * @file arena.h
+ * @brief Interface for per-connection arena allocation
+ *
+ * An arena hands out memory by bumping a pointer through one large block, and
+ * takes it all back at once. The small things a request needs for its
+ * lifetime (the parser, its header views, iovec arrays) come from the arena
+ * of its connection, so the request path does not call malloc or free for
+ * them, and nothing allocated for a request can leak.
+ */
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+/*
+ * Size of the block of an arena, enough for the parser and iovecs of a typical
+ * request; larger demands are met with extra blocks
+ */
+#define ARENA_SIZE (32 * 1024)
+
+/*
+ * Max number of released arenas kept for reuse
+ */
+#define ARENA_MAX_FREE 64
+
+typedef struct arena arena_t;
+
+/**
+ * @brief Get an empty arena, reusing a released one if there is any
+ * @return The arena, or NULL if out of memory
+ */
+arena_t *arena_acquire(void);
+
+/**
+ * @brief Give an arena back for reuse
+ *
+ * All memory allocated from the arena becomes invalid.
+ *
+ * @param[in] arena The arena
+ */
+void arena_release(arena_t *arena);
+
+/**
+ * @brief Allocate memory from an arena
+ *
+ * The memory is aligned for any type, and is not initialized. It cannot be
+ * freed individually; it lasts until the arena is reset or released.
+ *
+ * @param[in] arena The arena
+ * @param[in] size Number of bytes
+ * @return Pointer to the memory, or NULL if out of memory
+ */
+void *arena_alloc(arena_t *arena, size_t size);
+
+/**
+ * @brief Free everything allocated from an arena, keeping the arena
+ *
+ * Takes constant time unless allocations overflowed into extra blocks. Used
+ * between requests on one connection.
+ *
+ * @param[in] arena The arena
+ */
+void arena_reset(arena_t *arena);
+
+/**
+ * @brief Allocator callback for interfaces that take one, such as
+ * parser_new_with()
+ * @param[in] arena The arena, as a void pointer
+ * @param[in] size Number of bytes
+ * @return Pointer to the memory, or NULL if out of memory
+ */
+void *arena_alloc_cb(void *arena, size_t size);
+
+#endif /* ARENA_H */
@@ -0,0 +1,440 @@
+/**
+ * @file cache_bench.c
+ * @brief Benchmark of the cache (cache.c) on its own
+ *
+ * Runs two workloads against the cache from 1, 2, 4, ... threads, with
+ * responses written to /dev/null, or with -p to a socketpair drained by
+ * another thread:
+ *   - lookups: each thread looks up keys picked uniformly or with Zipf
+ *     popularity, and stores the object on a miss, as the proxy does;
+ *     reports operations per second, the hit ratio and the latency of hits
+ *     and of misses (the failed lookup and the store);
+ *   - inserts: each thread stores objects under keys never used before, so
+ *     that once the cache is full every store evicts; reports stores per
+ *     second and their latency.
+ * Object sizes for a key are drawn from one of three mixes: small (512 B to
+ * 2 KB), mixed (mostly 1 to 8 KB, a fifth 16 to 96 KB) and large (32 KB up
+ * to MAX_OBJECT_SIZE).
+ *
+ * usage: cache_bench [-n operations] [-t threads] [-k keys]
+ *                    [-z exponent] [-s small|mixed|large] [-p]
+ */
+
+#include "cache.h"
+#include "histogram.h"
+
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Mixes of object sizes
+ */
+typedef enum { SIZES_SMALL, SIZES_MIXED, SIZES_LARGE, NMIXES } size_mix_t;
+
+static const char *mix_names[NMIXES] = {"small", "mixed", "large"};
+
+/*
+ * Settings, from the command line
+ */
+static unsigned long nops = 50000; // operations per thread
+static int max_threads = 4;
+static int nkeys = 5000;
+static double zipf_s = -1; // negative to run both uniform and Zipf 0.99
+static int only_mix = -1;  // negative to run every mix
+static bool use_socketpair = false;
+
+/*
+ * The workload being run
+ */
+static size_mix_t mix;
+static double *zipf_cdf = NULL; // cumulative probabilities, NULL if uniform
+static pthread_barrier_t barrier;
+
+/* Results of a thread */
+typedef struct results {
+    histogram_t hits;   // latency of lookups that hit, nanoseconds
+    histogram_t misses; // latency of lookups that missed, with the store
+} results_t;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * xorshift - next number of a thread's generator
+ */
+static uint64_t xorshift(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+/*
+ * mix64 - scramble a key number into the seed of its object size
+ */
+static uint64_t mix64(uint64_t x) {
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+/*
+ * object_size - size of the body stored under a key, the same every time
+ */
+static ssize_t object_size(uint64_t key) {
+    uint64_t r = mix64(key + 1);
+    switch (mix) {
+    case SIZES_SMALL:
+        return 512 + r % (1536 + 1);
+    case SIZES_MIXED:
+        if (r % 5 != 0) {
+            return 1024 + (r >> 8) % (7 * 1024 + 1);
+        }
+        return 16 * 1024 + (r >> 8) % (80 * 1024 + 1);
+    default:
+        return 32 * 1024 + r % (MAX_OBJECT_SIZE - 32 * 1024 - MAXLINE + 1);
+    }
+}
+
+/*
+ * init_zipf - tabulate the cumulative Zipf distribution over the keys
+ */
+static void init_zipf(double s) {
+    free(zipf_cdf);
+    zipf_cdf = NULL;
+    if (s <= 0) {
+        return;
+    }
+    zipf_cdf = (double *)malloc(nkeys * sizeof(double));
+    if (zipf_cdf == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    double sum = 0;
+    for (int i = 0; i < nkeys; i++) {
+        sum += 1.0 / pow(i + 1, s);
+        zipf_cdf[i] = sum;
+    }
+    for (int i = 0; i < nkeys; i++) {
+        zipf_cdf[i] /= sum;
+    }
+}
+
+/*
+ * next_key - pick the key of the next lookup
+ */
+static int next_key(uint64_t *rng) {
+    if (zipf_cdf == NULL) {
+        return xorshift(rng) % nkeys;
+    }
+    double u = (xorshift(rng) >> 11) * (1.0 / 9007199254740992.0);
+    int lo = 0;
+    int hi = nkeys - 1;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (zipf_cdf[mid] < u) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/*
+ * store - cache the object of a key, using buf (MAX_OBJECT_SIZE bytes) to
+ * build it
+ */
+static void store(const char *uri, uint64_t key, char *buf) {
+    ssize_t size = object_size(key);
+    int n = snprintf(buf, MAXLINE,
+                     "HTTP/1.0 200 OK\r\nContent-Type: application/"
+                     "octet-stream\r\nContent-Length: %zd\r\n\r\n",
+                     size);
+    write_cache(uri, "", buf, n + size, NULL);
+}
+
+/*
+ * drain - read and discard everything sent on the connection
+ */
+static void *drain(void *vargp) {
+    int fd = *(int *)vargp;
+    char buf[64 * 1024];
+    while (read(fd, buf, sizeof(buf)) > 0) {
+    }
+    return NULL;
+}
+
+/* A thread's sink for responses */
+typedef struct sink {
+    int fd;
+    int peer; // other end of the socketpair, -1 if writing to /dev/null
+    pthread_t drainer;
+} sink_t;
+
+static void open_sink(sink_t *sink) {
+    if (!use_socketpair) {
+        sink->peer = -1;
+        if ((sink->fd = open("/dev/null", O_WRONLY)) < 0) {
+            perror("/dev/null");
+            exit(1);
+        }
+        return;
+    }
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+        perror("socketpair");
+        exit(1);
+    }
+    sink->fd = fds[0];
+    sink->peer = fds[1];
+    pthread_create(&sink->drainer, NULL, drain, &sink->peer);
+}
+
+static void close_sink(sink_t *sink) {
+    if (sink->peer >= 0) {
+        shutdown(sink->fd, SHUT_WR);
+        pthread_join(sink->drainer, NULL);
+        close(sink->peer);
+    }
+    close(sink->fd);
+}
+
+/*
+ * lookups - thread routine of the lookup workload
+ */
+static void *lookups(void *vargp) {
+    long id = (long)vargp;
+    uint64_t rng = 0x9E3779B97F4A7C15ULL * (id + 1);
+    results_t *res = (results_t *)calloc(1, sizeof(results_t));
+    char *buf = (char *)malloc(MAX_OBJECT_SIZE);
+    char uri[MAXLINE];
+    sink_t sink;
+
+    if (res == NULL || buf == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    memset(buf, 'x', MAX_OBJECT_SIZE);
+    open_sink(&sink);
+
+    // warm the cache up, untimed, with a quarter of the operations
+    for (unsigned long i = 0; i < nops / 4; i++) {
+        int key = next_key(&rng);
+        snprintf(uri, sizeof(uri), "http://bench/%d", key);
+        if (read_cache(uri, "", sink.fd) < 0) {
+            store(uri, key, buf);
+        }
+    }
+
+    pthread_barrier_wait(&barrier);
+    for (unsigned long i = 0; i < nops; i++) {
+        int key = next_key(&rng);
+        uint64_t start = now_ns();
+        snprintf(uri, sizeof(uri), "http://bench/%d", key);
+        if (read_cache(uri, "", sink.fd) >= 0) {
+            histogram_record(&res->hits, now_ns() - start);
+        } else {
+            store(uri, key, buf);
+            histogram_record(&res->misses, now_ns() - start);
+        }
+    }
+    pthread_barrier_wait(&barrier);
+
+    close_sink(&sink);
+    free(buf);
+    return res;
+}
+
+/*
+ * inserts - thread routine of the insert workload
+ */
+static void *inserts(void *vargp) {
+    long id = (long)vargp;
+    results_t *res = (results_t *)calloc(1, sizeof(results_t));
+    char *buf = (char *)malloc(MAX_OBJECT_SIZE);
+    char uri[MAXLINE];
+
+    if (res == NULL || buf == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    memset(buf, 'x', MAX_OBJECT_SIZE);
+
+    // fill the cache, untimed, so that the timed stores evict
+    uint64_t key = (uint64_t)id << 32;
+    for (unsigned long i = 0; i < nops / 4; i++, key++) {
+        snprintf(uri, sizeof(uri), "http://bench/%lu", (unsigned long)key);
+        store(uri, key, buf);
+    }
+
+    pthread_barrier_wait(&barrier);
+    for (unsigned long i = 0; i < nops; i++, key++) {
+        uint64_t start = now_ns();
+        snprintf(uri, sizeof(uri), "http://bench/%lu", (unsigned long)key);
+        store(uri, key, buf);
+        histogram_record(&res->misses, now_ns() - start);
+    }
+    pthread_barrier_wait(&barrier);
+
+    free(buf);
+    return res;
+}
+
+/*
+ * run - run a workload from a number of threads on an empty cache
+ * Returns the merged results, and the wall time of the timed part.
+ */
+static results_t *run(void *(*routine)(void *), int nthreads,
+                      double *seconds) {
+    pthread_t *tids = (pthread_t *)malloc(nthreads * sizeof(pthread_t));
+    results_t *total = (results_t *)calloc(1, sizeof(results_t));
+    if (tids == NULL || total == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+
+    init_cache();
+    pthread_barrier_init(&barrier, NULL, nthreads + 1);
+    for (long i = 0; i < nthreads; i++) {
+        pthread_create(&tids[i], NULL, routine, (void *)i);
+    }
+    pthread_barrier_wait(&barrier);
+    uint64_t start = now_ns();
+    pthread_barrier_wait(&barrier);
+    *seconds = (now_ns() - start) / 1e9;
+
+    for (int i = 0; i < nthreads; i++) {
+        results_t *res;
+        pthread_join(tids[i], (void **)&res);
+        histogram_merge(&total->hits, &res->hits);
+        histogram_merge(&total->misses, &res->misses);
+        free(res);
+    }
+    pthread_barrier_destroy(&barrier);
+    free_cache();
+    free(tids);
+    return total;
+}
+
+static void print_latency(const histogram_t *h) {
+    if (h->total == 0) {
+        printf(" %8s %8s", "-", "-");
+        return;
+    }
+    printf(" %8.2f %8.2f", histogram_percentile(h, 50) / 1000.0,
+           histogram_percentile(h, 99) / 1000.0);
+}
+
+static void bench_lookups(double s) {
+    init_zipf(s);
+    if (s > 0) {
+        printf("lookups, Zipf %.2f over %d keys, %s sizes\n", s, nkeys,
+               mix_names[mix]);
+    } else {
+        printf("lookups, uniform over %d keys, %s sizes\n", nkeys,
+               mix_names[mix]);
+    }
+    printf("%7s %12s %6s %17s %17s\n", "threads", "ops/s", "hit%",
+           "hit p50/p99 us", "miss p50/p99 us");
+    for (int nthreads = 1; nthreads <= max_threads; nthreads *= 2) {
+        double seconds;
+        results_t *res = run(lookups, nthreads, &seconds);
+        uint64_t ops = res->hits.total + res->misses.total;
+        printf("%7d %12.0f %5.1f%%", nthreads, ops / seconds,
+               100.0 * res->hits.total / ops);
+        print_latency(&res->hits);
+        print_latency(&res->misses);
+        printf("\n");
+        free(res);
+    }
+    printf("\n");
+}
+
+static void bench_inserts(void) {
+    printf("inserts with eviction, %s sizes\n", mix_names[mix]);
+    printf("%7s %12s %17s\n", "threads", "stores/s", "p50/p99 us");
+    for (int nthreads = 1; nthreads <= max_threads; nthreads *= 2) {
+        double seconds;
+        results_t *res = run(inserts, nthreads, &seconds);
+        printf("%7d %12.0f", nthreads, res->misses.total / seconds);
+        print_latency(&res->misses);
+        printf("\n");
+        free(res);
+    }
+    printf("\n");
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [-n operations] [-t threads] [-k keys] "
+            "[-z exponent]\n"
+            "       [-s small|mixed|large] [-p]\n",
+            prog);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    int c;
+    while ((c = getopt(argc, argv, "n:t:k:z:s:p")) != -1) {
+        switch (c) {
+        case 'n':
+            nops = strtoul(optarg, NULL, 10);
+            break;
+        case 't':
+            max_threads = atoi(optarg);
+            break;
+        case 'k':
+            nkeys = atoi(optarg);
+            break;
+        case 'z':
+            zipf_s = atof(optarg);
+            break;
+        case 's':
+            for (only_mix = 0; only_mix < NMIXES; only_mix++) {
+                if (!strcmp(optarg, mix_names[only_mix])) {
+                    break;
+                }
+            }
+            if (only_mix == NMIXES) {
+                usage(argv[0]);
+            }
+            break;
+        case 'p':
+            use_socketpair = true;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc || nops == 0 || max_threads < 1 || nkeys < 1) {
+        usage(argv[0]);
+    }
+
+    for (int m = 0; m < NMIXES; m++) {
+        if (only_mix >= 0 && m != only_mix) {
+            continue;
+        }
+        mix = (size_mix_t)m;
+        if (zipf_s < 0) {
+            bench_lookups(0);
+            bench_lookups(0.99);
+        } else {
+            bench_lookups(zipf_s);
+        }
+        bench_inserts();
+    }
+    return 0;
+}
@@ -0,0 +1,481 @@
+/**
+ * @file cache_sim.c
+ * @brief Offline simulator of the cache's replacement policy over a trace
+ *
+ * Reads a trace of requests, then replays it against caches of several
+ * capacities and policies, reporting for each the object and byte hit
+ * ratios and the number of evictions. Keys are normalized as the proxy does
+ * (normalize_cache_key), and, as in cache.c, objects larger than the
+ * maximum object size are never stored, and a store first evicts from the
+ * tail until the new object fits. The trace is parsed once and each replay
+ * runs over arrays of key numbers and sizes, so a sweep costs a few
+ * nanoseconds per request and policy.
+ *
+ * Policies:
+ *   - lru: cache.c's; hits move to the head, evictions take the tail;
+ *   - fifo: as lru, but hits do not move;
+ *   - second: lru, storing an object only on its second miss.
+ *
+ * The trace is either lines of "[timestamp] URI size", or JSON lines with
+ * "uri" (or "url") and "size" fields; requests are replayed in the order of
+ * the file. A request whose size differs from the stored object's is a miss
+ * that replaces it.
+ *
+ * usage: cache_sim [-c capacity[,capacity...]] [-m max object size]
+ *                  [-p policy[,policy...]] <trace>
+ */
+
+#include "cache.h"
+#include "hash.h"
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define MAX_CAPACITIES 32
+
+typedef enum { POLICY_LRU, POLICY_FIFO, POLICY_SECOND, NPOLICIES } policy_t;
+
+static const char *policy_names[NPOLICIES] = {"lru", "fifo", "second"};
+
+/*
+ * The trace, as key numbers and sizes
+ */
+static uint32_t *trace_keys = NULL;
+static uint32_t *trace_sizes = NULL;
+static size_t trace_len = 0;
+static size_t trace_cap = 0;
+static uint32_t nkeys = 0;
+
+/*
+ * Table from key hashes to key numbers, open addressing
+ */
+static uint64_t *key_hashes = NULL;
+static uint32_t *key_numbers = NULL;
+static size_t table_size = 0;
+
+/*
+ * State of the cache being simulated, by key number
+ */
+static uint32_t *prev;
+static uint32_t *next;
+static uint32_t *stored_size; // 0 if not cached
+static uint8_t *missed;       // missed once, for the second policy
+
+#define NIL UINT32_MAX
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *xrealloc(void *p, size_t size) {
+    if ((p = realloc(p, size)) == NULL) {
+        perror("realloc");
+        exit(1);
+    }
+    return p;
+}
+
+/*
+ * intern - number a key, giving new keys the next number
+ */
+static uint32_t intern(const char *key) {
+    uint64_t h = xxh64(key, strlen(key), 0);
+    if (h == 0) {
+        h = 1;
+    }
+
+    if (2 * (nkeys + 1) > table_size) {
+        size_t size = table_size > 0 ? 2 * table_size : 1 << 16;
+        uint64_t *hashes = (uint64_t *)calloc(size, sizeof(uint64_t));
+        uint32_t *numbers = (uint32_t *)malloc(size * sizeof(uint32_t));
+        if (hashes == NULL || numbers == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        for (size_t i = 0; i < table_size; i++) {
+            if (key_hashes[i] != 0) {
+                size_t j = key_hashes[i] & (size - 1);
+                while (hashes[j] != 0) {
+                    j = (j + 1) & (size - 1);
+                }
+                hashes[j] = key_hashes[i];
+                numbers[j] = key_numbers[i];
+            }
+        }
+        free(key_hashes);
+        free(key_numbers);
+        key_hashes = hashes;
+        key_numbers = numbers;
+        table_size = size;
+    }
+
+    size_t i = h & (table_size - 1);
+    while (key_hashes[i] != 0 && key_hashes[i] != h) {
+        i = (i + 1) & (table_size - 1);
+    }
+    if (key_hashes[i] == 0) {
+        key_hashes[i] = h;
+        key_numbers[i] = nkeys++;
+    }
+    return key_numbers[i];
+}
+
+/*
+ * json_field - find the value of a field in a JSON line
+ * Returns a pointer to the first character of the value, or NULL.
+ */
+static char *json_field(char *line, const char *name) {
+    char pattern[32];
+    snprintf(pattern, sizeof(pattern), "\"%s\"", name);
+    char *p = strstr(line, pattern);
+    if (p == NULL) {
+        return NULL;
+    }
+    p += strlen(pattern);
+    while (isspace((unsigned char)*p)) {
+        p++;
+    }
+    if (*p != ':') {
+        return NULL;
+    }
+    p++;
+    while (isspace((unsigned char)*p)) {
+        p++;
+    }
+    return p;
+}
+
+/*
+ * parse_line - find the URI and size of a request in a trace line
+ * Returns -1 if the line is not a request.
+ */
+static int parse_line(char *line, char **uri, unsigned long *size) {
+    if (line[0] == '{') {
+        char *value = json_field(line, "uri");
+        if (value == NULL) {
+            value = json_field(line, "url");
+        }
+        char *size_value = json_field(line, "size");
+        if (value == NULL || *value != '"' || size_value == NULL) {
+            return -1;
+        }
+        *uri = value + 1;
+        char *end = strchr(*uri, '"');
+        if (end == NULL) {
+            return -1;
+        }
+        *size = strtoul(size_value, NULL, 10);
+        *end = '\0';
+        return 0;
+    }
+
+    char *fields[3];
+    int nfields = 0;
+    char *saveptr;
+    for (char *tok = strtok_r(line, " \t\r\n", &saveptr);
+         tok != NULL && nfields < 3;
+         tok = strtok_r(NULL, " \t\r\n", &saveptr)) {
+        fields[nfields++] = tok;
+    }
+    if (nfields < 2 || fields[0][0] == '#') {
+        return -1;
+    }
+    *uri = fields[nfields - 2];
+    *size = strtoul(fields[nfields - 1], NULL, 10);
+    return 0;
+}
+
+/*
+ * load_trace - read and number the requests of a trace
+ */
+static void load_trace(const char *path) {
+    FILE *fp = fopen(path, "r");
+    char *line = NULL;
+    size_t line_cap = 0;
+    size_t skipped = 0;
+    char key[MAX_KEY_SIZE];
+
+    if (fp == NULL) {
+        perror(path);
+        exit(1);
+    }
+    while (getline(&line, &line_cap, fp) > 0) {
+        char *uri;
+        unsigned long size;
+        if (parse_line(line, &uri, &size) < 0) {
+            continue;
+        }
+        if (normalize_cache_key(uri, key, sizeof(key)) < 0 ||
+            size > UINT32_MAX) {
+            skipped++;
+            continue;
+        }
+        if (trace_len == trace_cap) {
+            trace_cap = trace_cap > 0 ? 2 * trace_cap : 1 << 16;
+            trace_keys = (uint32_t *)xrealloc(trace_keys,
+                                              trace_cap * sizeof(uint32_t));
+            trace_sizes = (uint32_t *)xrealloc(trace_sizes,
+                                               trace_cap * sizeof(uint32_t));
+        }
+        trace_keys[trace_len] = intern(key);
+        trace_sizes[trace_len] = (uint32_t)size;
+        trace_len++;
+    }
+    free(line);
+    fclose(fp);
+    if (skipped > 0) {
+        fprintf(stderr, "Skipped %zu requests with malformed URIs\n",
+                skipped);
+    }
+}
+
+/* Results of a replay */
+typedef struct results {
+    uint64_t hits;
+    uint64_t hit_bytes;
+    uint64_t total_bytes;
+    uint64_t evictions;
+} results_t;
+
+static uint32_t head;
+static uint32_t tail;
+
+static void unlink_key(uint32_t k) {
+    if (prev[k] == NIL) {
+        head = next[k];
+    } else {
+        next[prev[k]] = next[k];
+    }
+    if (next[k] == NIL) {
+        tail = prev[k];
+    } else {
+        prev[next[k]] = prev[k];
+    }
+}
+
+static void push_head(uint32_t k) {
+    prev[k] = NIL;
+    next[k] = head;
+    if (head != NIL) {
+        prev[head] = k;
+    } else {
+        tail = k;
+    }
+    head = k;
+}
+
+/*
+ * replay - run the trace against one cache
+ */
+static void replay(policy_t policy, uint64_t capacity, uint64_t max_object,
+                   results_t *res) {
+    uint64_t used = 0;
+
+    memset(res, 0, sizeof(*res));
+    memset(stored_size, 0, nkeys * sizeof(uint32_t));
+    memset(missed, 0, nkeys);
+    head = NIL;
+    tail = NIL;
+
+    for (size_t i = 0; i < trace_len; i++) {
+        uint32_t k = trace_keys[i];
+        uint32_t size = trace_sizes[i];
+        res->total_bytes += size;
+
+        if (stored_size[k] == size && size > 0) {
+            res->hits++;
+            res->hit_bytes += size;
+            if (policy != POLICY_FIFO && head != k) {
+                unlink_key(k);
+                push_head(k);
+            }
+            continue;
+        }
+
+        // a changed object replaces the stored one
+        if (stored_size[k] != 0) {
+            unlink_key(k);
+            used -= stored_size[k];
+            stored_size[k] = 0;
+        }
+        if (size > max_object || size == 0) {
+            continue;
+        }
+        if (policy == POLICY_SECOND && !missed[k]) {
+            missed[k] = 1;
+            continue;
+        }
+        if (size > capacity) {
+            continue;
+        }
+
+        used += size;
+        while (used > capacity && tail != NIL) {
+            uint32_t victim = tail;
+            unlink_key(victim);
+            used -= stored_size[victim];
+            stored_size[victim] = 0;
+            res->evictions++;
+        }
+        stored_size[k] = size;
+        push_head(k);
+    }
+}
+
+/*
+ * parse_size - parse a size with an optional K, M or G suffix
+ * Returns 0 if malformed.
+ */
+static uint64_t parse_size(const char *s) {
+    char *end;
+    uint64_t n = strtoull(s, &end, 10);
+    switch (toupper((unsigned char)*end)) {
+    case 'K':
+        n <<= 10;
+        end++;
+        break;
+    case 'M':
+        n <<= 20;
+        end++;
+        break;
+    case 'G':
+        n <<= 30;
+        end++;
+        break;
+    }
+    return *end == '\0' ? n : 0;
+}
+
+static void format_size(uint64_t n, char *buf, size_t len) {
+    if (n >= (1 << 30) && n % (1 << 30) == 0) {
+        snprintf(buf, len, "%luG", (unsigned long)(n >> 30));
+    } else if (n >= (1 << 20) && n % (1 << 20) == 0) {
+        snprintf(buf, len, "%luM", (unsigned long)(n >> 20));
+    } else if (n >= (1 << 10) && n % (1 << 10) == 0) {
+        snprintf(buf, len, "%luK", (unsigned long)(n >> 10));
+    } else {
+        snprintf(buf, len, "%lu", (unsigned long)n);
+    }
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [-c capacity[,capacity...]] [-m max object size]\n"
+            "       [-p policy[,policy...]] <trace>\n"
+            "  sizes take a K, M or G suffix; policies are lru (as in "
+            "cache.c), fifo\n"
+            "  and second (store on the second miss)\n",
+            prog);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    uint64_t capacities[MAX_CAPACITIES];
+    int ncapacities = 0;
+    uint64_t max_object = MAX_OBJECT_SIZE;
+    bool policies[NPOLICIES] = {true, true, true};
+    int c;
+
+    while ((c = getopt(argc, argv, "c:m:p:")) != -1) {
+        switch (c) {
+        case 'c':
+            for (char *tok = strtok(optarg, ","); tok != NULL;
+                 tok = strtok(NULL, ",")) {
+                if (ncapacities == MAX_CAPACITIES ||
+                    (capacities[ncapacities++] = parse_size(tok)) == 0) {
+                    usage(argv[0]);
+                }
+            }
+            break;
+        case 'm':
+            if ((max_object = parse_size(optarg)) == 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'p':
+            memset(policies, 0, sizeof(policies));
+            for (char *tok = strtok(optarg, ","); tok != NULL;
+                 tok = strtok(NULL, ",")) {
+                int p;
+                for (p = 0; p < NPOLICIES; p++) {
+                    if (!strcmp(tok, policy_names[p])) {
+                        policies[p] = true;
+                        break;
+                    }
+                }
+                if (p == NPOLICIES) {
+                    usage(argv[0]);
+                }
+            }
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+    }
+    if (ncapacities == 0) {
+        // from a quarter of MAX_CACHE_SIZE to 64 times it
+        for (uint64_t n = MAX_CACHE_SIZE / 4; n <= 64 * MAX_CACHE_SIZE;
+             n *= 2) {
+            capacities[ncapacities++] = n;
+        }
+    }
+
+    double start = now();
+    load_trace(argv[optind]);
+    printf("%zu requests for %u keys, read in %.2f s\n", trace_len, nkeys,
+           now() - start);
+    if (trace_len == 0) {
+        return 1;
+    }
+    size_t too_large = 0;
+    for (size_t i = 0; i < trace_len; i++) {
+        too_large += trace_sizes[i] > max_object;
+    }
+    if (too_large > 0) {
+        printf("%zu requests for objects over the maximum size\n",
+               too_large);
+    }
+
+    prev = (uint32_t *)malloc(nkeys * sizeof(uint32_t));
+    next = (uint32_t *)malloc(nkeys * sizeof(uint32_t));
+    stored_size = (uint32_t *)malloc(nkeys * sizeof(uint32_t));
+    missed = (uint8_t *)malloc(nkeys);
+    if (prev == NULL || next == NULL || stored_size == NULL ||
+        missed == NULL) {
+        perror("malloc");
+        return 1;
+    }
+
+    printf("%-7s %9s %8s %8s %12s %10s\n", "policy", "capacity", "hit%",
+           "byte%", "evictions", "Mreq/s");
+    for (int p = 0; p < NPOLICIES; p++) {
+        if (!policies[p]) {
+            continue;
+        }
+        for (int i = 0; i < ncapacities; i++) {
+            results_t res;
+            char capacity[32];
+            start = now();
+            replay((policy_t)p, capacities[i], max_object, &res);
+            double seconds = now() - start;
+            format_size(capacities[i], capacity, sizeof(capacity));
+            printf("%-7s %9s %7.2f%% %7.2f%% %12lu %10.1f\n",
+                   policy_names[p], capacity,
+                   100.0 * res.hits / trace_len,
+                   res.total_bytes > 0
+                       ? 100.0 * res.hit_bytes / res.total_bytes
+                       : 0.0,
+                   (unsigned long)res.evictions, trace_len / seconds / 1e6);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,154 @@
+/**
+ * @file hit_bench.c
+ * @brief Benchmark of sending cache hits by copy and by sendfile
+ *
+ * Stores an object of each size twice, once as a heap body and once in a
+ * memfd, then serves hits of each over a loopback TCP connection to a thread
+ * that drains it. Reports hits per second and bytes per second of CPU time
+ * of the sending thread, so per core, for:
+ *   - copy: writev() of the header block and the body from user space;
+ *   - sendfile: the header block with send(), the body with sendfile().
+ *
+ * usage: hit_bench [-n hits]
+ */
+
+#include "cache.h"
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+static const ssize_t sizes[] = {16 * 1024, 32 * 1024, 48 * 1024, 64 * 1024,
+                                96 * 1024};
+
+#define NSIZES (sizeof(sizes) / sizeof(sizes[0]))
+
+static double thread_cpu(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * drain - read and discard everything sent on the connection
+ */
+static void *drain(void *vargp) {
+    int fd = *(int *)vargp;
+    static char buf[256 * 1024];
+    while (read(fd, buf, sizeof(buf)) > 0) {
+    }
+    return NULL;
+}
+
+/*
+ * connect_pair - make a loopback TCP connection, returning both ends
+ */
+static void connect_pair(int *client, int *server) {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    int listenfd = socket(AF_INET, SOCK_STREAM, 0);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (listenfd < 0 || bind(listenfd, (struct sockaddr *)&addr, len) < 0 ||
+        listen(listenfd, 1) < 0 ||
+        getsockname(listenfd, (struct sockaddr *)&addr, &len) < 0) {
+        perror("listen");
+        exit(1);
+    }
+    *client = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(*client, (struct sockaddr *)&addr, len) < 0 ||
+        (*server = accept(listenfd, NULL, NULL)) < 0) {
+        perror("connect");
+        exit(1);
+    }
+    close(listenfd);
+}
+
+/*
+ * store - cache an object with a body of the given size under a key
+ */
+static void store(const char *uri, ssize_t size) {
+    char *object = (char *)malloc(size + MAXLINE);
+    int n = snprintf(object, MAXLINE,
+                     "HTTP/1.0 200 OK\r\nContent-Type: application/"
+                     "octet-stream\r\nContent-Length: %zd\r\n\r\n",
+                     size);
+    for (ssize_t i = 0; i < size; i++) {
+        object[n + i] = (char)(i * 131 + i / 7);
+    }
+    write_cache(uri, "", object, n + size, NULL);
+    free(object);
+}
+
+/*
+ * run - serve hits of a key, reporting CPU-time throughput
+ */
+static void run(const char *name, const char *uri, int fd, unsigned long n) {
+    size_t bytes = 0;
+    double start = thread_cpu();
+    for (unsigned long i = 0; i < n; i++) {
+        ssize_t sent = read_cache(uri, "", fd);
+        if (sent < 0) {
+            fprintf(stderr, "%s: miss\n", uri);
+            exit(1);
+        }
+        bytes += sent;
+    }
+    double seconds = thread_cpu() - start;
+    printf("%-9s %10.0f hits/s %9.1f MB/s per core\n", name, n / seconds,
+           bytes / seconds / 1e6);
+}
+
+int main(int argc, char **argv) {
+    unsigned long n = 20000;
+    int c;
+
+    while ((c = getopt(argc, argv, "n:")) != -1) {
+        switch (c) {
+        case 'n':
+            n = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n hits]\n", argv[0]);
+            exit(1);
+        }
+    }
+
+    int client;
+    int server;
+    pthread_t tid;
+    connect_pair(&client, &server);
+    pthread_create(&tid, NULL, drain, &client);
+
+    init_cache();
+    for (size_t i = 0; i < NSIZES; i++) {
+        char copy_uri[MAXLINE];
+        char sendfile_uri[MAXLINE];
+        snprintf(copy_uri, sizeof(copy_uri), "http://bench/copy/%zd",
+                 sizes[i]);
+        snprintf(sendfile_uri, sizeof(sendfile_uri),
+                 "http://bench/sendfile/%zd", sizes[i]);
+        cache_set_sendfile(false);
+        store(copy_uri, sizes[i]);
+        cache_set_sendfile(true);
+        store(sendfile_uri, sizes[i]);
+
+        printf("%zd KB bodies%s\n", sizes[i] / 1024,
+               sizes[i] < SENDFILE_MIN_SIZE ? " (below SENDFILE_MIN_SIZE)"
+                                            : "");
+        run("copy", copy_uri, server, n);
+        run("sendfile", sendfile_uri, server, n);
+    }
+
+    shutdown(server, SHUT_WR);
+    pthread_join(tid, NULL);
+    return 0;
+}
@@ -0,0 +1,545 @@
+/**
+ * @file loadgen.c
+ * @brief Load generator for the proxy
+ *
+ * Drives the proxy with GET requests for URLs of tiny's /gen, or URLs
+ * replayed from a trace, chosen uniformly or with Zipf popularity. Each
+ * thread keeps one request in flight at a time; with -r, the threads send
+ * on a fixed schedule instead, and latency is measured from when a request
+ * was due rather than when it went out, so that a stalled proxy cannot hide
+ * its queueing delay. Reports throughput, hit ratio and latency
+ * percentiles.
+ *
+ * A response is counted as a hit if its hit header (by default X-Gen-Id,
+ * which tiny numbers uniquely in every /gen response) carries a value
+ * already seen: the origin never sends the same one twice, so the response
+ * was replayed from a cache.
+ *
+ * usage: loadgen [-c threads] [-r rate] [-d seconds] [-u urls]
+ *                [-z exponent | -t trace] [-o origin] [-s size]
+ *                [-H header] <proxy host> <proxy port>
+ */
+
+#include "histogram.h"
+
+#include <math.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_URL 2048
+#define HEADER_BUF 8192
+
+/*
+ * Settings, from the command line
+ */
+static int nthreads = 8;
+static double rate = 0;       // requests per second, 0 for closed loop
+static double duration = 10;  // seconds
+static int nurls = 1000;      // number of /gen URLs
+static double zipf_s = 0;     // Zipf exponent, 0 for uniform
+static const char *trace = NULL;
+static const char *origin = "127.0.0.1:8000";
+static long object_size = 4096;
+static const char *hit_header = "X-Gen-Id";
+
+/*
+ * Requests to send, one per URL, and how to pick the next
+ */
+static char **requests;
+static size_t *request_lens;
+static double *zipf_cdf = NULL; // cumulative probabilities, if Zipf
+static unsigned long trace_next = 0;
+
+static struct addrinfo *proxy_addr;
+static volatile bool stopping = false;
+
+/*
+ * Set of hit header values seen, as 64-bit hashes
+ */
+static uint64_t *seen = NULL;
+static size_t seen_size = 0;
+static size_t seen_count = 0;
+static pthread_mutex_t seen_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Results of a thread */
+typedef struct results {
+    histogram_t latency; // microseconds
+    uint64_t requests;
+    uint64_t errors;  // requests without a response
+    uint64_t ok;      // 2xx responses
+    uint64_t tagged;  // responses with the hit header
+    uint64_t hits;    // responses whose hit header was seen before
+} results_t;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * xorshift - next number of a thread's generator
+ */
+static uint64_t xorshift(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+static uint64_t fnv1a(const char *s, size_t len) {
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)s[i]) * 1099511628211ULL;
+    }
+    return h != 0 ? h : 1;
+}
+
+/*
+ * seen_before - add a hit header value to the set
+ * Returns true if it was already there.
+ */
+static bool seen_before(const char *value, size_t len) {
+    uint64_t h = fnv1a(value, len);
+    bool found = false;
+
+    pthread_mutex_lock(&seen_mutex);
+    if (2 * (seen_count + 1) > seen_size) {
+        size_t size = seen_size > 0 ? 2 * seen_size : 1 << 16;
+        uint64_t *table = (uint64_t *)calloc(size, sizeof(uint64_t));
+        if (table == NULL) {
+            pthread_mutex_unlock(&seen_mutex);
+            return false;
+        }
+        for (size_t i = 0; i < seen_size; i++) {
+            if (seen[i] != 0) {
+                size_t j = seen[i] & (size - 1);
+                while (table[j] != 0) {
+                    j = (j + 1) & (size - 1);
+                }
+                table[j] = seen[i];
+            }
+        }
+        free(seen);
+        seen = table;
+        seen_size = size;
+    }
+
+    size_t i = h & (seen_size - 1);
+    while (seen[i] != 0 && seen[i] != h) {
+        i = (i + 1) & (seen_size - 1);
+    }
+    if (seen[i] == h) {
+        found = true;
+    } else {
+        seen[i] = h;
+        seen_count++;
+    }
+    pthread_mutex_unlock(&seen_mutex);
+    return found;
+}
+
+/*
+ * add_request - render the request for a URL
+ */
+static int add_request(int i, const char *url) {
+    const char *host = strstr(url, "://");
+    host = host != NULL ? host + 3 : url;
+    size_t host_len = strcspn(host, "/");
+
+    char buf[MAX_URL + 256];
+    int len = snprintf(buf, sizeof(buf),
+                       "GET %s HTTP/1.0\r\nHost: %.*s\r\n\r\n", url,
+                       (int)host_len, host);
+    if (len < 0 || (size_t)len >= sizeof(buf) ||
+        (requests[i] = strdup(buf)) == NULL) {
+        return -1;
+    }
+    request_lens[i] = len;
+    return 0;
+}
+
+/*
+ * load_urls - make the /gen URLs, or read the trace
+ */
+static int load_urls(void) {
+    char url[MAX_URL];
+    FILE *fp = NULL;
+
+    if (trace != NULL) {
+        if ((fp = fopen(trace, "r")) == NULL) {
+            perror(trace);
+            return -1;
+        }
+        nurls = 0;
+        while (fgets(url, sizeof(url), fp) != NULL) {
+            if (url[0] != '#' && url[0] != '\n') {
+                nurls++;
+            }
+        }
+        rewind(fp);
+    }
+    if (nurls <= 0) {
+        fprintf(stderr, "No URLs\n");
+        return -1;
+    }
+
+    requests = (char **)calloc(nurls, sizeof(char *));
+    request_lens = (size_t *)calloc(nurls, sizeof(size_t));
+    if (requests == NULL || request_lens == NULL) {
+        return -1;
+    }
+    for (int i = 0; i < nurls; i++) {
+        if (fp != NULL) {
+            do {
+                if (fgets(url, sizeof(url), fp) == NULL) {
+                    return -1;
+                }
+            } while (url[0] == '#' || url[0] == '\n');
+            url[strcspn(url, "\r\n")] = '\0';
+        } else {
+            snprintf(url, sizeof(url), "http://%s/gen?size=%ld&seed=%d",
+                     origin, object_size, i);
+        }
+        if (add_request(i, url) < 0) {
+            return -1;
+        }
+    }
+    if (fp != NULL) {
+        fclose(fp);
+    }
+    return 0;
+}
+
+/*
+ * init_zipf - tabulate the cumulative Zipf distribution over the URLs, the
+ * first the most popular
+ */
+static int init_zipf(void) {
+    zipf_cdf = (double *)malloc(nurls * sizeof(double));
+    if (zipf_cdf == NULL) {
+        return -1;
+    }
+    double sum = 0;
+    for (int i = 0; i < nurls; i++) {
+        sum += 1.0 / pow(i + 1, zipf_s);
+        zipf_cdf[i] = sum;
+    }
+    for (int i = 0; i < nurls; i++) {
+        zipf_cdf[i] /= sum;
+    }
+    return 0;
+}
+
+/*
+ * next_url - pick the URL of the next request
+ */
+static int next_url(uint64_t *rng) {
+    if (trace != NULL) {
+        return __atomic_fetch_add(&trace_next, 1, __ATOMIC_RELAXED) % nurls;
+    }
+    if (zipf_cdf == NULL) {
+        return xorshift(rng) % nurls;
+    }
+    double u = (xorshift(rng) >> 11) * (1.0 / 9007199254740992.0);
+    int lo = 0;
+    int hi = nurls - 1;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (zipf_cdf[mid] < u) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/*
+ * scan_header - find the status and the hit header in a response's header
+ * block
+ */
+static void scan_header(const char *header, size_t len, results_t *res) {
+    int status = 0;
+    if (sscanf(header, "HTTP/%*d.%*d %d", &status) == 1 && status >= 200 &&
+        status < 300) {
+        res->ok++;
+    }
+
+    size_t name_len = strlen(hit_header);
+    const char *end = header + len;
+    const char *line = memchr(header, '\n', len);
+    while (line != NULL && ++line < end) {
+        const char *eol = memchr(line, '\n', end - line);
+        if (eol == NULL) {
+            break;
+        }
+        if ((size_t)(eol - line) > name_len && line[name_len] == ':' &&
+            strncasecmp(line, hit_header, name_len) == 0) {
+            const char *value = line + name_len + 1;
+            while (value < eol && *value == ' ') {
+                value++;
+            }
+            const char *value_end = eol;
+            while (value_end > value && (value_end[-1] == '\r' ||
+                                         value_end[-1] == ' ')) {
+                value_end--;
+            }
+            res->tagged++;
+            if (seen_before(value, value_end - value)) {
+                res->hits++;
+            }
+            return;
+        }
+        line = eol;
+    }
+}
+
+/*
+ * send_request - send one request through the proxy and read the whole
+ * response
+ * Returns -1 if no response came.
+ */
+static int send_request(int i, results_t *res) {
+    char header[HEADER_BUF];
+    char discard[65536];
+    size_t header_len = 0;
+    bool header_done = false;
+    ssize_t n;
+
+    int fd = socket(proxy_addr->ai_family, proxy_addr->ai_socktype,
+                    proxy_addr->ai_protocol);
+    if (fd < 0) {
+        return -1;
+    }
+    if (connect(fd, proxy_addr->ai_addr, proxy_addr->ai_addrlen) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    size_t sent = 0;
+    while (sent < request_lens[i]) {
+        if ((n = write(fd, requests[i] + sent, request_lens[i] - sent)) <=
+            0) {
+            close(fd);
+            return -1;
+        }
+        sent += n;
+    }
+
+    // keep the start of the response until the header block is complete,
+    // and throw the rest away
+    while (true) {
+        char *dst = header_done ? discard : header + header_len;
+        size_t room =
+            header_done ? sizeof(discard) : sizeof(header) - 1 - header_len;
+        if ((n = read(fd, dst, room)) <= 0) {
+            break;
+        }
+        if (!header_done) {
+            header_len += n;
+            header[header_len] = '\0';
+            if (strstr(header, "\r\n\r\n") != NULL ||
+                header_len == sizeof(header) - 1) {
+                header_done = true;
+            }
+        }
+    }
+    close(fd);
+
+    if (header_len == 0 || n < 0) {
+        return -1;
+    }
+    scan_header(header, header_len, res);
+    return 0;
+}
+
+/*
+ * run - thread routine, sending requests until the run is over
+ */
+static void *run(void *vargp) {
+    long id = (long)vargp;
+    results_t *res = (results_t *)calloc(1, sizeof(results_t));
+    uint64_t rng = 0x9E3779B97F4A7C15ULL * (id + 1);
+    double interval = rate > 0 ? nthreads / rate : 0;
+    double due = now() + interval * id / nthreads;
+
+    if (res == NULL) {
+        return NULL;
+    }
+    while (!stopping) {
+        double start;
+        if (rate > 0) {
+            // open loop: wait until the request is due, and charge it any
+            // time it spent overdue
+            double wait = due - now();
+            if (wait > 0) {
+                struct timespec ts = {(time_t)wait,
+                                      (long)((wait - (time_t)wait) * 1e9)};
+                nanosleep(&ts, NULL);
+            }
+            start = due;
+            due += interval;
+        } else {
+            start = now();
+        }
+        if (stopping) {
+            break;
+        }
+
+        res->requests++;
+        if (send_request(next_url(&rng), res) < 0) {
+            res->errors++;
+            continue;
+        }
+        histogram_record(&res->latency, (uint64_t)((now() - start) * 1e6));
+    }
+    return res;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [-c threads] [-r rate] [-d seconds] [-u urls]\n"
+            "       [-z exponent | -t trace] [-o origin] [-s size]\n"
+            "       [-H header] <proxy host> <proxy port>\n",
+            prog);
+    fprintf(stderr, "  -c  threads, each with a request in flight (8)\n");
+    fprintf(stderr, "  -r  requests per second in all, on a fixed schedule;"
+                    " by default as fast as\n      responses come\n");
+    fprintf(stderr, "  -d  seconds to run (10)\n");
+    fprintf(stderr, "  -u  number of distinct /gen URLs (1000)\n");
+    fprintf(stderr, "  -z  Zipf exponent of URL popularity; by default "
+                    "uniform\n");
+    fprintf(stderr, "  -t  file of URLs, one per line, replayed in order\n");
+    fprintf(stderr, "  -o  host:port of the tiny serving /gen "
+                    "(127.0.0.1:8000)\n");
+    fprintf(stderr, "  -s  size of the /gen objects (4096)\n");
+    fprintf(stderr, "  -H  header unique to each origin response "
+                    "(X-Gen-Id)\n");
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    int c;
+    while ((c = getopt(argc, argv, "c:r:d:u:z:t:o:s:H:")) != -1) {
+        switch (c) {
+        case 'c':
+            nthreads = atoi(optarg);
+            break;
+        case 'r':
+            rate = atof(optarg);
+            break;
+        case 'd':
+            duration = atof(optarg);
+            break;
+        case 'u':
+            nurls = atoi(optarg);
+            break;
+        case 'z':
+            zipf_s = atof(optarg);
+            break;
+        case 't':
+            trace = optarg;
+            break;
+        case 'o':
+            origin = optarg;
+            break;
+        case 's':
+            object_size = atol(optarg);
+            break;
+        case 'H':
+            hit_header = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 2 || nthreads < 1 || rate < 0 || duration <= 0 ||
+        zipf_s < 0 || object_size < 0) {
+        usage(argv[0]);
+    }
+
+    // a proxy shedding load answers and closes without reading the request,
+    // which must not kill the run
+    signal(SIGPIPE, SIG_IGN);
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    int rc = getaddrinfo(argv[optind], argv[optind + 1], &hints, &proxy_addr);
+    if (rc != 0) {
+        fprintf(stderr, "%s: %s\n", argv[optind], gai_strerror(rc));
+        return 1;
+    }
+    if (load_urls() < 0 || (zipf_s > 0 && trace == NULL && init_zipf() < 0)) {
+        return 1;
+    }
+
+    pthread_t *tids = (pthread_t *)malloc(nthreads * sizeof(pthread_t));
+    if (tids == NULL) {
+        return 1;
+    }
+    double start = now();
+    for (long i = 0; i < nthreads; i++) {
+        if (pthread_create(&tids[i], NULL, run, (void *)i) != 0) {
+            fprintf(stderr, "Failed to start thread %ld\n", i);
+            return 1;
+        }
+    }
+    struct timespec ts = {(time_t)duration,
+                          (long)((duration - (time_t)duration) * 1e9)};
+    nanosleep(&ts, NULL);
+    stopping = true;
+
+    results_t *total = (results_t *)calloc(1, sizeof(results_t));
+    if (total == NULL) {
+        return 1;
+    }
+    for (int i = 0; i < nthreads; i++) {
+        results_t *res;
+        pthread_join(tids[i], (void **)&res);
+        if (res != NULL) {
+            histogram_merge(&total->latency, &res->latency);
+            total->requests += res->requests;
+            total->errors += res->errors;
+            total->ok += res->ok;
+            total->tagged += res->tagged;
+            total->hits += res->hits;
+            free(res);
+        }
+    }
+    double elapsed = now() - start;
+
+    uint64_t responses = total->requests - total->errors;
+    printf("requests  %lu in %.2f s, %.1f/s, %lu without a response\n",
+           (unsigned long)total->requests, elapsed,
+           responses / elapsed, (unsigned long)total->errors);
+    printf("status    %lu 2xx, %lu other\n", (unsigned long)total->ok,
+           (unsigned long)(responses - total->ok));
+    if (total->tagged > 0) {
+        printf("hits      %lu of %lu with %s (%.1f%%)\n",
+               (unsigned long)total->hits, (unsigned long)total->tagged,
+               hit_header, 100.0 * total->hits / total->tagged);
+    } else {
+        printf("hits      unknown, no response had %s\n", hit_header);
+    }
+    histogram_t *h = &total->latency;
+    printf("latency   mean %.3f, p50 %.3f, p90 %.3f, p99 %.3f, p99.9 %.3f, "
+           "max %.3f ms\n",
+           histogram_mean(h) / 1000, histogram_percentile(h, 50) / 1000.0,
+           histogram_percentile(h, 90) / 1000.0,
+           histogram_percentile(h, 99) / 1000.0,
+           histogram_percentile(h, 99.9) / 1000.0, h->max / 1000.0);
+    return 0;
+}
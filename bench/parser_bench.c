@@ -0,0 +1,222 @@
+/**
+ * @file parser_bench.c
+ * @brief Benchmark of the HTTP parser against a parser library
+ *
+ * Parses a set of browser-like requests repeatedly and reports the time per
+ * request for:
+ *   - lines: the line-at-a-time use of the original proxy, each line copied
+ *     out of the receive buffer before parser_parse_line(), then the host,
+ *     port and path retrieved as strings;
+ *   - whole: parser_parse() on the receive buffer, values taken as views;
+ *   - pieces: the same, with the request arriving in 64-byte pieces;
+ *   - ref: the lines case against another build of the parser API, such as
+ *     the course's libhttp_parser.so, loaded with -r.
+ *
+ * usage: parser_bench [-n iterations] [-r libhttp_parser.so]
+ */
+
+#define _GNU_SOURCE
+#include "http_parser.h"
+
+#include <dlfcn.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PIECE 64
+
+static const char *requests[] = {
+    "GET http://localhost:15213/home.html HTTP/1.1\r\n"
+    "Host: localhost:15213\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:3.10.0) Gecko/20191101 "
+    "Firefox/63.0.1\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,"
+    "*/*;q=0.8\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate\r\n"
+    "Connection: keep-alive\r\n"
+    "Proxy-Connection: keep-alive\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "Cache-Control: max-age=0\r\n\r\n",
+
+    "GET http://www.cs.cmu.edu/~213/schedule.html HTTP/1.0\r\n"
+    "Host: www.cs.cmu.edu\r\n"
+    "Cookie: session=8f2b6c1e0d9a47b3a5c2e1f0d9b8a7c6; theme=dark; "
+    "_ga=GA1.2.1234567890.1234567890\r\n"
+    "Referer: http://www.cs.cmu.edu/~213/index.html\r\n"
+    "If-Modified-Since: Mon, 05 Oct 2020 14:00:00 GMT\r\n"
+    "If-None-Match: \"5f7b2a10-3c4d\"\r\n\r\n",
+
+    "GET http://10.0.0.1:8080/cgi-bin/adder?15213&18213 HTTP/1.1\r\n"
+    "Host: 10.0.0.1:8080\r\n"
+    "Range: bytes=0-1023\r\n\r\n",
+};
+
+#define NREQUESTS (sizeof(requests) / sizeof(requests[0]))
+
+/* The parser API, from this build or from the library given with -r */
+typedef struct parser_api {
+    parser_t *(*new)(void);
+    void (*free)(parser_t *);
+    parser_state (*parse_line)(parser_t *, const char *);
+    int (*retrieve)(parser_t *, parser_value_type, const char **);
+    header_t *(*lookup_header)(parser_t *, const char *);
+} parser_api_t;
+
+static volatile size_t sink;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * bench_lines - parse a line at a time, as the proxy used to
+ */
+static void bench_lines(parser_api_t *api, const char *request) {
+    char line[PARSER_MAXLINE];
+    const char *p = request;
+    parser_t *parser = api->new();
+    const char *host;
+    const char *port;
+    const char *path;
+
+    while (*p != '\0') {
+        const char *eol = strchr(p, '\n');
+        size_t n = eol + 1 - p;
+        memcpy(line, p, n);
+        line[n] = '\0';
+        p = eol + 1;
+        if (n == 2) {
+            break;
+        }
+        if (api->parse_line(parser, line) == ERROR) {
+            fprintf(stderr, "parse error\n");
+            exit(1);
+        }
+    }
+    api->retrieve(parser, HOST, &host);
+    api->retrieve(parser, PORT, &port);
+    api->retrieve(parser, PATH, &path);
+    header_t *h = api->lookup_header(parser, "Host");
+    sink += strlen(host) + strlen(port) + strlen(path) + (h != NULL);
+    api->free(parser);
+}
+
+/*
+ * bench_views - parse the receive buffer in place, arriving in pieces of the
+ * given size
+ */
+static void bench_views(const char *request, size_t len, size_t piece) {
+    parser_t *parser = parser_new();
+    parser_state state = INCOMPLETE;
+    parser_view_t host;
+    parser_view_t path;
+
+    for (size_t have = piece; state == INCOMPLETE; have += piece) {
+        state = parser_parse(parser, request, have < len ? have : len);
+    }
+    if (state != DONE) {
+        fprintf(stderr, "parse error\n");
+        exit(1);
+    }
+    parser_retrieve_view(parser, HOST, &host);
+    parser_retrieve_view(parser, PATH, &path);
+    const header_view_t *h;
+    for (size_t i = 0; (h = parser_header_view(parser, i)) != NULL; i++) {
+        sink += h->value.length;
+    }
+    sink += host.length + path.length;
+    parser_free(parser);
+}
+
+/*
+ * report - print the time per request and throughput of a run
+ */
+static void report(const char *name, double seconds, unsigned long n,
+                   size_t bytes) {
+    printf("%-8s %8.1f ns/request %8.1f MB/s\n", name, seconds * 1e9 / n,
+           bytes / seconds / 1e6);
+}
+
+int main(int argc, char **argv) {
+    unsigned long iterations = 1000000;
+    const char *ref_path = NULL;
+    int c;
+
+    while ((c = getopt(argc, argv, "n:r:")) != -1) {
+        switch (c) {
+        case 'n':
+            iterations = strtoul(optarg, NULL, 10);
+            break;
+        case 'r':
+            ref_path = optarg;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n iterations] [-r library]\n",
+                    argv[0]);
+            exit(1);
+        }
+    }
+
+    size_t lens[NREQUESTS];
+    size_t bytes = 0;
+    for (size_t i = 0; i < NREQUESTS; i++) {
+        lens[i] = strlen(requests[i]);
+        bytes += lens[i];
+    }
+    bytes = bytes * (iterations / NREQUESTS);
+    unsigned long n = iterations / NREQUESTS * NREQUESTS;
+
+    parser_api_t ours = {parser_new, parser_free, parser_parse_line,
+                         parser_retrieve, parser_lookup_header};
+    double start = now();
+    for (unsigned long i = 0; i < n; i++) {
+        bench_lines(&ours, requests[i % NREQUESTS]);
+    }
+    report("lines", now() - start, n, bytes);
+
+    start = now();
+    for (unsigned long i = 0; i < n; i++) {
+        bench_views(requests[i % NREQUESTS], lens[i % NREQUESTS], SIZE_MAX);
+    }
+    report("whole", now() - start, n, bytes);
+
+    start = now();
+    for (unsigned long i = 0; i < n; i++) {
+        bench_views(requests[i % NREQUESTS], lens[i % NREQUESTS], PIECE);
+    }
+    report("pieces", now() - start, n, bytes);
+
+    if (ref_path != NULL) {
+        // deep binding keeps the library's calls to itself from resolving to
+        // this program's parser
+        void *lib = dlopen(ref_path, RTLD_NOW | RTLD_LOCAL | RTLD_DEEPBIND);
+        if (lib == NULL) {
+            fprintf(stderr, "%s\n", dlerror());
+            exit(1);
+        }
+        parser_api_t ref;
+        *(void **)&ref.new = dlsym(lib, "parser_new");
+        *(void **)&ref.free = dlsym(lib, "parser_free");
+        *(void **)&ref.parse_line = dlsym(lib, "parser_parse_line");
+        *(void **)&ref.retrieve = dlsym(lib, "parser_retrieve");
+        *(void **)&ref.lookup_header = dlsym(lib, "parser_lookup_header");
+        if (ref.new == NULL || ref.free == NULL || ref.parse_line == NULL ||
+            ref.retrieve == NULL || ref.lookup_header == NULL) {
+            fprintf(stderr, "%s: missing parser functions\n", ref_path);
+            exit(1);
+        }
+
+        start = now();
+        for (unsigned long i = 0; i < n; i++) {
+            bench_lines(&ref, requests[i % NREQUESTS]);
+        }
+        report("ref", now() - start, n, bytes);
+    }
+    return 0;
+}
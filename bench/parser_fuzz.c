@@ -0,0 +1,365 @@
+/**
+ * @file parser_fuzz.c
+ * @brief Fuzzer for the incremental HTTP parser
+ *
+ * Every input is parsed three ways, which must agree:
+ *   - in one call to parser_parse() on the whole input;
+ *   - incrementally, fed in pieces of random size through a buffer that is
+ *     moved before every call, as a growing receive buffer would be;
+ *   - a line at a time through parser_parse_line(), for inputs that parse;
+ *   - in pieces again by a parser allocating from an arena.
+ * All views must lie within the head of the request, and the strings given
+ * out by parser_retrieve() and the header_t functions must equal the views.
+ *
+ * Inputs are generated well-formed requests, three quarters of them mutated
+ * by flipping, inserting, deleting and duplicating bytes. Built with
+ * -DLIBFUZZER -fsanitize=fuzzer (clang), the harness is driven by libFuzzer
+ * instead.
+ *
+ * usage: parser_fuzz [-n iterations] [-s seed]
+ */
+
+#include "arena.h"
+#include "http_parser.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#define MAX_INPUT 8192
+
+static const char *methods[] = {"GET", "POST", "HEAD", "get"};
+static const char *schemes[] = {"http", "https", "HTTP", "ftp"};
+static const char *hosts[] = {"localhost", "www.cmu.edu", "10.0.0.1", "[::1]",
+                              "a"};
+static const char *ports[] = {"", ":80", ":8080", ":", ":99999"};
+static const char *paths[] = {"",         "/",          "/index.html",
+                              "/a/b?c=d", "?q",         "#frag",
+                              "/%20 x",   "/cgi-bin/adder?1&2"};
+static const char *versions[] = {"HTTP/1.0", "HTTP/1.1", "HTTP/2"};
+static const char *names[] = {"Host",       "User-Agent", "Accept",
+                              "Connection", "Range",      "X-Custom-Header",
+                              "A"};
+static const char *values[] = {"",   "close", "  spaced  ", "bytes=0-10",
+                               ":",  "\t",    "a:b:c",      "text/html, */*"};
+static const char *endings[] = {"\r\n", "\n", "\r\n", "\r\n"};
+
+#define PICK(a) (a[rand() % (sizeof(a) / sizeof(a[0]))])
+
+static unsigned long checks = 0;
+
+/*
+ * fail - report a disagreement on an input and abort
+ */
+static void fail(const char *what, const char *data, size_t len) {
+    fprintf(stderr, "parser_fuzz: %s on input of %zu bytes:\n", what, len);
+    fwrite(data, 1, len, stderr);
+    fprintf(stderr, "\n");
+    abort();
+}
+
+/*
+ * generate - write a random, mostly well-formed request head into buf
+ */
+static size_t generate(char *buf, size_t cap) {
+    size_t len = snprintf(buf, cap, "%s %s://%s%s%s %s%s", PICK(methods),
+                          PICK(schemes), PICK(hosts), PICK(ports), PICK(paths),
+                          PICK(versions), PICK(endings));
+    int nheaders = rand() % 24;
+    for (int i = 0; i < nheaders && len < cap; i++) {
+        len += snprintf(buf + len, cap - len, "%s:%s%s%s", PICK(names),
+                        rand() % 2 ? " " : "", PICK(values), PICK(endings));
+    }
+    if (len < cap && rand() % 8) {
+        len += snprintf(buf + len, cap - len, "%s", PICK(endings));
+    }
+    return len < cap ? len : cap - 1;
+}
+
+/*
+ * mutate - apply a few random edits to buf
+ */
+static size_t mutate(char *buf, size_t len, size_t cap) {
+    int nedits = rand() % 4;
+    for (int i = 0; i < nedits; i++) {
+        size_t pos = len > 0 ? rand() % len : 0;
+        switch (rand() % 4) {
+        case 0: // flip a byte
+            if (len > 0) {
+                buf[pos] = rand() % 4 ? "\r\n: \t\0"[rand() % 6] : rand();
+            }
+            break;
+        case 1: // insert a byte
+            if (len < cap) {
+                memmove(buf + pos + 1, buf + pos, len - pos);
+                buf[pos] = "\r\n: \t\0"[rand() % 6];
+                len++;
+            }
+            break;
+        case 2: // delete a byte
+            if (len > 0) {
+                memmove(buf + pos, buf + pos + 1, len - pos - 1);
+                len--;
+            }
+            break;
+        default: // duplicate the tail
+            if (len + (len - pos) <= cap) {
+                memcpy(buf + len, buf + pos, len - pos);
+                len += len - pos;
+            }
+            break;
+        }
+    }
+    return len;
+}
+
+/*
+ * check_view - check that a view lies within the head
+ */
+static void check_view(parser_view_t view, size_t head, const char *data,
+                       size_t len) {
+    if (view.offset > head || view.length > head - view.offset) {
+        fail("view outside the head", data, len);
+    }
+    checks++;
+}
+
+/*
+ * same_view - check whether two parsers recorded the same bytes for a view
+ */
+static bool same_view(const char *a, parser_view_t va, const char *b,
+                      parser_view_t vb) {
+    return va.length == vb.length &&
+           !memcmp(a + va.offset, b + vb.offset, va.length);
+}
+
+/*
+ * compare - check that two parsers parsed the same values and headers
+ */
+static void compare(parser_t *p, const char *pbuf, parser_t *q,
+                    const char *qbuf, const char *data, size_t len) {
+    for (int type = METHOD; type <= HTTP_VERSION; type++) {
+        parser_view_t vp;
+        parser_view_t vq;
+        int rp = parser_retrieve_view(p, type, &vp);
+        int rq = parser_retrieve_view(q, type, &vq);
+        if (rp != rq || (rp == 0 && !same_view(pbuf, vp, qbuf, vq))) {
+            fail("values differ", data, len);
+        }
+    }
+    for (size_t i = 0;; i++) {
+        const header_view_t *hp = parser_header_view(p, i);
+        const header_view_t *hq = parser_header_view(q, i);
+        if ((hp == NULL) != (hq == NULL)) {
+            fail("header counts differ", data, len);
+        }
+        if (hp == NULL) {
+            break;
+        }
+        if (!same_view(pbuf, hp->name, qbuf, hq->name) ||
+            !same_view(pbuf, hp->value, qbuf, hq->value)) {
+            fail("headers differ", data, len);
+        }
+    }
+    checks++;
+}
+
+/*
+ * check_strings - check the C string API of parser s against the views of
+ * parser p, which parsed buf
+ */
+static void check_strings(parser_t *p, const char *buf, parser_t *s,
+                          const char *data, size_t len) {
+    for (int type = METHOD; type <= HTTP_VERSION; type++) {
+        parser_view_t view;
+        const char *val;
+        if (parser_retrieve_view(p, type, &view) == 0 &&
+            (parser_retrieve(s, type, &val) != 0 ||
+             strlen(val) != view.length ||
+             memcmp(val, buf + view.offset, view.length))) {
+            fail("retrieved string differs from view", data, len);
+        }
+    }
+
+    const header_view_t *view;
+    header_t *header;
+    for (size_t i = 0; (view = parser_header_view(p, i)) != NULL; i++) {
+        header = parser_retrieve_next_header(s);
+        if (header == NULL || strlen(header->name) != view->name.length ||
+            strlen(header->value) != view->value.length ||
+            memcmp(header->value, buf + view->value.offset,
+                   view->value.length)) {
+            fail("header string differs from view", data, len);
+        }
+        header_t *found = parser_lookup_header(s, header->name);
+        if (found == NULL || strcasecmp(found->name, header->name)) {
+            fail("header lookup failed", data, len);
+        }
+    }
+    if (parser_retrieve_next_header(s) != NULL) {
+        fail("header iterator did not end", data, len);
+    }
+    checks++;
+}
+
+/*
+ * fuzz_one - parse one input every way and check that they agree
+ */
+static void fuzz_one(const char *data, size_t len) {
+    // whole input at once
+    parser_t *whole = parser_new();
+    parser_state state = parser_parse(whole, data, len);
+    size_t head = parser_head_size(whole);
+    if (state != DONE && state != INCOMPLETE && state != ERROR) {
+        fail("bad state", data, len);
+    }
+    if ((state == DONE) != (head > 0) || head > len) {
+        fail("bad head size", data, len);
+    }
+    size_t bound = state == DONE ? head : len;
+    parser_view_t view;
+    for (int type = METHOD; type <= HTTP_VERSION; type++) {
+        if (parser_retrieve_view(whole, type, &view) == 0) {
+            check_view(view, bound, data, len);
+        }
+    }
+    const header_view_t *h;
+    for (size_t i = 0; (h = parser_header_view(whole, i)) != NULL; i++) {
+        check_view(h->name, bound, data, len);
+        check_view(h->value, bound, data, len);
+        check_view(h->line, bound, data, len);
+    }
+
+    // in pieces, through a buffer that moves between calls
+    parser_t *pieces = parser_new();
+    char *buf = NULL;
+    size_t have = 0;
+    parser_state piece_state = INCOMPLETE;
+    while (piece_state == INCOMPLETE) {
+        size_t step = rand() % 2 ? 1 + rand() % 4 : 1 + rand() % 64;
+        have = have + step < len ? have + step : len;
+        char *moved = (char *)malloc(have > 0 ? have : 1);
+        memcpy(moved, data, have);
+        free(buf);
+        buf = moved;
+        piece_state = parser_parse(pieces, buf, have);
+        if (have == len) {
+            break;
+        }
+    }
+    if (piece_state != state || parser_head_size(pieces) != head) {
+        fail("incremental parse differs", data, len);
+    }
+    if (state == DONE) {
+        compare(whole, data, pieces, buf, data, len);
+        check_strings(whole, data, whole, data, len);
+    }
+
+    // in pieces, from an arena, which never frees what it grows out of
+    arena_t *arena = arena_acquire();
+    parser_t *in_arena = parser_new_with(arena_alloc_cb, arena);
+    parser_state arena_state = INCOMPLETE;
+    for (have = 0; arena_state == INCOMPLETE && have < len;) {
+        have += 1 + rand() % 16;
+        have = have < len ? have : len;
+        arena_state = parser_parse(in_arena, data, have);
+    }
+    if (len == 0) {
+        arena_state = parser_parse(in_arena, data, 0);
+    }
+    if (arena_state != state || parser_head_size(in_arena) != head) {
+        fail("arena parse differs", data, len);
+    }
+    if (state == DONE) {
+        compare(whole, data, in_arena, data, data, len);
+        check_strings(whole, data, in_arena, data, len);
+    }
+    parser_free(in_arena);
+    arena_release(arena);
+
+    // a line at a time, for requests that parse
+    if (state == DONE) {
+        parser_t *lines = parser_new();
+        const char *line = data;
+        char copy[MAX_INPUT + 1];
+        bool first = true;
+        while (line < data + head) {
+            const char *eol = memchr(line, '\n', data + head - line);
+            size_t n = eol + 1 - line;
+            memcpy(copy, line, n);
+            copy[n] = '\0';
+            line = eol + 1;
+            if (line == data + head) {
+                break; // the blank line
+            }
+            parser_state expect = first ? REQUEST : HEADER;
+            if (parser_parse_line(lines, copy) != expect) {
+                fail("line parse differs", data, len);
+            }
+            first = false;
+        }
+        check_strings(whole, data, lines, data, len);
+        parser_free(lines);
+    }
+
+    free(buf);
+    parser_free(whole);
+    parser_free(pieces);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    if (size <= MAX_INPUT) {
+        fuzz_one((const char *)data, size);
+    }
+    return 0;
+}
+
+#ifndef LIBFUZZER
+int main(int argc, char **argv) {
+    unsigned long iterations = 1000000;
+    unsigned seed = 1;
+    int c;
+
+    while ((c = getopt(argc, argv, "n:s:")) != -1) {
+        switch (c) {
+        case 'n':
+            iterations = strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            seed = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n iterations] [-s seed]\n", argv[0]);
+            exit(1);
+        }
+    }
+
+    srand(seed);
+    unsigned long done = 0;
+    unsigned long parsed = 0;
+    static char input[MAX_INPUT];
+    for (unsigned long i = 0; i < iterations; i++) {
+        size_t len = generate(input, sizeof(input));
+        if (rand() % 4) {
+            len = mutate(input, len, sizeof(input));
+        }
+        // the copy lets the sanitizer catch reads past the end
+        char *data = (char *)malloc(len > 0 ? len : 1);
+        memcpy(data, input, len);
+
+        parser_t *p = parser_new();
+        parsed += parser_parse(p, data, len) == DONE;
+        parser_free(p);
+        fuzz_one(data, len);
+        free(data);
+        done++;
+    }
+    printf("%lu inputs, %lu complete requests, %lu checks passed\n", done,
+           parsed, checks);
+    return 0;
+}
+#endif
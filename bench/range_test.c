@@ -0,0 +1,97 @@
+/**
+ * @file range_test.c
+ * @brief Checks of which If-Range values send_ranges() honours
+ *
+ * A cached response with both an ETag and a Last-Modified date is answered
+ * with a range request under a set of If-Range values, and the status line
+ * written to the client (or the fallback to the whole response) is compared
+ * with the expected one.
+ *
+ * usage: range_test
+ */
+
+#include "range.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+static const char response_header[] =
+    "HTTP/1.0 200 OK\r\n"
+    "Content-Type: text/plain\r\n"
+    "Content-Length: 26\r\n"
+    "ETag: \"v1\"\r\n"
+    "Last-Modified: Wed, 21 Oct 2015 07:28:00 GMT\r\n"
+    "\r\n";
+static const char body[] = "abcdefghijklmnopqrstuvwxyz";
+
+/*
+ * An If-Range value and the status expected for "Range: bytes=0-9", or NULL
+ * if the whole response should be sent
+ */
+typedef struct test_case {
+    const char *if_range;
+    const char *status;
+} test_case_t;
+
+static const test_case_t cases[] = {
+    {NULL, "206"},
+    {"\"v1\"", "206"},
+    {"\"v2\"", NULL},
+    {"W/\"v1\"", NULL},
+    {"Wed, 21 Oct 2015 07:28:00 GMT", "206"},
+    {"Wed, 21 Oct 2015 07:28:01 GMT", NULL},
+    {"Thu, 22 Oct 2015 07:28:00 GMT", NULL},
+};
+
+/*
+ * run_case - answer the range request under one If-Range value
+ * Returns 1 if the outcome is as expected, 0 otherwise.
+ */
+static int run_case(const test_case_t *test) {
+    char headers[256];
+    char reply[1024];
+    int fds[2];
+
+    if (test->if_range != NULL) {
+        snprintf(headers, sizeof(headers),
+                 "Range: bytes=0-9\r\nIf-Range: %s\r\n", test->if_range);
+    } else {
+        snprintf(headers, sizeof(headers), "Range: bytes=0-9\r\n");
+    }
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+        perror("socketpair");
+        exit(1);
+    }
+    ssize_t sent = send_ranges(fds[0], response_header,
+                               sizeof(response_header) - 1, body,
+                               sizeof(body) - 1, headers);
+    close(fds[0]);
+    ssize_t n = read(fds[1], reply, sizeof(reply) - 1);
+    close(fds[1]);
+    reply[n > 12 ? 12 : (n > 0 ? n : 0)] = '\0'; // the status line's start
+
+    const char *outcome = sent < 0 ? "whole response" : reply;
+    int ok = test->status == NULL
+                 ? sent < 0
+                 : sent > 0 && n >= 12 && !strncmp(reply + 9, test->status, 3);
+    if (!ok) {
+        fprintf(stderr, "range_test: If-Range %s: expected %s, got %s\n",
+                test->if_range ? test->if_range : "(none)",
+                test->status ? test->status : "whole response", outcome);
+    }
+    return ok;
+}
+
+int main(void) {
+    size_t ncases = sizeof(cases) / sizeof(cases[0]);
+    size_t passed = 0;
+
+    for (size_t i = 0; i < ncases; i++) {
+        passed += run_case(&cases[i]);
+    }
+    printf("%zu of %zu checks passed\n", passed, ncases);
+    return passed == ncases ? 0 : 1;
+}
@@ -0,0 +1,191 @@
+/**
+ * @file reader_bench.c
+ * @brief Benchmark of the line readers on requests with many headers
+ *
+ * Writes a file of requests with 50 headers each, then reads it back a line
+ * at a time and reports the time per request for:
+ *   - bytes: rio_readlineb() as it was, copying a byte at a time;
+ *   - rio: rio_readlineb(), copying up to the newline found with memchr();
+ *   - reader: reader_readline(), returning views into its buffer.
+ * The number of lines each reader returns is checked.
+ *
+ * usage: reader_bench [-n requests] [-f file]
+ */
+
+#include "csapp.h"
+#include "reader.h"
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NHEADERS 50
+
+static volatile size_t sink;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * write_requests - write n requests of NHEADERS headers to path
+ * Returns the number of bytes written.
+ */
+static size_t write_requests(const char *path, unsigned long n) {
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        perror(path);
+        exit(1);
+    }
+    size_t bytes = 0;
+    for (unsigned long i = 0; i < n; i++) {
+        bytes += fprintf(f, "GET http://localhost:15213/item/%lu HTTP/1.1\r\n",
+                         i);
+        for (int h = 0; h < NHEADERS; h++) {
+            bytes += fprintf(f, "X-Header-%d: value-%lu-%d, some more text "
+                                "to make a typical header line\r\n",
+                             h, i, h);
+        }
+        bytes += fprintf(f, "\r\n");
+    }
+    fclose(f);
+    return bytes;
+}
+
+/*
+ * readline_bytes - rio_readlineb() as it was, a byte at a time
+ */
+static ssize_t readline_bytes(rio_t *rp, char *usrbuf, size_t maxlen) {
+    size_t n;
+    ssize_t rc;
+    char c, *bufp = usrbuf;
+
+    for (n = 1; n < maxlen; n++) {
+        if ((rc = rio_readnb(rp, &c, 1)) == 1) {
+            *bufp++ = c;
+            if (c == '\n') {
+                n++;
+                break;
+            }
+        } else if (rc == 0) {
+            if (n == 1) {
+                return 0;
+            }
+            break;
+        } else {
+            return -1;
+        }
+    }
+    *bufp = 0;
+    return (ssize_t)(n - 1);
+}
+
+/*
+ * bench_rio - read the file with a rio_t line reader
+ * Returns the number of lines.
+ */
+static unsigned long bench_rio(const char *path, bool bytes) {
+    char line[MAXLINE];
+    rio_t rio;
+    ssize_t n;
+    unsigned long lines = 0;
+
+    int fd = open(path, O_RDONLY);
+    rio_readinitb(&rio, fd);
+    while ((n = bytes ? readline_bytes(&rio, line, sizeof(line))
+                      : rio_readlineb(&rio, line, sizeof(line))) > 0) {
+        sink += line[n - 1];
+        lines++;
+    }
+    close(fd);
+    return lines;
+}
+
+/*
+ * bench_reader - read the file with reader_readline()
+ * Returns the number of lines.
+ */
+static unsigned long bench_reader(const char *path) {
+    reader_t reader;
+    const char *line;
+    ssize_t n;
+    unsigned long lines = 0;
+
+    int fd = open(path, O_RDONLY);
+    reader_init(&reader, fd, MAXLINE);
+    while ((n = reader_readline(&reader, &line)) > 0) {
+        sink += line[n - 1];
+        lines++;
+    }
+    reader_free(&reader);
+    close(fd);
+    return lines;
+}
+
+/*
+ * report - print the time per request and throughput of a run
+ */
+static void report(const char *name, double seconds, unsigned long n,
+                   size_t bytes) {
+    printf("%-8s %8.1f ns/request %8.1f MB/s\n", name, seconds * 1e9 / n,
+           bytes / seconds / 1e6);
+}
+
+int main(int argc, char **argv) {
+    unsigned long n = 20000;
+    const char *path = "/tmp/reader_bench.txt";
+    int c;
+
+    while ((c = getopt(argc, argv, "n:f:")) != -1) {
+        switch (c) {
+        case 'n':
+            n = strtoul(optarg, NULL, 10);
+            break;
+        case 'f':
+            path = optarg;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n requests] [-f file]\n", argv[0]);
+            exit(1);
+        }
+    }
+
+    size_t bytes = write_requests(path, n);
+    unsigned long expect = n * (NHEADERS + 2);
+
+    // warm the page cache
+    bench_reader(path);
+
+    double start = now();
+    unsigned long lines = bench_rio(path, true);
+    report("bytes", now() - start, n, bytes);
+    if (lines != expect) {
+        fprintf(stderr, "bytes: read %lu lines, not %lu\n", lines, expect);
+        exit(1);
+    }
+
+    start = now();
+    lines = bench_rio(path, false);
+    report("rio", now() - start, n, bytes);
+    if (lines != expect) {
+        fprintf(stderr, "rio: read %lu lines, not %lu\n", lines, expect);
+        exit(1);
+    }
+
+    start = now();
+    lines = bench_reader(path);
+    report("reader", now() - start, n, bytes);
+    if (lines != expect) {
+        fprintf(stderr, "reader: read %lu lines, not %lu\n", lines, expect);
+        exit(1);
+    }
+
+    unlink(path);
+    return 0;
+}
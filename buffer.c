@@ -0,0 +1,117 @@
+/**
+ * @file buffer.c
+ * @brief Pooled, reference-counted I/O buffers
+ *
+ * Each buffer is a single allocation of its header followed by its bytes.
+ * Free buffers are kept on one list per size class, under a lock of its own,
+ * up to BUFFER_POOL_BYTES per class. As with arenas, the pool is shared by
+ * all threads: a connection's thread exits with it, so buffers cached per
+ * thread would be freed rather than reused.
+ */
+
+#include "buffer.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const size_t class_sizes[BUFFER_CLASSES] = {
+    4 * 1024,
+    16 * 1024,
+    64 * 1024,
+    128 * 1024,
+};
+
+typedef struct buffer_pool {
+    pthread_mutex_t mutex;
+    buffer_t *free;
+    size_t nfree;
+} buffer_pool_t;
+
+static buffer_pool_t pools[BUFFER_CLASSES] = {
+    {PTHREAD_MUTEX_INITIALIZER, NULL, 0},
+    {PTHREAD_MUTEX_INITIALIZER, NULL, 0},
+    {PTHREAD_MUTEX_INITIALIZER, NULL, 0},
+    {PTHREAD_MUTEX_INITIALIZER, NULL, 0},
+};
+
+/*
+ * new_buffer - allocate a buffer of the given capacity and class
+ */
+static buffer_t *new_buffer(size_t size, int size_class) {
+    buffer_t *buf = (buffer_t *)malloc(sizeof(buffer_t) + size);
+    if (buf == NULL) {
+        return NULL;
+    }
+    buf->data = (char *)(buf + 1);
+    buf->size = size;
+    buf->size_class = size_class;
+    return buf;
+}
+
+buffer_t *buffer_get(size_t size) {
+    int size_class = 0;
+    while (size_class < BUFFER_CLASSES && class_sizes[size_class] < size) {
+        size_class++;
+    }
+
+    buffer_t *buf = NULL;
+    if (size_class == BUFFER_CLASSES) {
+        buf = new_buffer(size, -1);
+    } else {
+        buffer_pool_t *pool = &pools[size_class];
+        pthread_mutex_lock(&pool->mutex);
+        buf = pool->free;
+        if (buf != NULL) {
+            pool->free = buf->next_free;
+            pool->nfree--;
+        }
+        pthread_mutex_unlock(&pool->mutex);
+        if (buf == NULL) {
+            buf = new_buffer(class_sizes[size_class], size_class);
+        }
+    }
+
+    if (buf != NULL) {
+        buf->reference_count = 1;
+        buf->next_free = NULL;
+    }
+    return buf;
+}
+
+buffer_t *buffer_grow(buffer_t *buf, size_t used, size_t size) {
+    buffer_t *grown = buffer_get(size);
+    if (grown == NULL) {
+        return NULL;
+    }
+    memcpy(grown->data, buf->data, used);
+    buffer_put(buf);
+    return grown;
+}
+
+buffer_t *buffer_ref(buffer_t *buf) {
+    __atomic_add_fetch(&buf->reference_count, 1, __ATOMIC_RELAXED);
+    return buf;
+}
+
+void buffer_put(buffer_t *buf) {
+    if (buf == NULL ||
+        __atomic_sub_fetch(&buf->reference_count, 1, __ATOMIC_ACQ_REL) > 0) {
+        return;
+    }
+
+    if (buf->size_class >= 0) {
+        buffer_pool_t *pool = &pools[buf->size_class];
+        pthread_mutex_lock(&pool->mutex);
+        if ((pool->nfree + 1) * buf->size <= BUFFER_POOL_BYTES) {
+            buf->next_free = pool->free;
+            pool->free = buf;
+            pool->nfree++;
+            buf = NULL;
+        }
+        pthread_mutex_unlock(&pool->mutex);
+    }
+
+    // not pooled, or the pool is full
+    free(buf);
+}
@@ -0,0 +1,78 @@
+/**
+ * @file buffer.h
+ * @brief Interface for pooled, reference-counted I/O buffers
+ *
+ * Buffers come in a few size classes and are recycled through a pool, so
+ * that reading a request or a response costs no malloc once the proxy is
+ * warm. A buffer is reference-counted: the bytes read from a web server can
+ * be sent to the client and kept by the cache without being copied, and the
+ * buffer goes back to the pool when the last user puts it.
+ */
+
+#ifndef BUFFER_H
+#define BUFFER_H
+
+#include <stddef.h>
+
+/*
+ * Number of size classes, of 4 KB, 16 KB, 64 KB and 128 KB; the largest holds
+ * a whole object of MAX_OBJECT_SIZE with its headers
+ */
+#define BUFFER_CLASSES 4
+
+/*
+ * Max bytes of free buffers kept in the pool for each class
+ */
+#define BUFFER_POOL_BYTES (1024 * 1024)
+
+/**
+ * @brief Reference-counted buffer
+ */
+typedef struct buffer {
+    char *data;                    // the bytes, right after this struct
+    size_t size;                   // capacity of data
+    int size_class;                // index of the class, -1 if not pooled
+    unsigned long reference_count; // number of users holding the buffer
+    struct buffer *next_free;      // next buffer in the pool
+} buffer_t;
+
+/**
+ * @brief Get a buffer of at least the given size, with one reference
+ *
+ * Sizes beyond the largest class get a buffer of their own that is freed
+ * rather than pooled.
+ *
+ * @param[in] size Minimum capacity
+ * @return The buffer, or NULL if out of memory
+ */
+buffer_t *buffer_get(size_t size);
+
+/**
+ * @brief Move the contents of a buffer into a larger one
+ *
+ * The first used bytes are copied into a new buffer of at least size bytes,
+ * and the caller's reference to the old buffer is put.
+ *
+ * @param[in] buf Buffer with one reference held by the caller
+ * @param[in] used Number of bytes of buf to keep
+ * @param[in] size Minimum capacity of the new buffer
+ * @return The new buffer, or NULL if out of memory, in which case buf is
+ * left alone
+ */
+buffer_t *buffer_grow(buffer_t *buf, size_t used, size_t size);
+
+/**
+ * @brief Add a reference to a buffer
+ * @param[in] buf The buffer
+ * @return buf
+ */
+buffer_t *buffer_ref(buffer_t *buf);
+
+/**
+ * @brief Drop a reference to a buffer, returning it to the pool with the
+ * last one
+ * @param[in] buf The buffer, or NULL
+ */
+void buffer_put(buffer_t *buf);
+
+#endif /* BUFFER_H */
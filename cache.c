@@ -6,13 +6,699 @@
  * objects in memory. It stores the URL of a GET request as a key, and the
  * received corresponding web object from the server limited by maximum size.
  *
+ * URLs are normalized before being used as keys, so that equivalent requests
+ * (different host case, explicit default port, reordered query) share one
+ * entry. A URL can have several cached variants when the server's response
+ * names request headers in its Vary header, e.g. Accept-Encoding; a variant
+ * is only served to requests whose values of those headers match.
+ *
+ * Optionally, compressible text responses are gzip-compressed once when they
+ * are stored, and the compressed copy is served to clients that accept gzip.
+ * Independently, objects can be kept LZ4-compressed in memory, trading a
+ * decompression on every hit for room to hold more objects. Range requests
+ * are answered from the cached object with 206 Partial Content.
+ *
+ * Every block keeps its own header block, and bodies are stored in a table
+ * keyed by an XXH64 content hash. Optionally, identical bodies are shared by
+ * reference count, so that the same bytes served under several URLs take
+ * memory only once.
+ *
+ * Also optionally, large bodies live in memfds, mapped for the cache's own
+ * reads, so that hits can hand them to the socket with sendfile() without
+ * copying them through user space.
+ *
  * @author Yujia Wang <yujiawan@andrew.cmu.edu>
  */
 
+#define _GNU_SOURCE // memfd_create
 #include "cache.h"
+#include "hash.h"
+#include "http_util.h"
+#include "lz4.h"
+#include "metrics.h"
+#include "range.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <zlib.h>
+
+/* Max number of query parameters sorted when normalizing a key */
+#define MAX_QUERY_PARAMS 64
 
 cache_t *cache;
 pthread_mutex_t mutex;
+static bool gzip_enabled = false;
+static bool lz4_enabled = false;
+static bool dedup_enabled = false;
+static bool sendfile_enabled = false;
+
+/* Per-thread buffer that compressed objects are decompressed into on hits */
+static pthread_key_t scratch_key;
+static pthread_once_t scratch_once = PTHREAD_ONCE_INIT;
+
+/* Content types worth compressing, matched as prefixes */
+static const char *compressible_types[] = {
+    "text/",           "application/json",      "application/javascript",
+    "application/xml", "application/xhtml+xml", "image/svg+xml"};
+
+/*
+ * append - append n bytes of s to buf at *pos, keeping buf NUL-terminated
+ * Returns false if buf would overflow.
+ */
+static bool append(char *buf, size_t buflen, size_t *pos, const char *s,
+                   size_t n) {
+    if (*pos + n >= buflen) {
+        return false;
+    }
+    memcpy(buf + *pos, s, n);
+    *pos += n;
+    buf[*pos] = '\0';
+    return true;
+}
+
+/*
+ * append_lower - append n bytes of s to buf at *pos in lowercase
+ */
+static bool append_lower(char *buf, size_t buflen, size_t *pos, const char *s,
+                         size_t n) {
+    size_t start = *pos;
+    if (!append(buf, buflen, pos, s, n)) {
+        return false;
+    }
+    for (size_t i = start; i < *pos; i++) {
+        buf[i] = tolower((unsigned char)buf[i]);
+    }
+    return true;
+}
+
+static int compare_params(const void *a, const void *b) {
+    return strcmp(*(const char **)a, *(const char **)b);
+}
+
+int normalize_cache_key(const char *uri, char *key, size_t keylen) {
+    const char *scheme = "http";
+    size_t scheme_len = strlen("http");
+    const char *rest = uri;
+    size_t pos = 0;
+
+    const char *sep = strstr(uri, "://");
+    if (sep != NULL) {
+        scheme = uri;
+        scheme_len = sep - uri;
+        rest = sep + strlen("://");
+    }
+
+    // split authority into host and port
+    size_t auth_len = strcspn(rest, "/?#");
+    const char *host = rest;
+    size_t host_len = auth_len;
+    const char *port = NULL;
+    size_t port_len = 0;
+    const char *colon = memchr(rest, ':', auth_len);
+    if (colon != NULL) {
+        host_len = colon - rest;
+        port = colon + 1;
+        port_len = auth_len - host_len - 1;
+    }
+
+    // the default port of the scheme is the same as no port at all
+    const char *default_port = NULL;
+    if (scheme_len == strlen("http") && !strncasecmp(scheme, "http", 4)) {
+        default_port = "80";
+    } else if (scheme_len == strlen("https") &&
+               !strncasecmp(scheme, "https", 5)) {
+        default_port = "443";
+    }
+    if (port != NULL && (port_len == 0 ||
+                         (default_port != NULL &&
+                          port_len == strlen(default_port) &&
+                          !strncmp(port, default_port, port_len)))) {
+        port = NULL;
+    }
+
+    if (!append_lower(key, keylen, &pos, scheme, scheme_len) ||
+        !append(key, keylen, &pos, "://", 3) ||
+        !append_lower(key, keylen, &pos, host, host_len)) {
+        return -1;
+    }
+    if (port != NULL && (!append(key, keylen, &pos, ":", 1) ||
+                         !append(key, keylen, &pos, port, port_len))) {
+        return -1;
+    }
+
+    // path, an empty path is the same as "/"
+    const char *path = rest + auth_len;
+    size_t path_len = strcspn(path, "?#");
+    if (path_len == 0) {
+        if (!append(key, keylen, &pos, "/", 1)) {
+            return -1;
+        }
+    } else if (!append(key, keylen, &pos, path, path_len)) {
+        return -1;
+    }
+
+    // query, with parameters in sorted order; the fragment is dropped
+    if (path[path_len] != '?') {
+        return 0;
+    }
+    char query[MAX_KEY_SIZE];
+    const char *query_start = path + path_len + 1;
+    size_t query_len = strcspn(query_start, "#");
+    if (query_len >= sizeof(query)) {
+        return -1;
+    }
+    memcpy(query, query_start, query_len);
+    query[query_len] = '\0';
+
+    char *params[MAX_QUERY_PARAMS];
+    size_t nparams = 0;
+    char *saveptr;
+    for (char *param = strtok_r(query, "&", &saveptr); param != NULL;
+         param = strtok_r(NULL, "&", &saveptr)) {
+        if (nparams == MAX_QUERY_PARAMS) {
+            return -1;
+        }
+        params[nparams++] = param;
+    }
+    qsort(params, nparams, sizeof(char *), compare_params);
+
+    for (size_t i = 0; i < nparams; i++) {
+        if (!append(key, keylen, &pos, i == 0 ? "?" : "&", 1) ||
+            !append(key, keylen, &pos, params[i], strlen(params[i]))) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * parse_vary - collect the header names listed in the Vary headers of a
+ * response as a lowercase, comma separated list
+ * Returns -1 for "Vary: *" or if the list does not fit, 0 otherwise.
+ */
+static int parse_vary(const char *object, ssize_t object_size, char *vary,
+                      size_t varylen) {
+    const char *end = object + object_size;
+    const char *line = memchr(object, '\n', object_size);
+    size_t pos = 0;
+
+    vary[0] = '\0';
+    if (line == NULL) {
+        return 0;
+    }
+
+    // skip the status line, then look at every Vary header
+    for (line++; line < end;) {
+        const char *eol = memchr(line, '\n', end - line);
+        if (eol == NULL) {
+            eol = end;
+        }
+        if (eol == line || (eol == line + 1 && *line == '\r')) {
+            break;
+        }
+
+        const char *value;
+        size_t value_len;
+        if (header_value(line, eol, "Vary", &value, &value_len)) {
+            const char *field = value;
+            const char *value_end = value + value_len;
+            while (field < value_end) {
+                const char *comma = memchr(field, ',', value_end - field);
+                const char *field_end = comma != NULL ? comma : value_end;
+                while (field < field_end && isspace((unsigned char)*field)) {
+                    field++;
+                }
+                const char *trim = field_end;
+                while (trim > field && isspace((unsigned char)trim[-1])) {
+                    trim--;
+                }
+                if (trim - field == 1 && *field == '*') {
+                    return -1;
+                }
+                if (trim > field &&
+                    (!append_lower(vary, varylen, &pos, field, trim - field) ||
+                     !append(vary, varylen, &pos, ",", 1))) {
+                    return -1;
+                }
+                field = field_end + 1;
+            }
+        }
+        line = eol + 1;
+    }
+    return 0;
+}
+
+/*
+ * build_variant - collect the request's values of the headers named in vary,
+ * one per line, so that two requests select the same variant iff their
+ * variant strings are equal
+ * Returns -1 if the variant does not fit.
+ */
+static int build_variant(const char *headers, const char *vary, char *variant,
+                         size_t variantlen) {
+    const char *end = headers + strlen(headers);
+    char name[MAXLINE];
+    size_t pos = 0;
+
+    variant[0] = '\0';
+    while (*vary != '\0') {
+        size_t name_len = strcspn(vary, ",");
+        if (name_len >= sizeof(name)) {
+            return -1;
+        }
+        memcpy(name, vary, name_len);
+        name[name_len] = '\0';
+        vary += name_len + (vary[name_len] == ',');
+
+        const char *value = "";
+        size_t value_len = 0;
+        find_header(headers, end, name, &value, &value_len);
+        if (!append(variant, variantlen, &pos, value, value_len) ||
+            !append(variant, variantlen, &pos, "\n", 1)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * block_matches - check whether a cache block holds the variant of key
+ * selected by the request headers
+ */
+static bool block_matches(cache_block_t *block, const char *key,
+                          const char *headers) {
+    char variant[MAXLINE];
+
+    if (strcmp(key, block->url)) {
+        return false;
+    }
+    if (block->vary == NULL) {
+        return true;
+    }
+    if (build_variant(headers, block->vary, variant, sizeof(variant)) < 0) {
+        return false;
+    }
+    return !strcmp(variant, block->variant);
+}
+
+static void make_scratch_key(void) {
+    pthread_key_create(&scratch_key, free);
+}
+
+/*
+ * get_scratch - get the calling thread's decompression buffer of
+ * MAX_OBJECT_SIZE bytes, allocating it on first use; it is freed when the
+ * thread exits
+ */
+static char *get_scratch(void) {
+    pthread_once(&scratch_once, make_scratch_key);
+    char *scratch = (char *)pthread_getspecific(scratch_key);
+    if (scratch == NULL) {
+        scratch = (char *)malloc(MAX_OBJECT_SIZE);
+        if (scratch != NULL) {
+            pthread_setspecific(scratch_key, scratch);
+        }
+    }
+    return scratch;
+}
+
+/*
+ * body_footprint - memory accounted to a body against MAX_CACHE_SIZE
+ * A body kept in a buffer counts its own size like any other, though the
+ * buffer, which it fills at least half of, may be up to twice that.
+ */
+static ssize_t body_footprint(cache_body_t *body) {
+    return body->lz4_size > 0 ? body->lz4_size : body->size;
+}
+
+/*
+ * discard_body - free a body and its data
+ */
+static void discard_body(cache_body_t *body) {
+    if (body->memfd >= 0) {
+        munmap(body->data, body->size);
+        close(body->memfd);
+    } else if (body->buffer != NULL) {
+        buffer_put(body->buffer);
+    } else {
+        free(body->data);
+    }
+    free(body);
+}
+
+/*
+ * map_body - copy the data of a body into a new memfd, and map it for reading
+ * Returns -1 if the memfd cannot be made.
+ */
+static int map_body(cache_body_t *body, const char *data, ssize_t size) {
+    int memfd = memfd_create("cache-body", MFD_CLOEXEC);
+    if (memfd < 0) {
+        return -1;
+    }
+    char *map = MAP_FAILED;
+    if (ftruncate(memfd, size) == 0) {
+        map = (char *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                           memfd, 0);
+    }
+    if (map == MAP_FAILED) {
+        close(memfd);
+        return -1;
+    }
+    memcpy(map, data, size);
+    body->data = map;
+    body->memfd = memfd;
+    return 0;
+}
+
+/*
+ * new_body - copy a body for storage, LZ4-compressed if enabled and it saves
+ * at least an eighth of the size, and hash it; an uncompressed body is put in
+ * a memfd if large enough and sendfile is enabled, or else referenced rather
+ * than copied if it lies in a buffer it fills at least half of
+ * Returns a body with no references, not yet in the cache's table.
+ */
+static cache_body_t *new_body(const char *data, ssize_t size,
+                              buffer_t *buffer) {
+    cache_body_t *body = (cache_body_t *)malloc(sizeof(cache_body_t));
+    if (body == NULL) {
+        return NULL;
+    }
+    body->size = size;
+    body->lz4_size = 0;
+    body->reference_count = 0;
+    body->next = NULL;
+
+    body->data = NULL;
+    body->buffer = NULL;
+    body->memfd = -1;
+    if (lz4_enabled && size > 0) {
+        body->data = (char *)malloc(LZ4_BOUND(size));
+        size_t packed = 0;
+        if (body->data != NULL) {
+            packed = lz4_compress(data, size, body->data, LZ4_BOUND(size));
+        }
+        if (packed > 0 && (ssize_t)packed <= size - size / 8) {
+            body->lz4_size = packed;
+        } else {
+            free(body->data);
+            body->data = NULL;
+        }
+    }
+    if (body->data == NULL && sendfile_enabled && size >= SENDFILE_MIN_SIZE) {
+        map_body(body, data, size);
+    }
+    if (body->data == NULL && buffer != NULL &&
+        buffer->size <= 2 * (size_t)size) {
+        body->data = (char *)data;
+        body->buffer = buffer_ref(buffer);
+    }
+    if (body->data == NULL) {
+        body->data = (char *)malloc(size > 0 ? size : 1);
+        if (body->data == NULL) {
+            free(body);
+            return NULL;
+        }
+        memcpy(body->data, data, size);
+    }
+
+    // the compressor is deterministic, so equal bodies have equal data
+    body->hash = xxh64(body->data, body_footprint(body), 0);
+    return body;
+}
+
+/*
+ * intern_body - add a reference to the cached body equal to the given one,
+ * freeing the given one, or add the given one to the table if there is none
+ * or sharing is disabled
+ * Must be called with the cache locked.
+ */
+static cache_body_t *intern_body(cache_body_t *body) {
+    cache_body_t **bucket = &cache->bodies[body->hash % BODY_TABLE_SIZE];
+    for (cache_body_t *curr = dedup_enabled ? *bucket : NULL; curr != NULL;
+         curr = curr->next) {
+        if (curr->hash == body->hash && curr->size == body->size &&
+            curr->lz4_size == body->lz4_size &&
+            !memcmp(curr->data, body->data, body_footprint(body))) {
+            discard_body(body);
+            curr->reference_count++;
+            return curr;
+        }
+    }
+
+    body->next = *bucket;
+    *bucket = body;
+    body->reference_count = 1;
+    cache->size += body_footprint(body);
+    return body;
+}
+
+/*
+ * release_body - drop a reference to a body, freeing it with the last one
+ * Must be called with the cache locked.
+ */
+static void release_body(cache_body_t *body) {
+    if (--body->reference_count > 0) {
+        return;
+    }
+
+    cache_body_t **link = &cache->bodies[body->hash % BODY_TABLE_SIZE];
+    while (*link != body) {
+        link = &(*link)->next;
+    }
+    *link = body->next;
+    cache->size -= body_footprint(body);
+    discard_body(body);
+}
+
+/*
+ * free_object - free a stored response that never made it into the cache
+ */
+static void free_object(cache_object_t *object) {
+    free(object->header);
+    if (object->body != NULL) {
+        discard_body(object->body);
+    }
+}
+
+/*
+ * split_object - split a response as received, in the given buffer if not
+ * NULL, into its header block and a body prepared for storage
+ * Returns -1 if out of memory.
+ */
+static int split_object(const char *object, ssize_t object_size,
+                        buffer_t *buffer, cache_object_t *out) {
+    const char *body = find_body(object, object_size);
+    if (body == NULL) {
+        body = object + object_size; // no complete header block, no body
+    }
+
+    out->header_size = body - object;
+    out->header = (char *)malloc(out->header_size > 0 ? out->header_size : 1);
+    out->body = new_body(body, object + object_size - body, buffer);
+    if (out->header == NULL || out->body == NULL) {
+        free_object(out);
+        return -1;
+    }
+    memcpy(out->header, object, out->header_size);
+    return 0;
+}
+
+/*
+ * accepts_gzip - check whether the request's Accept-Encoding allows a gzip
+ * response, either by naming gzip or through "*", with a nonzero q-value
+ */
+static bool accepts_gzip(const char *headers) {
+    const char *value;
+    size_t value_len;
+    char codings[MAXLINE];
+    bool gzip_listed = false;
+    bool gzip_ok = false;
+    bool star_ok = false;
+    char *saveptr;
+
+    if (!find_header(headers, headers + strlen(headers), "Accept-Encoding",
+                     &value, &value_len) ||
+        value_len >= sizeof(codings)) {
+        return false;
+    }
+    memcpy(codings, value, value_len);
+    codings[value_len] = '\0';
+
+    for (char *coding = strtok_r(codings, ",", &saveptr); coding != NULL;
+         coding = strtok_r(NULL, ",", &saveptr)) {
+        double q = 1.0;
+        char *params = strchr(coding, ';');
+        if (params != NULL) {
+            *params++ = '\0';
+            char *qparam = strstr(params, "q=");
+            if (qparam != NULL) {
+                q = strtod(qparam + strlen("q="), NULL);
+            }
+        }
+
+        while (isspace((unsigned char)*coding)) {
+            coding++;
+        }
+        size_t len = strcspn(coding, " \t");
+        if ((len == 4 && !strncasecmp(coding, "gzip", 4)) ||
+            (len == 6 && !strncasecmp(coding, "x-gzip", 6))) {
+            gzip_listed = true;
+            gzip_ok = q > 0;
+        } else if (len == 1 && *coding == '*') {
+            star_ok = q > 0;
+        }
+    }
+    return gzip_listed ? gzip_ok : star_ok;
+}
+
+/*
+ * is_compressible - check whether a response is a successful, unencoded,
+ * unframed response with a text-like content type that may be transformed
+ */
+static bool is_compressible(const char *object, const char *body) {
+    const char *value;
+    size_t value_len;
+
+    if (strncmp(object, "HTTP/1.", strlen("HTTP/1.")) ||
+        strncmp(object + strlen("HTTP/1.x"), " 200", strlen(" 200"))) {
+        return false;
+    }
+    if (find_header(object, body, "Content-Encoding", &value, &value_len) ||
+        find_header(object, body, "Transfer-Encoding", &value, &value_len)) {
+        return false;
+    }
+    if (find_header(object, body, "Cache-Control", &value, &value_len)) {
+        for (size_t i = 0; i + strlen("no-transform") <= value_len; i++) {
+            if (!strncasecmp(value + i, "no-transform",
+                             strlen("no-transform"))) {
+                return false;
+            }
+        }
+    }
+    if (!find_header(object, body, "Content-Type", &value, &value_len)) {
+        return false;
+    }
+
+    size_t ntypes = sizeof(compressible_types) / sizeof(compressible_types[0]);
+    for (size_t i = 0; i < ntypes; i++) {
+        size_t len = strlen(compressible_types[i]);
+        if (value_len >= len &&
+            !strncasecmp(value, compressible_types[i], len)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * gzip_response - build the gzip-encoded version of a response: the original
+ * headers without Content-Length and ETag, plus Content-Encoding, the new
+ * Content-Length and Vary: Accept-Encoding, and the compressed body
+ * Returns -1 if the response is not compressible, compressing does not make
+ * it smaller, or out of memory.
+ */
+static int gzip_response(const char *header, ssize_t header_size,
+                         const char *body, ssize_t body_size,
+                         cache_object_t *out) {
+    const char *header_end = header + header_size;
+    if (body_size < GZIP_MIN_SIZE || !is_compressible(header, header_end)) {
+        return -1;
+    }
+
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    // window bits + 16 selects the gzip wrapper instead of zlib's
+    if (deflateInit2(&strm, Z_BEST_COMPRESSION, Z_DEFLATED, MAX_WBITS + 16,
+                     8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return -1;
+    }
+    uLong bound = deflateBound(&strm, body_size);
+    char *compressed = (char *)malloc(bound);
+    if (compressed == NULL) {
+        deflateEnd(&strm);
+        return -1;
+    }
+    strm.next_in = (Bytef *)body;
+    strm.avail_in = body_size;
+    strm.next_out = (Bytef *)compressed;
+    strm.avail_out = bound;
+    int ret = deflate(&strm, Z_FINISH);
+    size_t compressed_len = strm.total_out;
+    deflateEnd(&strm);
+    if (ret != Z_STREAM_END || compressed_len >= (size_t)body_size) {
+        free(compressed);
+        return -1;
+    }
+
+    char extra[MAXLINE];
+    int extra_len = snprintf(extra, sizeof(extra),
+                             "Content-Encoding: gzip\r\n"
+                             "Content-Length: %zu\r\n"
+                             "Vary: Accept-Encoding\r\n\r\n",
+                             compressed_len);
+    out->header = (char *)malloc(header_size + extra_len);
+    out->body = new_body(compressed, compressed_len, NULL);
+    free(compressed);
+    if (out->header == NULL || out->body == NULL) {
+        free_object(out);
+        return -1;
+    }
+
+    // copy the status line and the headers that still hold
+    const char *line = header;
+    size_t len = 0;
+    while (line < header_end) {
+        const char *eol = memchr(line, '\n', header_end - line);
+        const char *value;
+        size_t value_len;
+        if (eol == line + 1) {
+            break; // blank line ending the headers
+        }
+        if (!header_value(line, eol, "Content-Length", &value, &value_len) &&
+            !header_value(line, eol, "ETag", &value, &value_len)) {
+            memcpy(out->header + len, line, eol + 1 - line);
+            len += eol + 1 - line;
+        }
+        line = eol + 1;
+    }
+    memcpy(out->header + len, extra, extra_len);
+    out->header_size = len + extra_len;
+    return 0;
+}
+
+/*
+ * add_vary_encoding - add "Vary: Accept-Encoding" to the header block of a
+ * response that also has a gzip variant, unless its Vary header (vary, as
+ * parsed by parse_vary) already names Accept-Encoding
+ * Returns -1 if out of memory.
+ */
+static int add_vary_encoding(cache_object_t *object, const char *vary) {
+    static const char line[] = "Vary: Accept-Encoding\r\n";
+    size_t line_len = strlen(line);
+    ssize_t size = object->header_size;
+
+    if (!strncmp(vary, "accept-encoding,", strlen("accept-encoding,")) ||
+        strstr(vary, ",accept-encoding,") != NULL) {
+        return 0;
+    }
+    if (size < 2 || strncmp(object->header + size - 2, "\r\n", 2)) {
+        return 0; // no blank line to insert before
+    }
+
+    char *header = (char *)realloc(object->header, size + line_len);
+    if (header == NULL) {
+        return -1;
+    }
+    memmove(header + size - 2 + line_len, header + size - 2, 2);
+    memcpy(header + size - 2, line, line_len);
+    object->header = header;
+    object->header_size = size + line_len;
+    return 0;
+}
 
 void init_cache() {
     cache = (cache_t *)malloc(sizeof(cache_t));
@@ -24,12 +710,48 @@ void init_cache() {
     cache->head = NULL;
     cache->tail = NULL;
     cache->size = 0;
+    cache->count = 0;
+    memset(cache->bodies, 0, sizeof(cache->bodies));
 
     // initialize mutex
     pthread_mutex_init(&mutex, NULL);
     return;
 }
 
+/*
+ * lock_cache - lock the cache, counting how long the lock was waited for
+ */
+static void lock_cache(void) {
+    if (pthread_mutex_trylock(&mutex) == 0) {
+        return;
+    }
+    struct timespec start;
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_mutex_lock(&mutex);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    metric_add(METRIC_LOCK_WAITS, 1);
+    metric_add(METRIC_LOCK_WAIT_NS,
+               (uint64_t)((end.tv_sec - start.tv_sec) * 1000000000 +
+                          (end.tv_nsec - start.tv_nsec)));
+}
+
+void cache_set_gzip(bool enable) {
+    gzip_enabled = enable;
+}
+
+void cache_set_lz4(bool enable) {
+    lz4_enabled = enable;
+}
+
+void cache_set_dedup(bool enable) {
+    dedup_enabled = enable;
+}
+
+void cache_set_sendfile(bool enable) {
+    sendfile_enabled = enable;
+}
+
 void free_cache() {
     if (cache->head != NULL) {
         cache_block_t *curr = cache->head;
@@ -43,69 +765,96 @@ void free_cache() {
     free(cache);
 }
 
-cache_block_t *alloc_block(const char *uri, char obj[], ssize_t obj_size) {
+cache_block_t *alloc_block(const char *key, const char *vary,
+                           const char *variant, cache_object_t *identity,
+                           cache_object_t *gzip, ssize_t obj_size) {
     cache_block_t *block = (cache_block_t *)malloc(sizeof(cache_block_t));
     if (block == NULL) {
         sio_printf("Malloc for cache block failed\n");
         return NULL;
     }
 
-    block->url = (char *)malloc(strlen(uri) + 1);
+    block->url = (char *)malloc(strlen(key) + 1);
     if (block->url == NULL) {
         sio_printf("Malloc for block url failed\n");
+        free(block);
         return NULL;
     }
-    strcpy(block->url, uri);
+    strcpy(block->url, key);
 
-    block->object = (char *)malloc(obj_size);
-    if (block->object == NULL) {
-        sio_printf("Malloc for block object failed\n");
-        return NULL;
+    block->vary = NULL;
+    block->variant = NULL;
+    if (vary != NULL) {
+        block->vary = strdup(vary);
+        block->variant = strdup(variant);
+        if (block->vary == NULL || block->variant == NULL) {
+            sio_printf("Malloc for block variant failed\n");
+            free(block->vary);
+            free(block->variant);
+            free(block->url);
+            free(block);
+            return NULL;
+        }
     }
-    memcpy(block->object, obj, obj_size);
 
+    block->identity = *identity;
+    block->gzip = *gzip;
     block->object_size = obj_size;
     block->reference_count = 0;
     return block;
 }
 
 void free_block(cache_block_t *block) {
-    // When the reference count drops to 0, the object can safely be freed
-    while (1) {
-        if (block->reference_count == 0) {
-            free(block->url);
-            free(block->object);
-            free(block);
-            break;
-        }
+    // the reference count has dropped to 0, no reader is using the bodies
+    release_body(block->identity.body);
+    if (block->gzip.body != NULL) {
+        release_body(block->gzip.body);
     }
+    free(block->identity.header);
+    free(block->gzip.header);
+    free(block->url);
+    free(block->vary);
+    free(block->variant);
+    free(block);
     return;
 }
 
 void insert_head(cache_block_t *block) {
+    block->prev = NULL;
+    block->next = cache->head;
     if (cache->head == NULL) { // linked list is null
-        cache->head = block;
         cache->tail = block;
-        block->prev = NULL;
-        block->next = NULL;
     } else {
         // insert to the head of the list, most recently used block
-        if (block == cache->head) {
-            return;
-        }
-
-        block->next = cache->head;
         cache->head->prev = block;
-        block->prev = NULL;
-        cache->head = block;
+    }
+    cache->head = block;
+    return;
+}
 
-        // only one block in the cache
-        if (cache->head->next == NULL) {
-            cache->tail->prev = block;
-        }
+void remove_block(cache_block_t *block) {
+    if (block->prev == NULL) {
+        cache->head = block->next;
+    } else {
+        block->prev->next = block->next;
+    }
+    if (block->next == NULL) {
+        cache->tail = block->prev;
+    } else {
+        block->next->prev = block->prev;
     }
+    block->prev = NULL;
+    block->next = NULL;
 
-    block->reference_count++;
+    // headers are accounted to the block, bodies to the body table
+    cache->size -= block->identity.header_size + block->gzip.header_size;
+    cache->count--;
+
+    // drop the cache's reference; a block still being sent is freed by its
+    // last reader
+    if (--block->reference_count == 0) {
+        free_block(block);
+    }
     return;
 }
 
@@ -115,30 +864,63 @@ void remove_tail() {
     }
 
     // do eviction, remove the tail of the list
-    cache_block_t *old_tail = cache->tail;
-    if (cache->tail->prev == NULL) {
-        // only one block in cache
-        cache->head = NULL;
-        cache->tail = NULL;
-    } else {
-        cache->tail = old_tail->prev;
-        cache->tail->next = NULL;
-        old_tail->prev = NULL;
-    }
-
-    cache->size -= old_tail->object_size;
+    remove_block(cache->tail);
+    metric_add(METRIC_EVICTIONS, 1);
+    return;
+}
 
-    old_tail->reference_count--;
+/*
+ * send_file - send a header block, then a body from its memfd with
+ * sendfile(), falling back to writing the mapped body if the socket does not
+ * support sendfile()
+ * Returns -1 on error.
+ */
+static ssize_t send_file(int fd, const char *header, ssize_t header_size,
+                         cache_body_t *body) {
+    // MSG_MORE holds the header back to go out with the start of the body
+    while (header_size > 0) {
+        ssize_t n = send(fd, header, header_size, MSG_MORE);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return -1;
+        }
+        header += n;
+        header_size -= n;
+    }
 
-    free_block(old_tail);
-    return;
+    off_t offset = 0;
+    while (offset < body->size) {
+        ssize_t n = sendfile(fd, body->memfd, &offset, body->size - offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+            return rio_writen(fd, body->data + offset, body->size - offset);
+        }
+        if (n <= 0) {
+            return -1;
+        }
+    }
+    return body->size;
 }
 
-ssize_t read_cache(const char *uri, int fd) {
-    pthread_mutex_lock(&mutex);
+ssize_t read_cache(const char *uri, const char *headers, int fd) {
+    char key[MAX_KEY_SIZE];
+    if (normalize_cache_key(uri, key, sizeof(key)) < 0) {
+        metric_add(METRIC_MISSES, 1);
+        return -1;
+    }
+    if (headers == NULL) {
+        headers = "";
+    }
+    bool gzip = accepts_gzip(headers);
+
+    lock_cache();
     cache_block_t *block = cache->head;
     while (block != NULL) {
-        if (!strncasecmp(uri, block->url, strlen(uri))) {
+        if (block_matches(block, key, headers)) {
             if (block != cache->head) {
                 // move the object to the head of the list
                 block->prev->next = block->next;
@@ -148,64 +930,179 @@ ssize_t read_cache(const char *uri, int fd) {
                 } else {
                     block->next->prev = block->prev;
                 }
-                block->prev = NULL;
-                block->next = NULL;
                 insert_head(block);
-            } else {
-                // if head matches, simply add reference count
-                block->reference_count++;
             }
+            // the block stays alive while it is being sent
+            block->reference_count++;
 
             // release lock before transmitting the object to the client
             pthread_mutex_unlock(&mutex);
 
-            // forward the cached web object to the client
-            rio_writen(fd, block->object, block->object_size);
+            // forward the cached web object to the client, compressed if the
+            // client accepts it
+            cache_object_t *object = &block->identity;
+            if (gzip && block->gzip.body != NULL) {
+                object = &block->gzip;
+            }
+            cache_body_t *body = object->body;
+            char *data = body->data;
+            ssize_t object_size = object->header_size + body->size;
+            if (body->lz4_size > 0) {
+                data = get_scratch();
+                if (data == NULL ||
+                    lz4_decompress(body->data, body->lz4_size, data,
+                                   MAX_OBJECT_SIZE) != body->size) {
+                    object_size = -1;
+                }
+            }
+            if (object_size > 0 &&
+                send_ranges(fd, object->header, object->header_size, data,
+                            body->size, headers) < 0) {
+                if (body->memfd >= 0) {
+                    send_file(fd, object->header, object->header_size, body);
+                } else {
+                    struct iovec iov[2];
+                    iov[0].iov_base = object->header;
+                    iov[0].iov_len = object->header_size;
+                    iov[1].iov_base = data;
+                    iov[1].iov_len = body->size;
+                    writev_all(fd, iov, 2);
+                }
+            }
+            // an object that could not be decompressed is refetched, so it
+            // counts as a miss
+            if (object_size > 0) {
+                metric_add(METRIC_HITS, 1);
+                metric_add(METRIC_HIT_BYTES, object_size);
+            } else {
+                metric_add(METRIC_MISSES, 1);
+            }
 
             // decrement reference count when it is done transmitting the object
             // to a client
-            pthread_mutex_lock(&mutex);
-            block->reference_count--;
+            lock_cache();
+            if (--block->reference_count == 0) {
+                free_block(block);
+            }
             pthread_mutex_unlock(&mutex);
 
-            return block->object_size;
+            return object_size;
         }
         block = block->next;
     }
 
     // URL not found
     pthread_mutex_unlock(&mutex);
+    metric_add(METRIC_MISSES, 1);
     return -1;
 }
 
-void write_cache(const char *uri, char object[], ssize_t object_size) {
-    pthread_mutex_lock(&mutex);
+void write_cache(const char *uri, const char *headers, char object[],
+                 ssize_t object_size, buffer_t *buffer) {
+    char key[MAX_KEY_SIZE];
+    char vary[MAXLINE];
+    char variant[MAXLINE];
+    if (normalize_cache_key(uri, key, sizeof(key)) < 0) {
+        return;
+    }
+    if (headers == NULL) {
+        headers = "";
+    }
 
-    // check uniqueness, if the URL is already in cache, return
+    // "Vary: *" responses can never be served from cache
+    if (parse_vary(object, object_size, vary, sizeof(vary)) < 0) {
+        return;
+    }
+    if (vary[0] != '\0' &&
+        build_variant(headers, vary, variant, sizeof(variant)) < 0) {
+        return;
+    }
+
+    // copy, compress and hash outside the lock, at most once per stored object
+    cache_object_t identity;
+    cache_object_t gzip = {NULL, 0, NULL};
+    if (split_object(object, object_size, buffer, &identity) < 0) {
+        return;
+    }
+    if (gzip_enabled &&
+        gzip_response(object, identity.header_size,
+                      object + identity.header_size,
+                      object_size - identity.header_size, &gzip) == 0 &&
+        add_vary_encoding(&identity, vary) < 0) {
+        // the identity response must tell caches that it has an encoded
+        // sibling, so without room for that, store it alone
+        free_object(&gzip);
+        gzip = (cache_object_t){NULL, 0, NULL};
+    }
+
+    lock_cache();
+
+    // check uniqueness, if the variant is already in cache, return; keep at
+    // most MAX_VARIANTS variants of one key by dropping the least recently
+    // used one
     cache_block_t *block = cache->head;
+    cache_block_t *oldest_variant = NULL;
+    int nvariants = 0;
     while (block != NULL) {
-        if (!strncasecmp(uri, block->url, strlen(uri))) {
+        if (block_matches(block, key, headers)) {
             pthread_mutex_unlock(&mutex);
+            free_object(&identity);
+            free_object(&gzip);
             return;
         }
+        if (!strcmp(key, block->url)) {
+            oldest_variant = block;
+            nvariants++;
+        }
         block = block->next;
     }
+    if (nvariants >= MAX_VARIANTS) {
+        remove_block(oldest_variant);
+        metric_add(METRIC_EVICTIONS, 1);
+    }
 
-    while (cache->size + object_size > MAX_CACHE_SIZE) {
+    // share bodies already in the cache; only new ones add to its size
+    identity.body = intern_body(identity.body);
+    if (gzip.body != NULL) {
+        gzip.body = intern_body(gzip.body);
+    }
+    cache->size += identity.header_size + gzip.header_size;
+
+    while (cache->size > MAX_CACHE_SIZE && cache->tail != NULL) {
         // eviction
         remove_tail();
     }
 
     // store the web object with its URL in a new cache block and insert to the
     // head of the list
-    block = alloc_block(uri, object, object_size);
+    block = alloc_block(key, vary[0] != '\0' ? vary : NULL, variant,
+                        &identity, &gzip, object_size);
+    if (block == NULL) {
+        release_body(identity.body);
+        if (gzip.body != NULL) {
+            release_body(gzip.body);
+        }
+        cache->size -= identity.header_size + gzip.header_size;
+        pthread_mutex_unlock(&mutex);
+        free(identity.header);
+        free(gzip.header);
+        return;
+    }
+    block->reference_count = 1;
     insert_head(block);
-    cache->size += object_size;
+    cache->count++;
 
     pthread_mutex_unlock(&mutex);
     return;
 }
 
+void cache_stats(uint64_t *objects, uint64_t *bytes) {
+    lock_cache();
+    *objects = cache->count;
+    *bytes = cache->size;
+    pthread_mutex_unlock(&mutex);
+}
+
 void print_cache() {
     cache_block_t *block = cache->head;
     while (block != NULL) {
@@ -213,7 +1110,19 @@ void print_cache() {
         sio_printf("  address    : %p\n", block);
         sio_printf("  url        : %s\n", block->url);
         sio_printf("  url length : %zu\n", strlen(block->url));
+        if (block->vary != NULL) {
+            sio_printf("  vary       : %s\n", block->vary);
+        }
         sio_printf("  object size: %zu\n", block->object_size);
+        sio_printf("  body       : %p (%lu refs)\n", block->identity.body,
+                   block->identity.body->reference_count);
+        if (block->identity.body->lz4_size > 0) {
+            sio_printf("  lz4 size   : %zu\n", block->identity.body->lz4_size);
+        }
+        if (block->gzip.body != NULL) {
+            sio_printf("  gzip size  : %zu\n",
+                       block->gzip.header_size + block->gzip.body->size);
+        }
         if (block->next != NULL) {
             sio_printf("  next block : %p\n", block->next);
         } else {
@@ -5,8 +5,11 @@
  * @author Yujia Wang <yujiawan@andrew.cmu.edu>
  */
 
+#include "buffer.h"
 #include "csapp.h"
 #include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -20,25 +23,77 @@
 #define MAX_CACHE_SIZE (1024 * 1024)
 #define MAX_OBJECT_SIZE (100 * 1024)
 
+/*
+ * Max length of a normalized cache key, and max number of variants (selected
+ * by the response's Vary header) kept for one key
+ */
+#define MAX_KEY_SIZE MAXLINE
+#define MAX_VARIANTS 4
+
+/*
+ * Smallest body worth gzip-compressing at cache-fill time
+ */
+#define GZIP_MIN_SIZE 256
+
+/*
+ * Number of buckets of the table of bodies by content hash
+ */
+#define BODY_TABLE_SIZE 1024
+
+/*
+ * Smallest body kept in a memfd when sending with sendfile is enabled
+ */
+#define SENDFILE_MIN_SIZE (32 * 1024)
+
+/**
+ * @brief Response body, shared by all cache blocks whose bodies are
+ * byte-for-byte identical when sharing is enabled
+ */
+typedef struct cache_body {
+    uint64_t hash;                 // xxh64 of the stored bytes
+    char *data;                    // LZ4-compressed if lz4_size is nonzero
+    buffer_t *buffer;              // buffer data lies in, NULL if malloc'd
+    int memfd;                     // memfd data is mapped from, -1 if none
+    ssize_t size;                  // size of the body
+    ssize_t lz4_size;              // size of data if compressed, 0 if raw
+    unsigned long reference_count; // number of blocks using the body
+    struct cache_body *next;       // next body in the same bucket
+} cache_body_t;
+
+/**
+ * @brief A stored response: its own header block and a shared body
+ */
+typedef struct cache_object {
+    char *header;       // status line and headers, with the ending blank line
+    ssize_t header_size;
+    cache_body_t *body; // NULL if there is no such response
+} cache_object_t;
+
 /**
  * @brief Cache block structure
  */
 typedef struct cache_block {
-    char *url;
-    char *object;
-    ssize_t object_size;
-    unsigned long reference_count;
+    char *url;     // normalized cache key
+    char *vary;    // lowercased header names from Vary, NULL if none
+    char *variant; // request's values of the vary headers when stored
+    cache_object_t identity;
+    cache_object_t gzip; // gzip-encoded response, if compressed
+    ssize_t object_size; // size of the response as received
+    unsigned long reference_count; // the cache's and every reader's
     struct cache_block *next;
     struct cache_block *prev;
 } cache_block_t;
 
 /**
- * @brief Cache structure - doubly linked list
+ * @brief Cache structure - doubly linked list, plus the bodies of its blocks
+ * hashed by content
  */
 typedef struct cache {
     cache_block_t *head;
     cache_block_t *tail;
     ssize_t size;
+    long count; // number of blocks in the list
+    cache_body_t *bodies[BODY_TABLE_SIZE];
 } cache_t;
 
 /**
@@ -52,16 +107,86 @@ void init_cache();
 void free_cache();
 
 /**
- * @brief Allocate memory for a cache block
+ * @brief Enable or disable gzip variants
+ *
+ * When enabled, compressible text responses are gzip-compressed once when
+ * they are stored, and the compressed response is served to clients whose
+ * Accept-Encoding allows gzip.
+ *
+ * @param[in] enable Whether to store gzip variants
+ */
+void cache_set_gzip(bool enable);
+
+/**
+ * @brief Enable or disable in-memory LZ4 compression
+ *
+ * When enabled, objects that shrink by at least an eighth are kept
+ * LZ4-compressed, and the cache size is accounted on compressed sizes. Hits
+ * decompress into a per-thread scratch buffer before sending.
+ *
+ * @param[in] enable Whether to compress stored objects
+ */
+void cache_set_lz4(bool enable);
+
+/**
+ * @brief Enable or disable sharing of identical bodies
+ *
+ * When enabled, a body whose bytes are already cached under another key is
+ * not stored again; both blocks reference the same body, and the cache size
+ * is charged for it once.
+ *
+ * @param[in] enable Whether to share identical bodies
+ */
+void cache_set_dedup(bool enable);
+
+/**
+ * @brief Enable or disable sending bodies with sendfile
+ *
+ * When enabled, uncompressed bodies of at least SENDFILE_MIN_SIZE bytes are
+ * stored in a memfd of their own and mapped for reading, and hits send them
+ * with sendfile() instead of copying them from user space into the socket.
+ *
+ * @param[in] enable Whether to store large bodies in memfds
+ */
+void cache_set_sendfile(bool enable);
+
+/**
+ * @brief Normalize a request URI into a cache key
+ *
+ * Lowercases the scheme and host, drops the default port, the fragment and
+ * empty query parameters, and sorts the remaining query parameters, so that
+ * equivalent URIs share one cache entry.
+ *
  * @param[in] uri URI of GET request
- * @param[in] obj Web object
+ * @param[out] key Buffer for the normalized key
+ * @param[in] keylen Size of the key buffer
+ * @return 0 on success
+ * @return -1 if the URI is malformed or the key does not fit
+ */
+int normalize_cache_key(const char *uri, char *key, size_t keylen);
+
+/**
+ * @brief Allocate memory for a cache block
+ * @param[in] key Normalized cache key
+ * @param[in] vary Header names the object varies on, or NULL
+ * @param[in] variant Request values of the vary headers, or NULL
+ * @param[in] identity Response as received; ownership is taken
+ * @param[in] gzip gzip-encoded response, body NULL if none; ownership is taken
  * @param[in] obj_size Size of web object
  * @return Pointer to the allocated cache block
+ * @return NULL if out of memory, in which case identity and gzip are still
+ * the caller's
  */
-cache_block_t *alloc_block(const char *uri, char obj[], ssize_t obj_size);
+cache_block_t *alloc_block(const char *key, const char *vary,
+                           const char *variant, cache_object_t *identity,
+                           cache_object_t *gzip, ssize_t obj_size);
 
 /**
  * @brief Free all memory used by a cache block
+ *
+ * The block's bodies are released, and freed if no other block uses them.
+ * Must be called with the cache locked, once the reference count is 0.
+ *
  * @param block Cache block to be freed
  */
 void free_block(cache_block_t *block);
@@ -72,6 +197,15 @@ void free_block(cache_block_t *block);
  */
 void insert_head(cache_block_t *block);
 
+/**
+ * @brief Unlink a cache block from the list and drop the cache's reference
+ *
+ * The block is freed right away, or by its last reader if it is being sent.
+ *
+ * @param block Cache block to be removed
+ */
+void remove_block(cache_block_t *block);
+
 /**
  * @brief Remove the tail cache block of the list
  */
@@ -79,20 +213,49 @@ void remove_tail();
 
 /**
  * @brief Retrieve cache to check if the URL is in cache
+ *
+ * A cached object matches if its key equals the normalized URI and, when the
+ * response carried a Vary header, the request's values of the listed headers
+ * equal those of the request that filled the cache. The gzip-encoded response
+ * is sent instead of the original one if there is one and the request's
+ * Accept-Encoding allows it. Requests with a Range header are answered with
+ * the requested slices of the object.
+ *
  * @param[in] uri URI of GET request
+ * @param[in] headers Request header lines, "Name: value\r\n" each
  * @param[in] fd Connected descriptor
- * @return Size of web object of the URL
+ * @return Size of web object sent to the client
  * @return -1 if the URL is not found
  */
-ssize_t read_cache(const char *uri, int fd);
+ssize_t read_cache(const char *uri, const char *headers, int fd);
 
 /**
  * @brief Store a new web object in cache with its key
+ *
+ * Responses with "Vary: *" are not stored. Otherwise the object is stored as
+ * a variant selected by the request headers named in its Vary header. If gzip
+ * variants are enabled, a gzip-encoded copy of compressible responses is
+ * stored alongside. A body identical to one already cached is not stored
+ * again; the blocks share it.
+ *
+ * If the object lies in a pooled buffer that it fills at least half of, the
+ * cache keeps a reference to the buffer for the body instead of a copy.
+ *
  * @param[in] uri URI of GET request
+ * @param[in] headers Request header lines, "Name: value\r\n" each
  * @param[in] obj Web object
  * @param[in] obj_size Size of web object
+ * @param[in] buffer Buffer holding the object, or NULL to always copy it
+ */
+void write_cache(const char *uri, const char *headers, char object[],
+                 ssize_t object_size, buffer_t *buffer);
+
+/**
+ * @brief Read the number of objects in the cache and its size
+ * @param[out] objects Number of cached objects, counting each variant
+ * @param[out] bytes Bytes the cache is charged for
  */
-void write_cache(const char *uri, char object[], ssize_t object_size);
+void cache_stats(uint64_t *objects, uint64_t *bytes);
 
 /**
  * @brief Helper function to check correctness of cache
@@ -472,16 +472,11 @@ ssize_t rio_writen(int fd, const void *usrbuf, size_t n) {
 }
 
 /*
- * rio_read - This is a wrapper for the Unix read() function that
- *    transfers min(n, rio_cnt) bytes from an internal buffer to a user
- *    buffer, where n is the number of bytes requested by the user and
- *    rio_cnt is the number of unread bytes in the internal buffer. On
- *    entry, rio_read() refills the internal buffer via a call to
- *    read() if the internal buffer is empty.
+ * rio_fill - Refill the internal buffer via a call to read() if it is
+ *    empty. Returns the number of unread bytes in the internal buffer,
+ *    0 on EOF, or -1 on error.
  */
-static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n) {
-    size_t cnt;
-
+static ssize_t rio_fill(rio_t *rp) {
     while (rp->rio_cnt <= 0) { /* Refill if buf is empty */
         rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, sizeof(rp->rio_buf));
         if (rp->rio_cnt < 0) {
@@ -496,6 +491,24 @@ static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n) {
             rp->rio_bufptr = rp->rio_buf; /* Reset buffer ptr */
         }
     }
+    return rp->rio_cnt;
+}
+
+/*
+ * rio_read - This is a wrapper for the Unix read() function that
+ *    transfers min(n, rio_cnt) bytes from an internal buffer to a user
+ *    buffer, where n is the number of bytes requested by the user and
+ *    rio_cnt is the number of unread bytes in the internal buffer. On
+ *    entry, rio_read() refills the internal buffer via a call to
+ *    read() if the internal buffer is empty.
+ */
+static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n) {
+    size_t cnt;
+    ssize_t rc;
+
+    if ((rc = rio_fill(rp)) <= 0) {
+        return rc; /* EOF or error */
+    }
 
     /* Copy min(n, rp->rio_cnt) bytes from internal buf to user buf */
     cnt = n;
@@ -539,31 +552,47 @@ ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n) {
 
 /*
  * rio_readlineb - Robustly read a text line (buffered)
+ *    The internal buffer is searched for the newline with memchr(), and
+ *    the bytes up to it are copied at once rather than one at a time.
  */
 ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen) {
-    size_t n;
+    size_t n = 0;
     ssize_t rc;
-    char c, *bufp = usrbuf;
+    char *bufp = usrbuf;
 
-    for (n = 1; n < maxlen; n++) {
-        if ((rc = rio_read(rp, &c, 1)) == 1) {
-            *bufp++ = c;
-            if (c == '\n') {
-                n++;
-                break;
-            }
+    if (maxlen == 0) {
+        return 0;
+    }
+    while (n < maxlen - 1) {
+        if ((rc = rio_fill(rp)) < 0) {
+            return -1; /* Error */
         } else if (rc == 0) {
-            if (n == 1) {
+            if (n == 0) {
                 return 0; /* EOF, no data read */
             } else {
                 break; /* EOF, some data was read */
             }
-        } else {
-            return -1; /* Error */
+        }
+
+        /* Copy up to and including the newline, if it is in the buffer */
+        size_t cnt = maxlen - 1 - n;
+        if ((size_t)rp->rio_cnt < cnt) {
+            cnt = (size_t)rp->rio_cnt;
+        }
+        char *nl = memchr(rp->rio_bufptr, '\n', cnt);
+        if (nl != NULL) {
+            cnt = (size_t)(nl - rp->rio_bufptr) + 1;
+        }
+        memcpy(bufp + n, rp->rio_bufptr, cnt);
+        rp->rio_bufptr += cnt;
+        rp->rio_cnt -= (ssize_t)cnt;
+        n += cnt;
+        if (nl != NULL) {
+            break;
         }
     }
-    *bufp = 0;
-    return (ssize_t)(n - 1);
+    bufp[n] = 0;
+    return (ssize_t)n;
 }
 
 /********************************
@@ -0,0 +1,41 @@
+/**
+ * @file hash.h
+ * @brief Interface for fast content hashing, and for spreading threads over
+ * shards
+ */
+
+#ifndef HASH_H
+#define HASH_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief Hash a buffer with XXH64
+ *
+ * Produces the same values as the reference xxHash library's XXH64, at a few
+ * GB/s, so hashing a whole object costs less than copying it.
+ *
+ * @param[in] data Buffer to hash
+ * @param[in] len Length of the buffer
+ * @param[in] seed Seed of the hash
+ * @return 64-bit hash of the buffer
+ */
+uint64_t xxh64(const void *data, size_t len, uint64_t seed);
+
+/**
+ * @brief Pick the shard of a sharded structure the calling thread uses
+ *
+ * Thread IDs are addresses of thread descriptors, whose low bits are mostly
+ * zero; a multiplicative hash spreads them over the shards.
+ *
+ * @param[in] nshards Number of shards
+ * @return Index of the calling thread's shard, below nshards
+ */
+static inline unsigned thread_shard(unsigned nshards) {
+    uint64_t id = (uint64_t)(uintptr_t)pthread_self();
+    return (unsigned)(((id * 0x9E3779B97F4A7C15ULL) >> 32) % nshards);
+}
+
+#endif /* HASH_H */
@@ -0,0 +1,96 @@
+/**
+ * @file histogram.c
+ * @brief Latency histograms with bounded relative error
+ *
+ * A value below 2^SUB_BITS is its own bucket. Above that, a value whose
+ * highest set bit is b is shifted right by b - (SUB_BITS - 1), leaving a
+ * mantissa in [2^(SUB_BITS - 1), 2^SUB_BITS), and lands in bucket
+ * shift * 2^(SUB_BITS - 1) + mantissa.
+ */
+
+#include "histogram.h"
+
+#include <stdbool.h>
+#include <string.h>
+
+#define HALF (1 << (HISTOGRAM_SUB_BITS - 1))
+
+/*
+ * bucket_of - the bucket a value is counted in
+ */
+static int bucket_of(uint64_t value) {
+    if (value < (1 << HISTOGRAM_SUB_BITS)) {
+        return (int)value;
+    }
+    int msb = 63 - __builtin_clzll(value);
+    int shift = msb - (HISTOGRAM_SUB_BITS - 1);
+    return shift * HALF + (int)(value >> shift);
+}
+
+/*
+ * highest_in - the largest value counted in a bucket
+ */
+static uint64_t highest_in(int bucket) {
+    if (bucket < (1 << HISTOGRAM_SUB_BITS)) {
+        return bucket;
+    }
+    int shift = bucket / HALF - 1;
+    uint64_t mantissa = bucket % HALF + HALF;
+    return ((mantissa + 1) << shift) - 1;
+}
+
+void histogram_reset(histogram_t *h) {
+    memset(h, 0, sizeof(*h));
+}
+
+void histogram_record(histogram_t *h, uint64_t value) {
+    __atomic_add_fetch(&h->counts[bucket_of(value)], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&h->total, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&h->sum, value, __ATOMIC_RELAXED);
+
+    uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    while (value > max &&
+           !__atomic_compare_exchange_n(&h->max, &max, value, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+void histogram_merge(histogram_t *dst, const histogram_t *src) {
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        dst->counts[i] += src->counts[i];
+    }
+    dst->total += src->total;
+    dst->sum += src->sum;
+    if (src->max > dst->max) {
+        dst->max = src->max;
+    }
+}
+
+uint64_t histogram_percentile(const histogram_t *h, double percentile) {
+    if (h->total == 0) {
+        return 0;
+    }
+
+    // the rank of the value at the percentile, counting from 1
+    uint64_t rank = (uint64_t)(percentile / 100.0 * h->total + 0.5);
+    if (rank < 1) {
+        rank = 1;
+    }
+    if (rank > h->total) {
+        rank = h->total;
+    }
+
+    uint64_t seen = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= rank) {
+            uint64_t value = highest_in(i);
+            return value < h->max ? value : h->max;
+        }
+    }
+    return h->max;
+}
+
+double histogram_mean(const histogram_t *h) {
+    return h->total > 0 ? (double)h->sum / h->total : 0;
+}
@@ -0,0 +1,75 @@
+/**
+ * @file histogram.h
+ * @brief Interface for latency histograms with bounded relative error
+ *
+ * Values are counted in log-linear buckets, as in an HDR histogram: below
+ * 2^HISTOGRAM_SUB_BITS each value has a bucket of its own, and above that
+ * every power of two is split into 2^(HISTOGRAM_SUB_BITS - 1) buckets, so
+ * any value is known to within about 1.6%, from 0 to 2^64 - 1, in a fixed
+ * 30 KB. Recording is a single atomic increment, so threads can share a
+ * histogram, or keep their own and merge them when reporting.
+ */
+
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+
+/*
+ * Bits of precision kept of each value
+ */
+#define HISTOGRAM_SUB_BITS 7
+
+/*
+ * Number of buckets needed to cover every 64-bit value
+ */
+#define HISTOGRAM_BUCKETS                                                      \
+    ((64 - HISTOGRAM_SUB_BITS + 2) << (HISTOGRAM_SUB_BITS - 1))
+
+/**
+ * @brief A histogram; zero-initialized it is empty
+ */
+typedef struct histogram {
+    uint64_t counts[HISTOGRAM_BUCKETS];
+    uint64_t total; // number of values recorded
+    uint64_t sum;   // sum of the values, for the mean
+    uint64_t max;   // largest value recorded
+} histogram_t;
+
+/**
+ * @brief Empty a histogram
+ * @param[out] h The histogram
+ */
+void histogram_reset(histogram_t *h);
+
+/**
+ * @brief Record a value
+ * @param[in] h The histogram
+ * @param[in] value The value, e.g. a latency in microseconds
+ */
+void histogram_record(histogram_t *h, uint64_t value);
+
+/**
+ * @brief Add the counts of one histogram to another
+ * @param[in] dst Histogram added to
+ * @param[in] src Histogram added
+ */
+void histogram_merge(histogram_t *dst, const histogram_t *src);
+
+/**
+ * @brief Find a percentile
+ * @param[in] h The histogram
+ * @param[in] percentile Percentile, from 0 to 100, e.g. 99.9
+ * @return The largest value that falls in the same bucket as the percentile,
+ * or 0 if the histogram is empty
+ */
+uint64_t histogram_percentile(const histogram_t *h, double percentile);
+
+/**
+ * @brief Mean of the values recorded
+ * @param[in] h The histogram
+ * @return The mean, or 0 if the histogram is empty
+ */
+double histogram_mean(const histogram_t *h);
+
+#endif /* HISTOGRAM_H */
@@ -0,0 +1,505 @@
+/**
+ * @file http_parser.c
+ * @brief Incremental, zero-copy parser of HTTP request heads
+ *
+ * This program parses the request line and headers of an HTTP request in
+ * place. Parsed values are recorded as (offset, length) views into the
+ * buffer they were parsed from; C strings are only made, on demand, for the
+ * callers of parser_retrieve() and the header_t functions.
+ *
+ * Parsing goes a line at a time. The position of the next unparsed line and
+ * how far the search for its end has got are kept between calls, so bytes
+ * that arrive in pieces are scanned once in total. Line ends are found 16
+ * (SSE2) or 32 (AVX2) bytes at a time where the compiler targets those
+ * instruction sets.
+ *
+ * parser_parse_line() is kept for line-at-a-time callers: it appends each
+ * line to a buffer owned by the parser and parses that.
+ */
+
+#include "http_parser.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/* Number of values of parser_value_type */
+#define NVALUES (HTTP_VERSION + 1)
+
+/* Initial number of header views, doubled as needed */
+#define INITIAL_HEADERS 16
+
+struct parser {
+    const char *buf;   // buffer of the last call to parser_parse
+    size_t pos;        // offset of the next unparsed line
+    size_t scanned;    // offset up to which that line has no line end
+    bool got_request;  // whether the request line has been parsed
+    bool done;         // whether the blank line has been parsed
+    parser_state last; // kind of the last line parsed
+
+    parser_view_t values[NVALUES];
+    bool has_value[NVALUES];
+    char *strings[NVALUES]; // values copied for parser_retrieve
+
+    header_view_t *headers;
+    size_t nheaders;
+    size_t max_headers;
+    header_t **legacy; // headers copied for the header_t functions
+    size_t nlegacy;
+    size_t iter;
+
+    char *lines; // lines given to parser_parse_line
+    size_t lines_len;
+    size_t lines_cap;
+
+    void *(*alloc)(void *, size_t); // allocator, or NULL for malloc
+    void *alloc_ctx;
+};
+
+/*
+ * parser_alloc - allocate memory for the parser
+ */
+static void *parser_alloc(parser_t *p, size_t size) {
+    return p->alloc != NULL ? p->alloc(p->alloc_ctx, size) : malloc(size);
+}
+
+/*
+ * parser_realloc - grow memory of the parser from old_size to size bytes
+ * Memory from a caller's allocator is never freed, so it is copied instead.
+ */
+static void *parser_realloc(parser_t *p, void *ptr, size_t old_size,
+                            size_t size) {
+    if (p->alloc == NULL) {
+        return realloc(ptr, size);
+    }
+    void *grown = p->alloc(p->alloc_ctx, size);
+    if (grown != NULL && old_size > 0) {
+        memcpy(grown, ptr, old_size);
+    }
+    return grown;
+}
+
+/*
+ * find_line_end - find the first '\n' or NUL byte in [p, end)
+ * Returns end if there is none.
+ */
+static const char *find_line_end(const char *p, const char *end) {
+#if defined(__AVX2__)
+    const __m256i newline32 = _mm256_set1_epi8('\n');
+    const __m256i zero32 = _mm256_setzero_si256();
+    while (end - p >= 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)p);
+        unsigned mask = _mm256_movemask_epi8(_mm256_or_si256(
+            _mm256_cmpeq_epi8(v, newline32), _mm256_cmpeq_epi8(v, zero32)));
+        if (mask != 0) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 32;
+    }
+#endif
+#if defined(__SSE2__)
+    const __m128i newline = _mm_set1_epi8('\n');
+    const __m128i zero = _mm_setzero_si128();
+    while (end - p >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        unsigned mask = _mm_movemask_epi8(
+            _mm_or_si128(_mm_cmpeq_epi8(v, newline), _mm_cmpeq_epi8(v, zero)));
+        if (mask != 0) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 16;
+    }
+#endif
+    while (p < end && *p != '\n' && *p != '\0') {
+        p++;
+    }
+    return p;
+}
+
+/*
+ * set_value - record a value as the slice [start, end) of the buffer
+ */
+static void set_value(parser_t *p, parser_value_type type, const char *start,
+                      const char *end) {
+    p->values[type].offset = start - p->buf;
+    p->values[type].length = end - start;
+    p->has_value[type] = true;
+}
+
+/*
+ * parse_uri - split an absolute URI into its scheme, host, port and path
+ * Returns false if the URI is not of the form scheme://host[:port][path].
+ */
+static bool parse_uri(parser_t *p, const char *uri, const char *end) {
+    const char *sep = NULL;
+    for (const char *c = uri; c + 3 <= end; c++) {
+        if (c[0] == ':' && c[1] == '/' && c[2] == '/') {
+            sep = c;
+            break;
+        }
+    }
+    if (sep == NULL || sep == uri) {
+        return false;
+    }
+    set_value(p, SCHEME, uri, sep);
+
+    const char *host = sep + 3;
+    const char *host_end = host;
+    while (host_end < end && *host_end != '/' && *host_end != '?' &&
+           *host_end != '#') {
+        host_end++;
+    }
+    const char *path = host_end;
+
+    // the port follows the last colon, unless that is inside an IPv6 literal
+    const char *colon = NULL;
+    for (const char *c = host; c < host_end; c++) {
+        if (*c == ':') {
+            colon = c;
+        } else if (*c == ']') {
+            colon = NULL;
+        }
+    }
+    if (colon != NULL) {
+        set_value(p, PORT, colon + 1, host_end);
+        host_end = colon;
+    }
+    if (host + 1 < host_end && *host == '[' && host_end[-1] == ']') {
+        host++;
+        host_end--;
+    }
+    if (host == host_end) {
+        return false;
+    }
+    set_value(p, HOST, host, host_end);
+
+    if (path < end) {
+        set_value(p, PATH, path, end);
+    }
+    return true;
+}
+
+/*
+ * parse_request_line - parse "METHOD URI HTTP/version" in [line, end)
+ */
+static bool parse_request_line(parser_t *p, const char *line,
+                               const char *end) {
+    const char *sp1 = memchr(line, ' ', end - line);
+    if (sp1 == NULL || sp1 == line) {
+        return false;
+    }
+    const char *uri = sp1 + 1;
+    const char *sp2 = memchr(uri, ' ', end - uri);
+    if (sp2 == NULL || sp2 == uri) {
+        return false;
+    }
+    const char *version = sp2 + 1;
+    if ((size_t)(end - version) < strlen("HTTP/") + 1 ||
+        strncmp(version, "HTTP/", strlen("HTTP/"))) {
+        return false;
+    }
+
+    set_value(p, METHOD, line, sp1);
+    set_value(p, URI, uri, sp2);
+    set_value(p, HTTP_VERSION, version + strlen("HTTP/"), end);
+
+    // a path alone addresses the server parsing the request, there is no
+    // scheme, host or port
+    if (*uri == '/') {
+        set_value(p, PATH, uri, sp2);
+        return true;
+    }
+    return parse_uri(p, uri, sp2);
+}
+
+/*
+ * parse_header - parse "Name: value" in [line, end), the line ending at eol
+ */
+static bool parse_header(parser_t *p, const char *line, const char *end,
+                         const char *eol) {
+    const char *colon = memchr(line, ':', end - line);
+    if (colon == NULL || colon == line) {
+        return false;
+    }
+    for (const char *c = line; c < colon; c++) {
+        if (*c == ' ' || *c == '\t') {
+            return false; // no whitespace in names, nor folded lines
+        }
+    }
+
+    const char *value = colon + 1;
+    const char *value_end = end;
+    while (value < value_end && (*value == ' ' || *value == '\t')) {
+        value++;
+    }
+    while (value_end > value &&
+           (value_end[-1] == ' ' || value_end[-1] == '\t')) {
+        value_end--;
+    }
+
+    if (p->nheaders == p->max_headers) {
+        size_t max = p->max_headers == 0 ? INITIAL_HEADERS : 2 * p->max_headers;
+        header_view_t *headers = (header_view_t *)parser_realloc(
+            p, p->headers, p->max_headers * sizeof(*headers),
+            max * sizeof(*headers));
+        if (headers == NULL) {
+            return false;
+        }
+        p->headers = headers;
+        p->max_headers = max;
+    }
+
+    header_view_t *h = &p->headers[p->nheaders];
+    h->name.offset = line - p->buf;
+    h->name.length = colon - line;
+    h->value.offset = value - p->buf;
+    h->value.length = value_end - value;
+    h->line.offset = line - p->buf;
+    h->line.length = eol + 1 - line;
+    p->nheaders++;
+    return true;
+}
+
+parser_t *parser_new(void) {
+    return (parser_t *)calloc(1, sizeof(parser_t));
+}
+
+parser_t *parser_new_with(void *(*alloc)(void *ctx, size_t size), void *ctx) {
+    parser_t *p = (parser_t *)alloc(ctx, sizeof(parser_t));
+    if (p != NULL) {
+        memset(p, 0, sizeof(*p));
+        p->alloc = alloc;
+        p->alloc_ctx = ctx;
+    }
+    return p;
+}
+
+void parser_free(parser_t *p) {
+    if (p == NULL || p->alloc != NULL) {
+        return; // the caller's allocator owns the memory
+    }
+    for (int i = 0; i < NVALUES; i++) {
+        free(p->strings[i]);
+    }
+    for (size_t i = 0; i < p->nlegacy; i++) {
+        free(p->legacy[i]);
+    }
+    free(p->headers);
+    free(p->legacy);
+    free(p->lines);
+    free(p);
+}
+
+parser_state parser_parse(parser_t *p, const char *buf, size_t len) {
+    if (p == NULL || buf == NULL) {
+        return ERROR;
+    }
+    if (p->done) {
+        return DONE;
+    }
+    p->buf = buf;
+
+    while (true) {
+        const char *line = buf + p->pos;
+        const char *eol = find_line_end(buf + p->scanned, buf + len);
+        if (eol == buf + len) {
+            p->scanned = len;
+            return INCOMPLETE;
+        }
+        if (*eol == '\0') {
+            return ERROR;
+        }
+
+        const char *end = eol;
+        if (end > line && end[-1] == '\r') {
+            end--;
+        }
+        p->pos = eol + 1 - buf;
+        p->scanned = p->pos;
+
+        if (!p->got_request) {
+            if (!parse_request_line(p, line, end)) {
+                return ERROR;
+            }
+            p->got_request = true;
+            p->last = REQUEST;
+        } else if (end == line) {
+            p->done = true;
+            return DONE;
+        } else {
+            if (!parse_header(p, line, end, eol)) {
+                return ERROR;
+            }
+            p->last = HEADER;
+        }
+    }
+}
+
+size_t parser_head_size(parser_t *p) {
+    return p != NULL && p->done ? p->pos : 0;
+}
+
+parser_state parser_parse_line(parser_t *p, const char *line) {
+    if (p == NULL || line == NULL) {
+        return ERROR;
+    }
+
+    // keep a copy of the line, so that views into it outlive the caller's
+    size_t len = strlen(line);
+    if (len > 0 && line[len - 1] == '\n') {
+        len--;
+    }
+    if (len > 0 && line[len - 1] == '\r') {
+        len--;
+    }
+    if (p->lines_len + len + 2 > p->lines_cap) {
+        size_t cap = p->lines_cap == 0 ? PARSER_MAXLINE : 2 * p->lines_cap;
+        while (p->lines_len + len + 2 > cap) {
+            cap *= 2;
+        }
+        char *lines = (char *)parser_realloc(p, p->lines, p->lines_len, cap);
+        if (lines == NULL) {
+            return ERROR;
+        }
+        p->lines = lines;
+        p->lines_cap = cap;
+    }
+    memcpy(p->lines + p->lines_len, line, len);
+    p->lines_len += len;
+    p->lines[p->lines_len++] = '\r';
+    p->lines[p->lines_len++] = '\n';
+
+    // a blank line is not a request line or a header
+    parser_state state = parser_parse(p, p->lines, p->lines_len);
+    return state == INCOMPLETE ? p->last : ERROR;
+}
+
+/*
+ * copy_view - copy a view of the buffer into a new C string
+ */
+static char *copy_view(parser_t *p, parser_view_t view) {
+    char *s = (char *)parser_alloc(p, view.length + 1);
+    if (s != NULL) {
+        memcpy(s, p->buf + view.offset, view.length);
+        s[view.length] = '\0';
+    }
+    return s;
+}
+
+int parser_retrieve(parser_t *p, parser_value_type type, const char **val) {
+    if (p == NULL || type < 0 || type >= NVALUES || val == NULL) {
+        return -1;
+    }
+    if (!p->got_request) {
+        return -2;
+    }
+
+    // values the URI may leave out have defaults
+    if (!p->has_value[type]) {
+        if (type == PORT) {
+            *val = "80";
+            return 0;
+        }
+        if (type == PATH) {
+            *val = "/";
+            return 0;
+        }
+        return -2;
+    }
+
+    if (p->strings[type] == NULL) {
+        p->strings[type] = copy_view(p, p->values[type]);
+        if (p->strings[type] == NULL) {
+            return -1;
+        }
+    }
+    *val = p->strings[type];
+    return 0;
+}
+
+int parser_retrieve_view(parser_t *p, parser_value_type type,
+                         parser_view_t *view) {
+    if (p == NULL || type < 0 || type >= NVALUES || view == NULL) {
+        return -1;
+    }
+    if (!p->has_value[type]) {
+        return -2;
+    }
+    *view = p->values[type];
+    return 0;
+}
+
+/*
+ * legacy_header - the i-th header as a header_t of C strings, made on first
+ * use
+ */
+static header_t *legacy_header(parser_t *p, size_t i) {
+    if (i >= p->nlegacy) {
+        header_t **legacy = (header_t **)parser_realloc(
+            p, p->legacy, p->nlegacy * sizeof(*legacy),
+            p->nheaders * sizeof(*legacy));
+        if (legacy == NULL) {
+            return NULL;
+        }
+        memset(legacy + p->nlegacy, 0,
+               (p->nheaders - p->nlegacy) * sizeof(*legacy));
+        p->legacy = legacy;
+        p->nlegacy = p->nheaders;
+    }
+    if (p->legacy[i] == NULL) {
+        header_view_t *h = &p->headers[i];
+        // one allocation holds the struct and both strings
+        size_t size = sizeof(header_t) + h->name.length + h->value.length + 2;
+        header_t *header = (header_t *)parser_alloc(p, size);
+        if (header == NULL) {
+            return NULL;
+        }
+        char *name = (char *)(header + 1);
+        char *value = name + h->name.length + 1;
+        memcpy(name, p->buf + h->name.offset, h->name.length);
+        name[h->name.length] = '\0';
+        memcpy(value, p->buf + h->value.offset, h->value.length);
+        value[h->value.length] = '\0';
+        header->name = name;
+        header->value = value;
+        p->legacy[i] = header;
+    }
+    return p->legacy[i];
+}
+
+header_t *parser_lookup_header(parser_t *p, const char *name) {
+    if (p == NULL || name == NULL) {
+        return NULL;
+    }
+
+    size_t len = strlen(name);
+    for (size_t i = 0; i < p->nheaders; i++) {
+        header_view_t *h = &p->headers[i];
+        if (h->name.length == len &&
+            !strncasecmp(p->buf + h->name.offset, name, len)) {
+            return legacy_header(p, i);
+        }
+    }
+    return NULL;
+}
+
+header_t *parser_retrieve_next_header(parser_t *p) {
+    if (p == NULL || p->iter >= p->nheaders) {
+        return NULL;
+    }
+    return legacy_header(p, p->iter++);
+}
+
+const header_view_t *parser_header_view(parser_t *p, size_t i) {
+    if (p == NULL || i >= p->nheaders) {
+        return NULL;
+    }
+    return &p->headers[i];
+}
@@ -5,6 +5,13 @@
  * This library is intended to be used to parse HTTP requests for CMU's 15-213
  * proxylab.
  *
+ * Requests can be given to the parser a line at a time with
+ * parser_parse_line(), or incrementally as they arrive with parser_parse(),
+ * which parses the caller's receive buffer in place and resumes where it left
+ * off when called again with more bytes. Values parsed by parser_parse() can
+ * be retrieved without copying as views, (offset, length) slices of that
+ * buffer.
+ *
  * When using the parser library, strings that are given to the parser by a
  * caller are still owned by the caller, and therefore should be cleaned up by
  * the caller. The values stored in the parser will still be vaild if the
@@ -17,6 +24,8 @@
 #ifndef __HTTP_PARSER_H__
 #define __HTTP_PARSER_H__
 
+#include <stddef.h>
+
 #define MAXNAME 256
 #define PARSER_MAXLINE 4096
 
@@ -38,15 +47,38 @@ typedef struct header {
     const char *value; /**< the value of the header */
 } header_t;
 
+/**
+ * @brief A parsed value, as a slice of the buffer given to `parser_parse`
+ *
+ * Views hold offsets rather than pointers, so they stay valid when the
+ * caller's buffer is moved or grown between calls.
+ */
+typedef struct parser_view {
+    size_t offset; /**< offset of the first byte in the buffer */
+    size_t length; /**< number of bytes */
+} parser_view_t;
+
+/**
+ * @brief A parsed HTTP header, as views into the parsed buffer
+ */
+typedef struct header_view {
+    parser_view_t name;  /**< the name of the header */
+    parser_view_t value; /**< the value, without surrounding whitespace */
+    parser_view_t line;  /**< the whole line, including its line ending */
+} header_view_t;
+
 /**
  * @brief Different states the parse can be in
  *
- * After calling `parser_parse_line` the parser will return one of these states.
+ * After calling `parser_parse_line` the parser will return one of the first
+ * three states; `parser_parse` returns one of the last three.
  */
 typedef enum parser_state {
-    REQUEST, /**< parsed request line */
-    HEADER,  /**< parsed an HTTP header */
-    ERROR    /**< an error occurred */
+    REQUEST,    /**< parsed request line */
+    HEADER,     /**< parsed an HTTP header */
+    ERROR,      /**< an error occurred */
+    INCOMPLETE, /**< parsed all complete lines, more input is needed */
+    DONE        /**< parsed the blank line ending the request headers */
 } parser_state;
 
 /**
@@ -74,10 +106,24 @@ typedef enum parser_value {
  */
 parser_t *parser_new(void);
 
+/**
+ * @brief Initialize a parser that takes its memory from the given allocator
+ *
+ * The parser and everything it allocates come from alloc, and are never
+ * freed by the parser; they last as long as the allocator keeps them, e.g.
+ * until an arena is reset.
+ *
+ * @param[in] alloc Allocator, called with ctx and a number of bytes
+ * @param[in] ctx Context passed to alloc
+ * @return The parser, or NULL if out of memory
+ */
+parser_t *parser_new_with(void *(*alloc)(void *ctx, size_t size), void *ctx);
+
 /**
  * @brief Destroy a parser
  *
- * This must be called after finished using the parser to free its memory
+ * This must be called after finished using the parser to free its memory.
+ * It does nothing for a parser made with parser_new_with().
  *
  * @param[in] p The parser to be destroyed
  */
@@ -102,6 +148,40 @@ void parser_free(parser_t *p);
  */
 parser_state parser_parse_line(parser_t *p, const char *line);
 
+/**
+ * @brief Parse the head of an HTTP request as it arrives
+ *
+ * The buffer holds all bytes of the request received so far, starting with
+ * the request line. Each call parses the lines completed since the previous
+ * one, so the buffer must be given again, with the same contents followed by
+ * any new bytes; it may have moved in between. Lines may end with '\r\n' or
+ * '\n'. Nothing is copied: parsed values are recorded as views into the
+ * buffer.
+ *
+ * A parser is used either with this function or with `parser_parse_line`,
+ * not both.
+ *
+ * @param[in] p The parser
+ * @param[in] buf The bytes of the request received so far
+ * @param[in] len Number of bytes in buf
+ *
+ * @return DONE once the blank line ending the headers has been parsed; any
+ * bytes after it are not examined
+ * @return INCOMPLETE if more bytes are needed
+ * @return ERROR if the request is malformed
+ */
+parser_state parser_parse(parser_t *p, const char *buf, size_t len);
+
+/**
+ * @brief Size of the head of the request parsed by `parser_parse`
+ *
+ * @param[in] p The parser
+ *
+ * @return Number of bytes of the request line, headers and blank line, or 0
+ * if `parser_parse` has not returned DONE
+ */
+size_t parser_head_size(parser_t *p);
+
 /**
  * @brief Retrieve a parsed field
  *
@@ -126,12 +206,34 @@ parser_state parser_parse_line(parser_t *p, const char *line);
  * @param[in] type the value to retrieve
  * @param[out] val a pointer to the value that is retrieved
  *
+ * A request whose URI is just a path, e.g. "GET /health HTTP/1.0", has no
+ * SCHEME or HOST.
+ *
  * @return 0 on success
  * @return -2 if the requested type has not been parsed
  * @return -1 any other error
  */
 int parser_retrieve(parser_t *p, parser_value_type type, const char **val);
 
+/**
+ * @brief Retrieve a parsed field as a view, without copying
+ *
+ * Like `parser_retrieve`, but the value is given as a slice of the buffer it
+ * was parsed from. Values the request does not contain, such as the port of
+ * a URI without one, are not available as views.
+ *
+ * @param[in] p The parser
+ * @param[in] type the value to retrieve
+ * @param[out] view the slice of the buffer holding the value
+ *
+ * @return 0 on success
+ * @return -2 if the requested type has not been parsed, or is not in the
+ * request
+ * @return -1 any other error
+ */
+int parser_retrieve_view(parser_t *p, parser_value_type type,
+                         parser_view_t *view);
+
 /**
  * @brief Retrieve a specific header
  *
@@ -170,4 +272,17 @@ header_t *parser_lookup_header(parser_t *p, const char *name);
  */
 header_t *parser_retrieve_next_header(parser_t *p);
 
+/**
+ * @brief Retrieve a parsed header as views, without copying
+ *
+ * Headers are numbered from 0 in the order they appear in the request.
+ *
+ * @param[in] p The parser
+ * @param[in] i The number of the header
+ *
+ * @return NULL if fewer than i + 1 headers have been parsed
+ * @return a pointer to a header_view_t struct otherwise
+ */
+const header_view_t *parser_header_view(parser_t *p, size_t i);
+
 #endif /* __HTTP_PARSER_H__ */
@@ -0,0 +1,139 @@
+/**
+ * @file http_util.c
+ * @brief Helpers for working with raw HTTP header blocks
+ */
+
+#include "http_util.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <strings.h>
+
+/*
+ * Size of the perfect hash table of request header names; a power of two
+ */
+#define HEADER_TABLE_SIZE 32
+
+/*
+ * header_hash - hash of a header name, from its length and its first and
+ * last characters with ASCII case folded; the multiplier was chosen so that
+ * no two names in header_table collide
+ */
+static unsigned header_hash(const char *name, size_t len) {
+    return (len + 14 * (name[0] | 0x20) + (name[len - 1] | 0x20)) &
+           (HEADER_TABLE_SIZE - 1);
+}
+
+/* Request headers treated specially, at the slot of their hash */
+static const struct {
+    const char *name;
+    header_kind_t kind;
+} header_table[HEADER_TABLE_SIZE] = {
+    [1] = {"Proxy-Authorization", HEADER_HOP},
+    [2] = {"Connection", HEADER_HOP},
+    [4] = {"User-Agent", HEADER_USER_AGENT},
+    [6] = {"Range", HEADER_RANGE},
+    [8] = {"Host", HEADER_HOST},
+    [9] = {"Keep-Alive", HEADER_HOP},
+    [11] = {"If-Range", HEADER_RANGE},
+    [16] = {"Transfer-Encoding", HEADER_HOP},
+    [17] = {"Trailer", HEADER_HOP},
+    [18] = {"Upgrade", HEADER_HOP},
+    [23] = {"Proxy-Authenticate", HEADER_HOP},
+    [30] = {"Proxy-Connection", HEADER_HOP},
+    [31] = {"TE", HEADER_HOP},
+};
+
+bool header_value(const char *line, const char *eol, const char *name,
+                  const char **value, size_t *value_len) {
+    size_t name_len = strlen(name);
+    if ((size_t)(eol - line) <= name_len || line[name_len] != ':' ||
+        strncasecmp(line, name, name_len)) {
+        return false;
+    }
+
+    const char *start = line + name_len + 1;
+    const char *end = eol;
+    while (start < end && isspace((unsigned char)*start)) {
+        start++;
+    }
+    while (end > start && isspace((unsigned char)end[-1])) {
+        end--;
+    }
+    *value = start;
+    *value_len = end - start;
+    return true;
+}
+
+header_kind_t classify_header(const char *name, size_t len) {
+    if (len == 0) {
+        return HEADER_OTHER;
+    }
+
+    unsigned slot = header_hash(name, len);
+    const char *candidate = header_table[slot].name;
+    if (candidate != NULL && strlen(candidate) == len &&
+        !strncasecmp(name, candidate, len)) {
+        return header_table[slot].kind;
+    }
+    return HEADER_OTHER;
+}
+
+bool find_header(const char *start, const char *end, const char *name,
+                 const char **value, size_t *value_len) {
+    const char *line = start;
+    while (line < end) {
+        const char *eol = memchr(line, '\n', end - line);
+        if (eol == NULL) {
+            eol = end;
+        }
+        if (eol == line || (eol == line + 1 && *line == '\r')) {
+            break;
+        }
+        if (header_value(line, eol, name, value, value_len)) {
+            return true;
+        }
+        line = eol + 1;
+    }
+    return false;
+}
+
+const char *find_body(const char *object, ssize_t object_size) {
+    for (ssize_t i = 0; i + 3 < object_size; i++) {
+        if (object[i] == '\r' && object[i + 1] == '\n' &&
+            object[i + 2] == '\r' && object[i + 3] == '\n') {
+            return object + i + 4;
+        }
+    }
+    return NULL;
+}
+
+ssize_t writev_all(int fd, struct iovec *iov, int iovcnt) {
+    ssize_t total = 0;
+
+    while (iovcnt > 0) {
+        int batch = iovcnt < IOV_MAX ? iovcnt : IOV_MAX;
+        ssize_t n = writev(fd, iov, batch);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        total += n;
+
+        // skip the buffers written in full, then advance into a partial one
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return total;
+}
@@ -0,0 +1,93 @@
+/**
+ * @file http_util.h
+ * @brief Helpers for working with raw HTTP header blocks
+ *
+ * Header blocks are handled as the bytes read from the wire: a start line
+ * followed by "Name: value\r\n" lines and a blank line. None of these helpers
+ * copy or modify the block.
+ */
+
+#ifndef HTTP_UTIL_H
+#define HTTP_UTIL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/**
+ * @brief Match one header line against a header name
+ * @param[in] line Start of the header line
+ * @param[in] eol End of the header line (the '\n' or the end of the block)
+ * @param[in] name Header name, matched case-insensitively
+ * @param[out] value Header value with surrounding whitespace trimmed
+ * @param[out] value_len Length of the value
+ * @return true if the line is a header with the given name
+ */
+bool header_value(const char *line, const char *eol, const char *name,
+                  const char **value, size_t *value_len);
+
+/**
+ * @brief Find the first header with a given name in a header block
+ *
+ * The search stops at the blank line ending the block. A start line is never
+ * mistaken for a header, so a whole response can be searched.
+ *
+ * @param[in] start Start of the header lines
+ * @param[in] end End of the buffer holding them
+ * @param[in] name Header name, matched case-insensitively
+ * @param[out] value Header value with surrounding whitespace trimmed
+ * @param[out] value_len Length of the value
+ * @return true if the header is present
+ */
+bool find_header(const char *start, const char *end, const char *name,
+                 const char **value, size_t *value_len);
+
+/**
+ * @brief How the proxy treats a request header when forwarding it
+ */
+typedef enum header_kind {
+    HEADER_OTHER,      /**< forwarded unchanged */
+    HEADER_HOST,       /**< forwarded, or made up from the URI if missing */
+    HEADER_USER_AGENT, /**< replaced by the proxy's */
+    HEADER_HOP,        /**< hop-by-hop, dropped (Connection is replaced) */
+    HEADER_RANGE       /**< Range and If-Range, applied by the proxy */
+} header_kind_t;
+
+/**
+ * @brief Classify a request header by name
+ *
+ * The names the proxy treats specially are found through a perfect hash of
+ * the name's length and first and last characters, so classifying a header
+ * costs one case-insensitive comparison.
+ *
+ * @param[in] name Header name, not NUL-terminated
+ * @param[in] len Length of the name
+ * @return The kind of the header
+ */
+header_kind_t classify_header(const char *name, size_t len);
+
+/**
+ * @brief Find the start of the body of a response
+ * @param[in] object Response, starting with the status line
+ * @param[in] object_size Size of the response
+ * @return Pointer to the first byte after the blank line ending the headers
+ * @return NULL if the response has no complete header block
+ */
+const char *find_body(const char *object, ssize_t object_size);
+
+/**
+ * @brief Write all bytes described by an iovec array
+ *
+ * Like rio_writen, this retries on short writes and on EINTR. The iovec array
+ * is modified as bytes are written.
+ *
+ * @param[in] fd Descriptor to write to
+ * @param[in] iov Buffers to write
+ * @param[in] iovcnt Number of buffers
+ * @return Number of bytes written
+ * @return -1 on error
+ */
+ssize_t writev_all(int fd, struct iovec *iov, int iovcnt);
+
+#endif /* HTTP_UTIL_H */
@@ -0,0 +1,262 @@
+/**
+ * @file lz4.c
+ * @brief LZ4 block compression
+ *
+ * This program implements the LZ4 block format: a block is a series of
+ * sequences, each a token byte (literal length in the high nibble, match
+ * length minus 4 in the low nibble), optional length extension bytes, the
+ * literals, a 2-byte little-endian match offset and optional match length
+ * extension bytes. The last sequence holds only literals.
+ *
+ * The compressor is the single-pass greedy matcher of the reference
+ * implementation: a hash table of the last position of every 4-byte prefix,
+ * extended forward and backward on a hit. It favours speed over ratio, which
+ * is what the cache wants on its fill path.
+ */
+
+#include "lz4.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#define HASH_LOG 12
+#define MIN_MATCH 4
+#define WILD_COPY 16
+#define MAX_OFFSET 65535
+#define RUN_MASK 15
+
+/*
+ * Format constraints: the last LAST_LITERALS bytes are always literals, and
+ * the last match starts at least MF_LIMIT bytes before the end of the input
+ */
+#define LAST_LITERALS 5
+#define MF_LIMIT 12
+
+static uint32_t read32(const char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint64_t read64(const char *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t hash4(uint32_t v) {
+    return (v * 2654435761U) >> (32 - HASH_LOG);
+}
+
+/*
+ * match_length - count the bytes ip and ref have in common, comparing eight
+ * bytes at a time, without reading at or past limit
+ */
+static size_t match_length(const char *ip, const char *ref,
+                           const char *limit) {
+    const char *start = ip;
+    while (ip + sizeof(uint64_t) <= limit) {
+        uint64_t diff = read64(ip) ^ read64(ref);
+        if (diff != 0) {
+            return ip - start + __builtin_ctzll(diff) / 8;
+        }
+        ip += sizeof(uint64_t);
+        ref += sizeof(uint64_t);
+    }
+    while (ip < limit && *ip == *ref) {
+        ip++;
+        ref++;
+    }
+    return ip - start;
+}
+
+/*
+ * write_length - write the extension bytes of a length whose nibble in the
+ * token was saturated
+ */
+static char *write_length(char *op, size_t len) {
+    for (len -= RUN_MASK; len >= 255; len -= 255) {
+        *op++ = (char)255;
+    }
+    *op++ = (char)len;
+    return op;
+}
+
+/*
+ * emit_sequence - write one sequence: litlen literals from lit, then a match
+ * of matchlen bytes at the given offset, or none if matchlen is 0
+ * Returns false if the sequence does not fit before oend.
+ */
+static bool emit_sequence(char **opp, char *oend, const char *lit,
+                          size_t litlen, size_t offset, size_t matchlen) {
+    char *op = *opp;
+    size_t need = 1 + litlen / 255 + 1 + litlen + 2 + matchlen / 255 + 1;
+    if ((size_t)(oend - op) < need) {
+        return false;
+    }
+
+    char *token = op++;
+    *token = (char)((litlen < RUN_MASK ? litlen : RUN_MASK) << 4);
+    if (litlen >= RUN_MASK) {
+        op = write_length(op, litlen);
+    }
+    memcpy(op, lit, litlen);
+    op += litlen;
+
+    if (matchlen > 0) {
+        *op++ = (char)(offset & 0xff);
+        *op++ = (char)(offset >> 8);
+        size_t ml = matchlen - MIN_MATCH;
+        *token |= (char)(ml < RUN_MASK ? ml : RUN_MASK);
+        if (ml >= RUN_MASK) {
+            op = write_length(op, ml);
+        }
+    }
+
+    *opp = op;
+    return true;
+}
+
+size_t lz4_compress(const char *src, size_t srclen, char *dst, size_t dstcap) {
+    uint32_t table[1 << HASH_LOG];
+    const char *ip = src;
+    const char *anchor = src;
+    const char *end = src + srclen;
+    char *op = dst;
+    char *oend = dst + dstcap;
+
+    if (srclen > MF_LIMIT) {
+        const char *mflimit = end - MF_LIMIT;
+        const char *matchlimit = end - LAST_LITERALS;
+
+        // after every 64 consecutive misses, step one byte further, so that
+        // incompressible input is skipped over quickly
+        unsigned misses = 1 << 6;
+
+        memset(table, 0, sizeof(table));
+        for (ip++; ip <= mflimit;) {
+            uint32_t seq = read32(ip);
+            uint32_t h = hash4(seq);
+            const char *ref = src + table[h];
+            table[h] = ip - src;
+            if (ref >= ip || ip - ref > MAX_OFFSET || read32(ref) != seq) {
+                ip += misses++ >> 6;
+                continue;
+            }
+            misses = 1 << 6;
+
+            // extend the match backward into pending literals, then forward
+            while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            size_t len = MIN_MATCH + match_length(ip + MIN_MATCH,
+                                                  ref + MIN_MATCH, matchlimit);
+
+            if (!emit_sequence(&op, oend, anchor, ip - anchor, ip - ref,
+                               len)) {
+                return 0;
+            }
+            ip += len;
+            anchor = ip;
+        }
+    }
+
+    // the remaining input goes out as literals
+    if (!emit_sequence(&op, oend, anchor, end - anchor, 0, 0)) {
+        return 0;
+    }
+    return op - dst;
+}
+
+/*
+ * read_length - read the extension bytes of a saturated length
+ * Returns false if the input ends first.
+ */
+static bool read_length(const unsigned char **ipp, const unsigned char *iend,
+                        size_t *len) {
+    const unsigned char *ip = *ipp;
+    unsigned char b;
+    do {
+        if (ip >= iend) {
+            return false;
+        }
+        b = *ip++;
+        *len += b;
+    } while (b == 255);
+    *ipp = ip;
+    return true;
+}
+
+ssize_t lz4_decompress(const char *src, size_t srclen, char *dst,
+                       size_t dstcap) {
+    const unsigned char *ip = (const unsigned char *)src;
+    const unsigned char *iend = ip + srclen;
+    char *op = dst;
+    char *oend = dst + dstcap;
+
+    while (ip < iend) {
+        unsigned char token = *ip++;
+
+        size_t litlen = token >> 4;
+        if (litlen == RUN_MASK && !read_length(&ip, iend, &litlen)) {
+            return -1;
+        }
+        if ((size_t)(iend - ip) < litlen || (size_t)(oend - op) < litlen) {
+            return -1;
+        }
+        // short literal runs are copied with one fixed-size copy when there
+        // is slack on both sides
+        if (litlen <= WILD_COPY && iend - ip >= WILD_COPY &&
+            oend - op >= WILD_COPY) {
+            memcpy(op, ip, WILD_COPY);
+        } else {
+            memcpy(op, ip, litlen);
+        }
+        op += litlen;
+        ip += litlen;
+
+        // the last sequence has no match part
+        if (ip == iend) {
+            break;
+        }
+
+        if (iend - ip < 2) {
+            return -1;
+        }
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - dst)) {
+            return -1;
+        }
+
+        size_t matchlen = token & RUN_MASK;
+        if (matchlen == RUN_MASK && !read_length(&ip, iend, &matchlen)) {
+            return -1;
+        }
+        matchlen += MIN_MATCH;
+        if ((size_t)(oend - op) < matchlen) {
+            return -1;
+        }
+
+        // copy in eight byte chunks when the chunks cannot overlap and there
+        // is room for the last one to run past the match; overlapping matches
+        // repeat the last offset bytes, copy those bytewise
+        const char *ref = op - offset;
+        if (offset >= sizeof(uint64_t) &&
+            (size_t)(oend - op) >= matchlen + sizeof(uint64_t)) {
+            for (size_t i = 0; i < matchlen; i += sizeof(uint64_t)) {
+                memcpy(op + i, ref + i, sizeof(uint64_t));
+            }
+        } else if (offset >= matchlen) {
+            memcpy(op, ref, matchlen);
+        } else {
+            for (size_t i = 0; i < matchlen; i++) {
+                op[i] = ref[i];
+            }
+        }
+        op += matchlen;
+    }
+    return op - dst;
+}
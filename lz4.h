@@ -0,0 +1,48 @@
+/**
+ * @file lz4.h
+ * @brief Interface for LZ4 block compression
+ *
+ * A small implementation of the LZ4 block format, used by the cache to keep
+ * objects compressed in memory. Compressed blocks are compatible with the
+ * reference implementation's LZ4_compress_default/LZ4_decompress_safe.
+ */
+
+#ifndef LZ4_H
+#define LZ4_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * Worst case compressed size of n bytes of input
+ */
+#define LZ4_BOUND(n) ((n) + (n) / 255 + 16)
+
+/**
+ * @brief Compress a buffer into an LZ4 block
+ * @param[in] src Input data
+ * @param[in] srclen Size of input data
+ * @param[out] dst Output buffer
+ * @param[in] dstcap Size of output buffer
+ * @return Size of the compressed block
+ * @return 0 if the block does not fit in dstcap bytes
+ */
+size_t lz4_compress(const char *src, size_t srclen, char *dst, size_t dstcap);
+
+/**
+ * @brief Decompress an LZ4 block
+ *
+ * The input is fully validated, so a corrupt block never makes this read or
+ * write out of bounds.
+ *
+ * @param[in] src Compressed block
+ * @param[in] srclen Size of compressed block
+ * @param[out] dst Output buffer
+ * @param[in] dstcap Size of output buffer
+ * @return Size of the decompressed data
+ * @return -1 if the block is corrupt or does not fit in dstcap bytes
+ */
+ssize_t lz4_decompress(const char *src, size_t srclen, char *dst,
+                       size_t dstcap);
+
+#endif /* LZ4_H */
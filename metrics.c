@@ -0,0 +1,112 @@
+/**
+ * @file metrics.c
+ * @brief The proxy's counters, exported as Prometheus metrics
+ *
+ * Threads sharing a shard still add atomically, so no count is lost; the
+ * sums read while threads are counting are not a consistent snapshot across
+ * counters, which scrapes can tolerate.
+ */
+
+#include "metrics.h"
+#include "hash.h"
+
+#include <stdio.h>
+
+/* A shard of the counters, padded to a cache line of its own */
+typedef struct metrics_shard {
+    uint64_t counts[NMETRICS];
+} __attribute__((aligned(CACHE_LINE_SIZE))) metrics_shard_t;
+
+static metrics_shard_t shards[METRIC_SHARDS];
+
+/* A metric's name, type and description */
+typedef struct metric_info {
+    const char *name;
+    const char *type;
+    const char *help;
+} metric_info_t;
+
+static const metric_info_t counters[NMETRICS] = {
+    [METRIC_HITS] = {"proxy_cache_hits_total", "counter",
+                     "Requests served from the cache"},
+    [METRIC_MISSES] = {"proxy_cache_misses_total", "counter",
+                       "Cache lookups that missed"},
+    [METRIC_HIT_BYTES] = {"proxy_cache_sent_bytes_total", "counter",
+                          "Bytes sent to clients from the cache"},
+    [METRIC_ORIGIN_BYTES] = {"proxy_origin_received_bytes_total", "counter",
+                             "Bytes received from web servers"},
+    [METRIC_EVICTIONS] = {"proxy_cache_evictions_total", "counter",
+                          "Objects evicted from the cache to make room"},
+    [METRIC_CONNECT_FAILURES] = {"proxy_origin_connect_failures_total",
+                                 "counter",
+                                 "Failures to resolve or connect to a web "
+                                 "server"},
+    [METRIC_LOCK_WAITS] = {"proxy_cache_lock_waits_total", "counter",
+                           "Acquisitions of the cache lock that had to wait"},
+    [METRIC_LOCK_WAIT_NS] = {"proxy_cache_lock_wait_seconds_total", "counter",
+                             "Time spent waiting for the cache lock"},
+};
+
+void metric_add(metric_t metric, uint64_t n) {
+    __atomic_add_fetch(&shards[thread_shard(METRIC_SHARDS)].counts[metric], n,
+                       __ATOMIC_RELAXED);
+}
+
+uint64_t metric_value(metric_t metric) {
+    uint64_t sum = 0;
+    for (int i = 0; i < METRIC_SHARDS; i++) {
+        sum += __atomic_load_n(&shards[i].counts[metric], __ATOMIC_RELAXED);
+    }
+    return sum;
+}
+
+/*
+ * report_one - render one metric, advancing *pos unless it does not fit
+ */
+static void report_one(char *buf, size_t len, size_t *pos, const char *name,
+                       const char *type, const char *help,
+                       const char *value) {
+    int n = snprintf(buf + *pos, len - *pos,
+                     "# HELP %s %s\n# TYPE %s %s\n%s %s\n", name, help, name,
+                     type, name, value);
+    if (n > 0 && *pos + n < len) {
+        *pos += n;
+    } else {
+        buf[*pos] = '\0';
+    }
+}
+
+size_t metrics_report(const metrics_gauges_t *gauges, char *buf, size_t len) {
+    char value[32];
+    size_t pos = 0;
+
+    if (len == 0) {
+        return 0;
+    }
+    buf[0] = '\0';
+    for (int m = 0; m < NMETRICS; m++) {
+        uint64_t count = metric_value((metric_t)m);
+        if (m == METRIC_LOCK_WAIT_NS) {
+            snprintf(value, sizeof(value), "%.9f", count / 1e9);
+        } else {
+            snprintf(value, sizeof(value), "%lu", (unsigned long)count);
+        }
+        report_one(buf, len, &pos, counters[m].name, counters[m].type,
+                   counters[m].help, value);
+    }
+
+    snprintf(value, sizeof(value), "%lu",
+             (unsigned long)gauges->cache_objects);
+    report_one(buf, len, &pos, "proxy_cache_objects", "gauge",
+               "Objects in the cache", value);
+    snprintf(value, sizeof(value), "%lu", (unsigned long)gauges->cache_bytes);
+    report_one(buf, len, &pos, "proxy_cache_bytes", "gauge",
+               "Bytes the cache is charged for", value);
+    snprintf(value, sizeof(value), "%lu", (unsigned long)gauges->connections);
+    report_one(buf, len, &pos, "proxy_connections", "gauge",
+               "Client connections in flight", value);
+    snprintf(value, sizeof(value), "%lu", (unsigned long)gauges->fetches);
+    report_one(buf, len, &pos, "proxy_origin_fetches", "gauge",
+               "Fetches from web servers in flight", value);
+    return pos;
+}
@@ -0,0 +1,70 @@
+/**
+ * @file metrics.h
+ * @brief Interface for the proxy's counters, exported as Prometheus metrics
+ *
+ * Counters are kept in shards that threads pick by their thread ID, each
+ * shard on a cache line of its own, so that counting on the hot path writes
+ * to a line other threads rarely touch. Reading a counter sums its shards.
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Number of shards of the counters, and the size of a cache line
+ */
+#define METRIC_SHARDS 16
+#define CACHE_LINE_SIZE 64
+
+/**
+ * @brief Counters
+ */
+typedef enum metric {
+    METRIC_HITS,             // requests served from the cache
+    METRIC_MISSES,           // cache lookups that missed
+    METRIC_HIT_BYTES,        // bytes sent from the cache
+    METRIC_ORIGIN_BYTES,     // bytes received from web servers
+    METRIC_EVICTIONS,        // objects evicted to make room
+    METRIC_CONNECT_FAILURES, // failures to resolve or connect to a web server
+    METRIC_LOCK_WAITS,       // acquisitions of the cache lock that waited
+    METRIC_LOCK_WAIT_NS,     // nanoseconds spent waiting for the cache lock
+    NMETRICS
+} metric_t;
+
+/**
+ * @brief Values that are read when the metrics are reported, not counted
+ */
+typedef struct metrics_gauges {
+    uint64_t cache_objects; // objects in the cache
+    uint64_t cache_bytes;   // bytes the cache is charged for
+    uint64_t connections;   // connections in flight
+    uint64_t fetches;       // fetches from web servers in flight
+} metrics_gauges_t;
+
+/**
+ * @brief Add to a counter
+ * @param[in] metric The counter
+ * @param[in] n Amount added
+ */
+void metric_add(metric_t metric, uint64_t n);
+
+/**
+ * @brief Read a counter
+ * @param[in] metric The counter
+ * @return The sum of its shards
+ */
+uint64_t metric_value(metric_t metric);
+
+/**
+ * @brief Render the counters and gauges in the Prometheus text format
+ * @param[in] gauges Gauges read by the caller
+ * @param[out] buf Buffer for the metrics
+ * @param[in] len Size of the buffer
+ * @return Length of the metrics, truncated to fit the buffer
+ */
+size_t metrics_report(const metrics_gauges_t *gauges, char *buf, size_t len);
+
+#endif /* METRICS_H */
@@ -11,13 +11,24 @@
  * @author Yujia Wang <yujiawan@andrew.cmu.edu>
  */
 
+#include "admission.h"
+#include "arena.h"
+#include "buffer.h"
 #include "cache.h"
 #include "csapp.h"
 #include "http_parser.h"
+#include "http_util.h"
+#include "metrics.h"
+#include "range.h"
+#include "ratelimit.h"
+#include "response.h"
+#include "stages.h"
+#include "timer.h"
 
 #include <assert.h>
 #include <ctype.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -26,12 +37,15 @@
 #include <unistd.h>
 
 #include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <pthread.h>
 #include <signal.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <time.h>
 
 /*
  * Debug macros, which can be enabled by adding -DDEBUG in the Makefile
@@ -45,6 +59,33 @@
 #define dbg_printf(...)
 #endif
 
+/*
+ * Max size of the request line and headers of a client's request
+ */
+#define MAX_REQUEST_SIZE (8 * MAXBUF)
+
+/*
+ * Initial sizes of the buffers a request and a response are read into
+ */
+#define REQUEST_BUFFER_SIZE (4 * 1024)
+#define RESPONSE_BUFFER_SIZE (16 * 1024)
+
+/*
+ * Default timeouts of the phases of a request, in milliseconds
+ */
+#define HEADER_TIMEOUT_MS 15000     // client sending its request
+#define CONNECT_TIMEOUT_MS 10000    // connecting to the web server
+#define FIRST_BYTE_TIMEOUT_MS 30000 // web server starting its response
+#define IDLE_TIMEOUT_MS 30000       // either side going quiet after that
+
+/*
+ * Timeouts in use, set from the command line; 0 disables one
+ */
+static unsigned header_timeout = HEADER_TIMEOUT_MS;
+static unsigned connect_timeout = CONNECT_TIMEOUT_MS;
+static unsigned first_byte_timeout = FIRST_BYTE_TIMEOUT_MS;
+static unsigned idle_timeout = IDLE_TIMEOUT_MS;
+
 /*
  * String to use for the User-Agent header.
  * Don't forget to terminate with \r\n
@@ -56,249 +97,885 @@ static const char *header_connection = "Connection: close\r\n";
 static const char *header_proxy_connection = "Proxy-Connection: close\r\n";
 
 /*
- * clienterror - returns an error message to the client
+ * Pieces of the upstream request besides the client's headers: the request
+ * line (3), Host (up to 5), User-Agent, Connection, Proxy-Connection and the
+ * blank line
  */
-void clienterror(int fd, char *cause, char *errnum, char *shortmsg,
-                 char *longmsg) {
-    char buf[MAXLINE];
-    char body[MAXBUF];
-    size_t buflen;
-    size_t bodylen;
-
-    /* Build the HTTP response body */
-    bodylen = snprintf(body, MAXBUF,
-                       "<html>\r\n"
-                       "<head><title>Tiny Error</title></head>\r\n"
-                       "<body bgcolor=\"ffffff\">\r\n"
-                       "<h1>%s: %s</h1>\r\n"
-                       "<p>%s: %s</p>\r\n"
-                       "<hr><em>The Tiny Web server</em>\r\n"
-                       "</body></html>\r\n",
-                       errnum, shortmsg, longmsg, cause);
-    if (bodylen >= MAXBUF) {
-        return; // Overflow!
-    }
-
-    /* Build the HTTP response headers */
-    buflen = snprintf(buf, MAXLINE,
-                      "HTTP/1.0 %s %s\r\n"
-                      "Content-Type: text/html\r\n"
-                      "Content-Length: %zu\r\n\r\n",
-                      errnum, shortmsg, bodylen);
-    if (buflen >= MAXLINE) {
-        return; // Overflow!
-    }
-
-    /* Write the headers */
-    if (rio_writen(fd, buf, buflen) < 0) {
-        fprintf(stderr, "Error writing error response headers to client\n");
-        return;
-    }
+#define REQUEST_FIXED_IOVS 12
 
-    /* Write the body */
-    if (rio_writen(fd, body, bodylen) < 0) {
-        fprintf(stderr, "Error writing error response body to client\n");
-        return;
-    }
+/*
+ * Request sent to the web server, as iovecs that reference the client's
+ * request and the proxy's fixed headers in place
+ */
+typedef struct http_request {
+    struct iovec *iov; // request line and headers, without the blank line
+    int iovcnt;
+    struct iovec *range_iov; // the client's Range and If-Range lines
+    int nrange;
+    char *client_headers; // all header lines of the client, NUL-terminated
+} http_request_t;
+
+/*
+ * An accepted connection, handed to the thread serving it
+ */
+typedef struct connection {
+    int fd;
+    int slot;                 // slot of the client's rate limit bucket
+    struct timespec accepted; // when it was accepted, on CLOCK_MONOTONIC
+} connection_t;
+
+/*
+ * Pooled buffers of a request, put when it is done
+ */
+typedef struct request_buffers {
+    buffer_t *request;  // the client's request
+    buffer_t *response; // the web server's response
+} request_buffers_t;
+
+/*
+ * set_iov - point an iovec at a buffer
+ */
+static void set_iov(struct iovec *iov, const void *base, size_t len) {
+    iov->iov_base = (void *)base;
+    iov->iov_len = len;
 }
 
 /**
- * @brief Build HTTP request headers of proxy sent to server
- * @param rio[in] Robust I/O package
- * @param request_line[in] Request line of proxy
- * @param header_host[in] Host header
- * @param http_request[out] HTTP request sent to server
+ * @brief Build the HTTP request of proxy sent to server
+ *
+ * Nothing is copied: the request is assembled as iovecs over the new request
+ * line, the Host header, the proxy's fixed headers, and the client's other
+ * headers in place, adjacent ones merged into a single iovec. Hop-by-hop
+ * headers are dropped, and Range and If-Range are set aside so that the
+ * whole object is fetched.
+ *
+ * The client's header lines are also NUL-terminated in place, overwriting
+ * the blank line, for the cache to select a variant with.
+ *
+ * @param[in] parser Parser that has parsed the client's request
+ * @param[in] request Buffer the client's request was parsed from
+ * @param[in] path Path of the requested URI
+ * @param[in] host Host of the requested URI
+ * @param[in] port Port of the requested URI
+ * @param[in] arena Arena of the connection, to allocate the iovecs from
+ * @param[out] req The request to send
+ * @return 0 on success, -1 if out of memory
  */
-void build_http_request(rio_t *rio, char *request_line, char *header_host,
-                        char *http_request) {
-    char buf[MAXLINE];
-    char other_header[MAXLINE];
-
-    // assume that the request and header lines are ASCII text
-    while (rio_readlineb(rio, buf, MAXLINE) > 0) {
-        if (!strcmp(buf, "\r\n")) {
+int build_http_request(parser_t *parser, char *request, const char *path,
+                       const char *host, const char *port, arena_t *arena,
+                       http_request_t *req) {
+    const header_view_t *header;
+    const header_view_t *client_host = NULL;
+    size_t nheaders = 0;
+
+    while (parser_header_view(parser, nheaders) != NULL) {
+        nheaders++;
+    }
+    req->iov = (struct iovec *)arena_alloc(
+        arena, (2 * nheaders + REQUEST_FIXED_IOVS) * sizeof(struct iovec));
+    if (req->iov == NULL) {
+        return -1;
+    }
+    req->range_iov = req->iov + nheaders + REQUEST_FIXED_IOVS;
+    req->nrange = 0;
+
+    // the client's headers start after the fixed ones, which are filled in
+    // once it is known whether the client sent a Host header
+    int first = REQUEST_FIXED_IOVS - 1;
+    int n = first;
+    for (size_t i = 0; (header = parser_header_view(parser, i)) != NULL; i++) {
+        const char *line = request + header->line.offset;
+        size_t len = header->line.length;
+
+        switch (classify_header(request + header->name.offset,
+                                header->name.length)) {
+        case HEADER_HOST:
+            // if client attaches its own HOST header, use the same as client
+            client_host = header;
+            break;
+        case HEADER_RANGE:
+            // ranges are cut from the whole object by the proxy
+            set_iov(&req->range_iov[req->nrange++], line, len);
             break;
+        case HEADER_USER_AGENT:
+        case HEADER_HOP:
+            break;
+        default: {
+            // forward other headers unchanged, extending the last iovec if
+            // the line follows it
+            struct iovec *last = &req->iov[n - 1];
+            if (n > first && (char *)last->iov_base + last->iov_len == line) {
+                last->iov_len += len;
+            } else {
+                set_iov(&req->iov[n++], line, len);
+            }
+            break;
+        }
         }
+    }
+
+    // fill in the fixed headers backward, right before the client's
+    first--;
+    set_iov(&req->iov[first--], header_proxy_connection,
+            strlen(header_proxy_connection));
+    set_iov(&req->iov[first--], header_connection, strlen(header_connection));
+    set_iov(&req->iov[first--], header_user_agent, strlen(header_user_agent));
+    if (client_host != NULL) {
+        set_iov(&req->iov[first--], request + client_host->line.offset,
+                client_host->line.length);
+    } else {
+        set_iov(&req->iov[first--], "\r\n", strlen("\r\n"));
+        set_iov(&req->iov[first--], port, strlen(port));
+        set_iov(&req->iov[first--], ":", strlen(":"));
+        set_iov(&req->iov[first--], host, strlen(host));
+        set_iov(&req->iov[first--], "Host: ", strlen("Host: "));
+    }
+    set_iov(&req->iov[first--], " HTTP/1.0\r\n", strlen(" HTTP/1.0\r\n"));
+    set_iov(&req->iov[first--], path, strlen(path));
+    set_iov(&req->iov[first], "GET ", strlen("GET "));
+    memmove(req->iov, req->iov + first, (n - first) * sizeof(struct iovec));
+    req->iovcnt = n - first;
+
+    // the header lines run from the first one to the blank line
+    size_t end = parser_head_size(parser) - 1;
+    if (end > 0 && request[end - 1] == '\r') {
+        end--;
+    }
+    header = parser_header_view(parser, 0);
+    request[end] = '\0';
+    req->client_headers = header != NULL ? request + header->line.offset
+                                         : request + end;
+    return 0;
+}
+
+/**
+ * @brief Send a request to the web server with one writev
+ * @param[in] serverfd Descriptor connected to the web server
+ * @param[in] req The request
+ * @param[in] ranges Whether to include the client's range headers
+ * @param[in] arena Arena of the connection
+ * @return Number of bytes written, or -1 on error
+ */
+ssize_t send_http_request(int serverfd, http_request_t *req, bool ranges,
+                          arena_t *arena) {
+    int nrange = ranges ? req->nrange : 0;
+    struct iovec *iov = (struct iovec *)arena_alloc(
+        arena, (req->iovcnt + nrange + 1) * sizeof(struct iovec));
+    if (iov == NULL) {
+        return -1;
+    }
 
-        // if client attaches its own HOST header, use the same as client
-        if (!strncasecmp(buf, "Host", strlen("Host"))) {
-            sprintf(header_host, buf);
+    // the iovecs are copied, since writing consumes them
+    memcpy(iov, req->iov, req->iovcnt * sizeof(struct iovec));
+    memcpy(iov + req->iovcnt, req->range_iov, nrange * sizeof(struct iovec));
+    set_iov(&iov[req->iovcnt + nrange], "\r\n", strlen("\r\n"));
+    return writev_all(serverfd, iov, req->iovcnt + nrange + 1);
+}
+
+/**
+ * @brief Check whether a response announces a body too large to cache
+ * @param[in] response Start of the response read so far
+ * @param[in] response_size Number of bytes read so far
+ * @return true if the header block is complete and its Content-Length
+ * exceeds MAX_OBJECT_SIZE
+ */
+bool exceeds_object_size(const char *response, ssize_t response_size) {
+    const char *body = find_body(response, response_size);
+    const char *value;
+    size_t value_len;
+
+    if (body == NULL ||
+        !find_header(response, body, "Content-Length", &value, &value_len)) {
+        return false;
+    }
+    return strtoull(value, NULL, 10) >= MAX_OBJECT_SIZE;
+}
+
+/*
+ * read_some - read up to n bytes, as many as have arrived, retrying if
+ * interrupted
+ */
+static ssize_t read_some(int fd, char *buf, size_t n) {
+    ssize_t nread;
+    while ((nread = read(fd, buf, n)) < 0 && errno == EINTR) {
+    }
+    return nread;
+}
+
+/*
+ * write_client - write to the client under the idle timeout; the client's
+ * deadline is cancelled again once the bytes are written, since the proxy
+ * may then wait on the web server for a while
+ */
+static ssize_t write_client(int fd, deadline_t *client, const void *buf,
+                            size_t n) {
+    deadline_arm(client, fd, idle_timeout);
+    ssize_t nwritten = rio_writen(fd, buf, n);
+    deadline_cancel(client);
+    return nwritten;
+}
+
+/*
+ * connect_upstream - connect to a web server, giving up on each address after
+ * connect_timeout; the descriptor returned is blocking
+ */
+static int connect_upstream(const char *host, const char *port) {
+    struct addrinfo hints, *listp, *p;
+    int serverfd = -1;
+    int rc;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+    uint64_t start = stage_clock();
+    if ((rc = getaddrinfo(host, port, &hints, &listp)) != 0) {
+        fprintf(stderr, "getaddrinfo failed (%s:%s): %s\n", host, port,
+                gai_strerror(rc));
+        metric_add(METRIC_CONNECT_FAILURES, 1);
+        return -2;
+    }
+    start = stage_record(STAGE_DNS, start);
+
+    for (p = listp; p != NULL; p = p->ai_next) {
+        serverfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+        if (serverfd < 0) {
             continue;
         }
 
-        // if client sends additional request headers, forward them unchanged
-        if (strncasecmp(buf, "User-Agent", strlen("User-Agent")) &&
-            strncasecmp(buf, "Connection", strlen("Connection")) &&
-            strncasecmp(buf, "Proxy-Connection", strlen("Proxy-Connection"))) {
-            strcat(other_header, buf);
+        // connect without blocking, then wait for the connection to complete
+        int flags = fcntl(serverfd, F_GETFL);
+        fcntl(serverfd, F_SETFL, flags | O_NONBLOCK);
+        rc = connect(serverfd, p->ai_addr, p->ai_addrlen);
+        if (rc < 0 && errno == EINPROGRESS) {
+            struct pollfd pfd = {serverfd, POLLOUT, 0};
+            int timeout = connect_timeout > 0 ? (int)connect_timeout : -1;
+            int err = 0;
+            socklen_t len = sizeof(err);
+            while ((rc = poll(&pfd, 1, timeout)) < 0 && errno == EINTR) {
+            }
+            if (rc == 1 &&
+                getsockopt(serverfd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 &&
+                err == 0) {
+                rc = 0;
+            } else {
+                rc = -1;
+            }
+        }
+        if (rc == 0) {
+            fcntl(serverfd, F_SETFL, flags);
+            break;
         }
+        close(serverfd);
+        serverfd = -1;
     }
 
-    sprintf(http_request, "%s%s%s%s%s%s\r\n", request_line, header_host,
-            header_user_agent, header_connection, header_proxy_connection,
-            other_header);
+    freeaddrinfo(listp);
+    if (serverfd >= 0) {
+        stage_record(STAGE_CONNECT, start);
+    } else {
+        metric_add(METRIC_CONNECT_FAILURES, 1);
+    }
+    return serverfd;
+}
+
+/*
+ * read_upstream - read from the web server under its deadline, re-arming it
+ * for the idle timeout once the response has started
+ */
+static ssize_t read_upstream(int serverfd, deadline_t *deadline, char *buf,
+                             size_t n) {
+    ssize_t nread = read_some(serverfd, buf, n);
+    if (nread > 0) {
+        deadline_arm(deadline, serverfd, idle_timeout);
+        metric_add(METRIC_ORIGIN_BYTES, nread);
+    }
+    return nread;
 }
 
 /**
- * @brief Handle a HTTP request
+ * @brief Forward a range request unchanged and relay the partial response
+ *
+ * Used when the object turns out too large to cache, so that fetching it
+ * whole would be wasted.
+ *
  * @param[in] fd Connected descriptor
+ * @param[in] client Deadline of the client
+ * @param[in] host Host of the web server
+ * @param[in] port Port of the web server
+ * @param[in] req Request, including the client's range headers
+ * @param[in] buf Buffer to relay through
+ * @param[in] arena Arena of the connection
+ */
+void relay_range_request(int fd, deadline_t *client, const char *host,
+                         const char *port, http_request_t *req, buffer_t *buf,
+                         arena_t *arena) {
+    deadline_t server;
+    ssize_t n;
+
+    int serverfd = connect_upstream(host, port);
+    if (serverfd < 0) {
+        fprintf(stderr, "Connection failed\n");
+        deadline_arm(client, fd, idle_timeout);
+        send_response(fd, RESPONSE_BAD_GATEWAY);
+        return;
+    }
+    deadline_init(&server);
+    deadline_arm(&server, serverfd, first_byte_timeout);
+    send_http_request(serverfd, req, true, arena);
+    while ((n = read_upstream(serverfd, &server, buf->data, buf->size)) > 0) {
+        write_client(fd, client, buf->data, n);
+    }
+    deadline_cancel(&server);
+    close(serverfd);
+}
+
+/*
+ * fetch_response - fetch the requested object from the web server, relay it
+ * to the client and cache it if it fits
+ */
+static void fetch_response(int fd, deadline_t *client, arena_t *arena,
+                           request_buffers_t *bufs, http_request_t *req,
+                           const char *uri, const char *host,
+                           const char *port) {
+    deadline_t server;
+    int serverfd;
+    ssize_t n;
+
+    bufs->response = buffer_get(RESPONSE_BUFFER_SIZE);
+    if (bufs->response == NULL) {
+        return;
+    }
+
+    // establish connection to the web server
+    serverfd = connect_upstream(host, port);
+    if (serverfd < 0) {
+        fprintf(stderr, "Connection failed\n");
+        // answer range requests as relay_range_request() would
+        if (req->nrange > 0) {
+            deadline_arm(client, fd, idle_timeout);
+            send_response(fd, RESPONSE_BAD_GATEWAY);
+        }
+        return;
+    }
+    deadline_init(&server);
+    deadline_arm(&server, serverfd, first_byte_timeout);
+
+    // request the object the client specified; for a range request, the whole
+    // object is requested so that it can be cached, and the response is held
+    // back until the ranges can be cut from it
+    send_http_request(serverfd, req, false, arena);
+    uint64_t sent = stage_clock();
+    uint64_t first_byte = 0;
+
+    // read the server's response straight into the buffer, growing it while
+    // the object may still be cached, and forward it to the client as it
+    // arrives; once the object is known too large to cache, the buffer is
+    // reused from its start for relaying
+    ssize_t response_size = 0;
+    bool caching = true;
+    bool relaying = req->nrange == 0;
+    while (true) {
+        buffer_t *response = bufs->response;
+        char *dst = response->data;
+        size_t room = response->size;
+        if (caching) {
+            if ((size_t)response_size == response->size) {
+                response = buffer_grow(response, response_size,
+                                       response->size + 1);
+                if (response == NULL) {
+                    // no memory to keep the object, so relay the rest of it
+                    // uncached, starting with what was held back
+                    caching = false;
+                    if (!relaying) {
+                        write_client(fd, client, bufs->response->data,
+                                     response_size);
+                        relaying = true;
+                    }
+                    continue;
+                }
+                bufs->response = response;
+            }
+            size_t cap = response->size < MAX_OBJECT_SIZE ? response->size
+                                                          : MAX_OBJECT_SIZE;
+            dst = response->data + response_size;
+            room = cap - response_size;
+        }
+        if ((n = read_upstream(serverfd, &server, dst, room)) <= 0) {
+            break;
+        }
+        if (first_byte == 0) {
+            first_byte = stage_record(STAGE_FIRST_BYTE, sent);
+        }
+
+        if (caching) {
+            response_size += n;
+            if (response_size >= MAX_OBJECT_SIZE) {
+                // too large to cache after all, the client gets the whole
+                // object
+                caching = false;
+                if (!relaying) {
+                    dst = response->data;
+                    n = response_size;
+                    relaying = true;
+                }
+            }
+        }
+        if (relaying) {
+            write_client(fd, client, dst, n);
+        }
+
+        // known to be too large to cache, ask for just the ranges instead
+        if (!relaying && exceeds_object_size(response->data, response_size)) {
+            deadline_cancel(&server);
+            close(serverfd);
+            relay_range_request(fd, client, host, port, req, response,
+                                arena);
+            return;
+        }
+    }
+
+    if (first_byte != 0) {
+        stage_record(STAGE_TRANSFER, first_byte);
+    }
+
+    // a response cut short by a timeout is not cached
+    deadline_cancel(&server);
+    bool timed_out = deadline_fired(&server);
+    if (timed_out) {
+        caching = false;
+    }
+
+    // a held-back response that cannot be cut into ranges is answered with
+    // an error, rather than the client getting nothing
+    if (!relaying && (!caching || response_size == 0)) {
+        deadline_arm(client, fd, idle_timeout);
+        send_response(fd, timed_out ? RESPONSE_GATEWAY_TIMEOUT
+                                    : RESPONSE_BAD_GATEWAY);
+        close(serverfd);
+        return;
+    }
+
+    // write the web object into cache, which may keep the buffer rather than
+    // copy it
+    if (caching) {
+        char *response = bufs->response->data;
+        uint64_t start = stage_clock();
+        write_cache(uri, req->client_headers, response, response_size,
+                    bufs->response);
+        stage_record(STAGE_INSERT, start);
+        const char *body = find_body(response, response_size);
+        deadline_arm(client, fd, idle_timeout);
+        if (!relaying &&
+            (body == NULL ||
+             send_ranges(fd, response, body - response, body,
+                         response + response_size - body,
+                         req->client_headers) < 0)) {
+            rio_writen(fd, response, response_size);
+        }
+    }
+
+    close(serverfd);
+}
+
+/*
+ * send_text - send a plain text body rendered for the request
  */
-void doit(int fd) {
-    char buf[MAXLINE];
-    char request_line[MAXLINE];
-    char header_host[MAXLINE];
-    char http_request[MAXLINE];
+static void send_text(int fd, const char *content_type, const char *body,
+                      size_t body_len) {
+    char header[MAXLINE];
+    int header_len = snprintf(header, sizeof(header),
+                              "HTTP/1.0 200 OK\r\n"
+                              "Content-Type: %s\r\n"
+                              "Content-Length: %zu\r\n"
+                              "Connection: close\r\n\r\n",
+                              content_type, body_len);
+    struct iovec iov[2];
+    set_iov(&iov[0], header, header_len);
+    set_iov(&iov[1], body, body_len);
+    writev_all(fd, iov, 2);
+}
+
+/*
+ * send_stages - send the table of latencies of request stages
+ */
+static void send_stages(int fd) {
+    char body[MAXBUF];
+    size_t body_len = stage_report(body, sizeof(body));
+    send_text(fd, "text/plain", body, body_len);
+}
+
+/*
+ * send_metrics - send the counters and gauges in the Prometheus text format
+ */
+static void send_metrics(int fd) {
+    char body[MAXBUF];
+    metrics_gauges_t gauges;
+    cache_stats(&gauges.cache_objects, &gauges.cache_bytes);
+    gauges.connections = admission_connections();
+    gauges.fetches = admission_fetches();
+    size_t body_len = metrics_report(&gauges, body, sizeof(body));
+    send_text(fd, "text/plain; version=0.0.4", body, body_len);
+}
+
+/*
+ * serve_request - handle a HTTP request, leaving the buffers it gets in bufs
+ * for the caller to put; the client's deadline is armed as the request goes
+ * through its phases, each timed from the connection being accepted
+ */
+static void serve_request(int fd, deadline_t *client, arena_t *arena,
+                          request_buffers_t *bufs, uint64_t accepted) {
+    parser_t *parser = parser_new_with(arena_alloc_cb, arena);
+    http_request_t req;
+    size_t request_len = 0;
     const char *method;
     const char *version;
     const char *uri;
     const char *host;
     const char *port;
     const char *path;
-    int serverfd;
-    rio_t client_rio, server_rio;
+    uint64_t first_byte = 0;
     ssize_t n;
 
-    // read request line
-    rio_readinitb(&client_rio, fd);
-    rio_readlineb(&client_rio, buf, MAXLINE);
+    bufs->request = buffer_get(REQUEST_BUFFER_SIZE);
+    if (parser == NULL || bufs->request == NULL) {
+        return;
+    }
+
+    // read until the request line and headers are complete, parsing what has
+    // arrived each time; the buffer grows up to MAX_REQUEST_SIZE, and the
+    // whole of it must arrive within the header timeout
+    deadline_arm(client, fd, header_timeout);
+    char *request = bufs->request->data;
+    parser_state state;
+    while ((state = parser_parse(parser, request, request_len)) == INCOMPLETE) {
+        if (request_len == bufs->request->size) {
+            if (request_len >= MAX_REQUEST_SIZE) {
+                state = ERROR; // headers too large
+                break;
+            }
+            buffer_t *grown =
+                buffer_grow(bufs->request, request_len, request_len + 1);
+            if (grown == NULL) {
+                return;
+            }
+            bufs->request = grown;
+            request = grown->data;
+        }
+        n = read_some(fd, request + request_len,
+                      bufs->request->size - request_len);
+        if (n <= 0) {
+            return;
+        }
+        if (request_len == 0) {
+            first_byte = stage_record(STAGE_ACCEPT, accepted);
+        }
+        request_len += n;
+    }
+    if (first_byte != 0) {
+        stage_record(STAGE_PARSE, first_byte);
+    }
 
-    parser_t *parser = parser_new();
-    parser_state state = parser_parse_line(parser, buf);
+    // from here on, the client's deadline is armed only while it is written
+    // to
+    deadline_cancel(client);
 
     // error handling
     if (state == ERROR) {
-        clienterror(fd, buf, "400", "Bad Request",
-                    "Tiny could not handle this request (ERROR)");
+        send_response(fd, RESPONSE_BAD_REQUEST);
         return;
     }
 
     parser_retrieve(parser, METHOD, &method);
     if (strcasecmp(method, "GET")) {
-        clienterror(fd, buf, "501", "Not implemented",
-                    "Tiny does not implement this method");
+        send_response(fd, RESPONSE_NOT_IMPLEMENTED);
         return;
     }
 
     parser_retrieve(parser, HTTP_VERSION, &version);
     if (strncasecmp(version, "1.0", strlen("1.0")) &&
         strncasecmp(version, "1.1", strlen("1.1"))) {
-        clienterror(fd, buf, "400", "Bad Request",
-                    "Tiny could not handle this request (HTTP_VERSION)");
+        send_response(fd, RESPONSE_BAD_VERSION);
         return;
     }
 
-    // retrieve cache and if the URI is in the cache, respond to client directly
-    parser_retrieve(parser, URI, &uri);
-    if ((n = read_cache(uri, fd)) > 0) {
+    // a request without a host is for the proxy itself
+    if (parser_retrieve(parser, HOST, &host) < 0) {
+        parser_retrieve(parser, PATH, &path);
+        if (!strcmp(path, "/stats")) {
+            send_stages(fd);
+            return;
+        }
+        if (!strcmp(path, "/metrics")) {
+            send_metrics(fd);
+            return;
+        }
+        send_response(fd, strcmp(path, "/health") ? RESPONSE_NOT_FOUND
+                                                  : RESPONSE_HEALTH);
         return;
     }
 
-    // not in the cache, build http request forwarded to web server
-    parser_retrieve(parser, HOST, &host);
+    // build http request forwarded to web server; the request headers are
+    // read first because they select which cached variant of the URI applies
+    parser_retrieve(parser, URI, &uri);
     parser_retrieve(parser, PORT, &port);
     parser_retrieve(parser, PATH, &path);
 
-    sprintf(request_line, "GET %s HTTP/1.0\r\n", path);
-    sprintf(header_host, "Host: %s:%s\r\n", host, port);
-
-    build_http_request(&client_rio, request_line, header_host, http_request);
-
-    // establish connection to the web server
-    serverfd = open_clientfd(host, port);
-    if (serverfd < 0) {
-        fprintf(stderr, "Connection failed\n");
+    if (build_http_request(parser, request, path, host, port, arena, &req) <
+        0) {
         return;
     }
 
-    // request the object the client specified
-    rio_readinitb(&server_rio, serverfd);
-    rio_writen(serverfd, http_request, strlen(http_request));
-
-    ssize_t response_size = 0;
-    char response[MAX_OBJECT_SIZE];
-    char *responsep = response;
-    // read the server's response and forward it to the client
-    while ((n = rio_readnb(&server_rio, buf, MAXLINE)) > 0) {
-        rio_writen(fd, buf, n);
-
-        // store the web server's response if maximum object size is not
-        // exceeded
-        response_size += n;
-        if (response_size < MAX_OBJECT_SIZE) {
-            memcpy(responsep, buf, n);
-            responsep += n;
-        }
+    // retrieve cache and if the URI is in the cache, respond to client directly
+    deadline_arm(client, fd, idle_timeout);
+    uint64_t start = stage_clock();
+    n = read_cache(uri, req.client_headers, fd);
+    stage_record(n > 0 ? STAGE_HIT : STAGE_LOOKUP, start);
+    deadline_cancel(client);
+    if (n > 0) {
+        return;
     }
 
-    // write the web object into cache
-    if (response_size < MAX_OBJECT_SIZE) {
-        write_cache(uri, response, response_size);
+    // a miss costs a fetch from the web server, which an overloaded proxy
+    // turns down while it keeps serving hits
+    if (!admission_fetch_begin()) {
+        send_response(fd, RESPONSE_UNAVAILABLE);
+        return;
     }
+    fetch_response(fd, client, arena, bufs, &req, uri, host, port);
+    admission_fetch_end();
+}
 
-    parser_free(parser);
-    close(serverfd);
-    return;
+/**
+ * @brief Handle a HTTP request
+ *
+ * The parser and other request-lifetime memory come from the connection's
+ * arena; the request and response are read into pooled buffers, which are
+ * put here once the request is done. A client that stalls past its deadline
+ * has its connection shut down, which ends the request. The request's
+ * stages are timed into the histograms reported at /stats.
+ *
+ * @param[in] fd Connected descriptor
+ * @param[in] arena Arena of the connection
+ * @param[in] accepted When the connection was accepted, on CLOCK_MONOTONIC
+ */
+void doit(int fd, arena_t *arena, const struct timespec *accepted) {
+    request_buffers_t bufs = {NULL, NULL};
+    deadline_t client;
+    uint64_t start = stage_time(accepted);
+    deadline_init(&client);
+    serve_request(fd, &client, arena, &bufs, start);
+    deadline_cancel(&client);
+    buffer_put(bufs.request);
+    buffer_put(bufs.response);
+    stage_record(STAGE_TOTAL, start);
 }
 
 /**
  * @brief Thread routine
- * @param[in] vargp Variable pointer to connected descriptor
+ * @param[in] vargp Variable pointer to the accepted connection
  */
 void *thread(void *vargp) {
-    int connfd = *((int *)vargp);
+    connection_t *conn = (connection_t *)vargp;
+    int connfd = conn->fd;
+    int slot = conn->slot;
+    struct timespec accepted = conn->accepted;
     // detach threads so that spare resources are automatically reaped upon
     // thread exit
     pthread_detach(pthread_self());
-    free(vargp);
-    doit(connfd);
+    admission_start(&conn->accepted);
+    free(conn);
+    // request-lifetime memory comes from an arena, recycled across
+    // connections
+    arena_t *arena = arena_acquire();
+    if (arena != NULL) {
+        doit(connfd, arena, &accepted);
+        arena_release(arena);
+    }
     close(connfd);
+    ratelimit_release(slot);
+    admission_disconnect();
     return NULL;
 }
 
+/**
+ * @brief Print command line usage and exit
+ * @param[in] prog Program name
+ */
+void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [-z] [-l] [-d] [-s] [-H ms] [-C ms] [-F ms] [-I ms] "
+            "[-M n] [-U n] [-r n] [-c n] <port>\n",
+            prog);
+    fprintf(stderr, "  -z  store gzip variants of compressible objects\n");
+    fprintf(stderr, "  -l  keep cached objects LZ4-compressed in memory\n");
+    fprintf(stderr, "  -d  store identical bodies only once\n");
+    fprintf(stderr, "  -s  send large cached bodies with sendfile\n");
+    fprintf(stderr, "  -H  timeout for a client's request headers (%d)\n",
+            HEADER_TIMEOUT_MS);
+    fprintf(stderr, "  -C  timeout for connecting to a web server (%d)\n",
+            CONNECT_TIMEOUT_MS);
+    fprintf(stderr, "  -F  timeout for a web server's first byte (%d)\n",
+            FIRST_BYTE_TIMEOUT_MS);
+    fprintf(stderr, "  -I  timeout for either side going idle (%d)\n",
+            IDLE_TIMEOUT_MS);
+    fprintf(stderr, "  -M  max connections in flight (%d)\n", MAX_CONNECTIONS);
+    fprintf(stderr, "  -U  max fetches from web servers in flight (%d)\n",
+            MAX_FETCHES);
+    fprintf(stderr, "  -r  max connections per second from one client\n");
+    fprintf(stderr, "  -c  max connections in flight from one client\n");
+    fprintf(stderr, "  timeouts are in milliseconds; 0 disables a timeout or "
+                    "limit\n");
+    exit(1);
+}
+
+/*
+ * parse_number - parse a timeout or limit, exiting with the usage if it is
+ * not a number
+ */
+static unsigned parse_number(const char *prog, const char *arg) {
+    char *end;
+    errno = 0;
+    unsigned long n = strtoul(arg, &end, 10);
+    if (errno != 0 || end == arg || *end != '\0' || *arg == '-' ||
+        n > UINT_MAX) {
+        usage(prog);
+    }
+    return (unsigned)n;
+}
+
 /**
  * The tiny proxy's main routine
  */
 int main(int argc, char **argv) {
     int listenfd;
-    int *connfdp;
+    int connfd;
+    connection_t *conn;
     socklen_t clientlen;
     struct sockaddr_storage clientaddr;
     char host[MAXLINE];
     char port[MAXLINE];
     pthread_t tid;
+    bool gzip = false;
+    bool lz4 = false;
+    bool dedup = false;
+    bool use_sendfile = false;
+    unsigned max_connections = MAX_CONNECTIONS;
+    unsigned max_fetches = MAX_FETCHES;
+    unsigned client_rate = 0;
+    unsigned client_connections = 0;
+    int slot;
+    int c;
 
     // check command line arguments
-    if (argc != 2) {
-        fprintf(stderr, "usage: %s <port>\n", argv[0]);
-        exit(1);
+    while ((c = getopt(argc, argv, "zldsH:C:F:I:M:U:r:c:")) != -1) {
+        switch (c) {
+        case 'z':
+            gzip = true;
+            break;
+        case 'l':
+            lz4 = true;
+            break;
+        case 'd':
+            dedup = true;
+            break;
+        case 's':
+            use_sendfile = true;
+            break;
+        case 'H':
+            header_timeout = parse_number(argv[0], optarg);
+            break;
+        case 'C':
+            connect_timeout = parse_number(argv[0], optarg);
+            break;
+        case 'F':
+            first_byte_timeout = parse_number(argv[0], optarg);
+            break;
+        case 'I':
+            idle_timeout = parse_number(argv[0], optarg);
+            break;
+        case 'M':
+            max_connections = parse_number(argv[0], optarg);
+            break;
+        case 'U':
+            max_fetches = parse_number(argv[0], optarg);
+            break;
+        case 'r':
+            client_rate = parse_number(argv[0], optarg);
+            break;
+        case 'c':
+            client_connections = parse_number(argv[0], optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
     }
 
     // ignore SIGPIPE signals
     signal(SIGPIPE, SIG_IGN);
 
+    init_responses();
     init_cache();
+    timer_init();
+    cache_set_gzip(gzip);
+    cache_set_lz4(lz4);
+    cache_set_dedup(dedup);
+    cache_set_sendfile(use_sendfile);
+    admission_set_limits(max_connections, max_fetches);
+    ratelimit_set_limits(client_rate, client_connections);
 
     // open a listening socket
-    listenfd = open_listenfd(argv[1]);
+    listenfd = open_listenfd(argv[optind]);
     if (listenfd < 0) {
-        fprintf(stderr, "Failed to listen on port: %s\n", argv[1]);
+        fprintf(stderr, "Failed to listen on port: %s\n", argv[optind]);
         exit(1);
     }
 
     while (1) {
         clientlen = sizeof(clientaddr);
-        connfdp = malloc(sizeof(int));
         // accept a connection request
-        *connfdp = accept(listenfd, (struct sockaddr *)&clientaddr, &clientlen);
-        if (*connfdp < 0) {
+        connfd = accept(listenfd, (struct sockaddr *)&clientaddr, &clientlen);
+        if (connfd < 0) {
             perror("accept error");
             continue;
         }
+
+        // turn away a client over its limits, or any client when overloaded,
+        // before spending a thread on it
+        if (!ratelimit_admit((struct sockaddr *)&clientaddr, &slot)) {
+            send_response(connfd, RESPONSE_TOO_MANY);
+            close(connfd);
+            continue;
+        }
+        if (!admission_connect()) {
+            send_response(connfd, RESPONSE_UNAVAILABLE);
+            close(connfd);
+            ratelimit_release(slot);
+            continue;
+        }
+
         getnameinfo((struct sockaddr *)&clientaddr, clientlen, host, MAXLINE,
                     port, MAXLINE, 0);
         sio_printf("Accepted connection from (%s, %s)\n", host, port);
         // create a new peer thread to perform a treansaction
-        pthread_create(&tid, NULL, thread, connfdp);
+        conn = (connection_t *)malloc(sizeof(connection_t));
+        if (conn == NULL) {
+            close(connfd);
+            ratelimit_release(slot);
+            admission_disconnect();
+            continue;
+        }
+        conn->fd = connfd;
+        conn->slot = slot;
+        clock_gettime(CLOCK_MONOTONIC, &conn->accepted);
+        if (pthread_create(&tid, NULL, thread, conn) != 0) {
+            free(conn);
+            close(connfd);
+            ratelimit_release(slot);
+            admission_disconnect();
+        }
     }
 
     free_cache();
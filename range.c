@@ -0,0 +1,365 @@
+/**
+ * @file range.c
+ * @brief Answering byte-range requests from whole responses
+ *
+ * This program answers requests with a Range header from a complete response
+ * held in memory. The 206 response is assembled as an iovec array: the new
+ * status line, the original header lines that still hold (referenced in
+ * place), the new Content-Range/Content-Length headers, and for every range
+ * a slice of the body. Nothing but the few new header lines is copied.
+ */
+
+#include "range.h"
+#include "csapp.h"
+#include "http_util.h"
+
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+/* Headers of the original response that do not describe a partial one */
+static const char *replaced_headers[] = {"Content-Length", "Content-Range"};
+
+/* Additionally replaced when the parts carry their own Content-Type */
+static const char *replaced_multipart_headers[] = {"Content-Type"};
+
+static unsigned long boundary_counter = 0;
+
+/*
+ * parse_position - parse a nonnegative decimal number in [start, end),
+ * saturating at SIZE_MAX
+ */
+static bool parse_position(const char *start, const char *end, size_t *pos) {
+    if (start == end) {
+        return false;
+    }
+
+    *pos = 0;
+    for (const char *p = start; p < end; p++) {
+        if (!isdigit((unsigned char)*p)) {
+            return false;
+        }
+        size_t digit = *p - '0';
+        if (*pos > (SIZE_MAX - digit) / 10) {
+            *pos = SIZE_MAX;
+        } else {
+            *pos = *pos * 10 + digit;
+        }
+    }
+    return true;
+}
+
+int parse_ranges(const char *value, size_t value_len, size_t length,
+                 byte_range_t *ranges, int max_ranges) {
+    const char *end = value + value_len;
+    const char *spec = value + strlen("bytes=");
+    int n = 0;
+
+    if (value_len < strlen("bytes=") ||
+        strncasecmp(value, "bytes=", strlen("bytes="))) {
+        return -1;
+    }
+
+    while (spec <= end) {
+        const char *comma = memchr(spec, ',', end - spec);
+        const char *spec_end = comma != NULL ? comma : end;
+        const char *next = spec_end + 1;
+
+        while (spec < spec_end && isspace((unsigned char)*spec)) {
+            spec++;
+        }
+        while (spec_end > spec && isspace((unsigned char)spec_end[-1])) {
+            spec_end--;
+        }
+
+        const char *dash = memchr(spec, '-', spec_end - spec);
+        size_t first;
+        size_t last;
+        if (spec == spec_end) {
+            // empty list elements are allowed and ignored
+            spec = next;
+            continue;
+        }
+        if (dash == NULL) {
+            return -1;
+        }
+
+        if (dash == spec) {
+            // suffix range: the last N bytes
+            size_t suffix;
+            if (!parse_position(dash + 1, spec_end, &suffix)) {
+                return -1;
+            }
+            if (suffix == 0 || length == 0) {
+                spec = next;
+                continue;
+            }
+            first = suffix >= length ? 0 : length - suffix;
+            last = length - 1;
+        } else {
+            if (!parse_position(spec, dash, &first)) {
+                return -1;
+            }
+            if (dash + 1 == spec_end) {
+                last = SIZE_MAX;
+            } else if (!parse_position(dash + 1, spec_end, &last) ||
+                       last < first) {
+                return -1;
+            }
+            if (first >= length) {
+                spec = next;
+                continue;
+            }
+            if (last >= length) {
+                last = length - 1;
+            }
+        }
+
+        if (n == max_ranges) {
+            return -1;
+        }
+        ranges[n].first = first;
+        ranges[n].last = last;
+        n++;
+        spec = next;
+    }
+    return n;
+}
+
+/*
+ * validator_matches - check an If-Range value against the response: entity
+ * tags must match the ETag strongly, anything else is a date that must equal
+ * Last-Modified
+ */
+static bool validator_matches(const char *header, const char *header_end,
+                              const char *if_range, size_t if_range_len) {
+    const char *value;
+    size_t value_len;
+
+    // weak entity tags never match for ranges; the prefix is checked in full
+    // because dates can start with 'W' too ("Wed, ...")
+    if (if_range_len >= 2 && !memcmp(if_range, "W/", 2)) {
+        return false;
+    }
+    bool is_etag = if_range_len > 0 && *if_range == '"';
+    const char *name = is_etag ? "ETag" : "Last-Modified";
+    if (!find_header(header, header_end, name, &value, &value_len)) {
+        return false;
+    }
+    return value_len == if_range_len && !memcmp(value, if_range, value_len);
+}
+
+/*
+ * is_replaced - check whether a header line is one of the given headers
+ */
+static bool is_replaced(const char *line, const char *eol, const char **names,
+                        size_t nnames) {
+    const char *value;
+    size_t value_len;
+    for (size_t i = 0; i < nnames; i++) {
+        if (header_value(line, eol, names[i], &value, &value_len)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * add_header_lines - add iovecs for the header lines of the response that
+ * are kept, merging adjacent kept lines into one iovec
+ * Returns the new number of iovecs.
+ */
+static int add_header_lines(struct iovec *iov, int iovcnt, const char *header,
+                            const char *header_end, bool multipart) {
+    const char *line = memchr(header, '\n', header_end - header) + 1;
+    const char *run = line;
+    size_t nreplaced = sizeof(replaced_headers) / sizeof(replaced_headers[0]);
+    size_t nmultipart = sizeof(replaced_multipart_headers) /
+                        sizeof(replaced_multipart_headers[0]);
+
+    while (line < header_end) {
+        const char *eol = memchr(line, '\n', header_end - line);
+        if (eol == line + 1) {
+            break; // blank line ending the headers
+        }
+        if (is_replaced(line, eol, replaced_headers, nreplaced) ||
+            (multipart && is_replaced(line, eol, replaced_multipart_headers,
+                                      nmultipart))) {
+            if (line > run) {
+                iov[iovcnt].iov_base = (char *)run;
+                iov[iovcnt].iov_len = line - run;
+                iovcnt++;
+            }
+            run = eol + 1;
+        }
+        line = eol + 1;
+    }
+    if (line > run) {
+        iov[iovcnt].iov_base = (char *)run;
+        iov[iovcnt].iov_len = line - run;
+        iovcnt++;
+    }
+    return iovcnt;
+}
+
+/*
+ * send_unsatisfiable - send a 416 naming the length of the body
+ */
+static ssize_t send_unsatisfiable(int fd, const char *header, size_t length) {
+    char buf[MAXLINE];
+    int len = snprintf(buf, sizeof(buf),
+                       "%.8s 416 Range Not Satisfiable\r\n"
+                       "Content-Range: bytes */%zu\r\n"
+                       "Content-Length: 0\r\n\r\n",
+                       header, length);
+    return rio_writen(fd, buf, len) < 0 ? 0 : len;
+}
+
+ssize_t send_ranges(int fd, const char *header, size_t header_size,
+                    const char *body, size_t body_size, const char *headers) {
+    const char *headers_end = headers + strlen(headers);
+    const char *header_end = header + header_size;
+    const char *range;
+    size_t range_len;
+    const char *value;
+    size_t value_len;
+
+    if (!find_header(headers, headers_end, "Range", &range, &range_len)) {
+        return -1;
+    }
+
+    // only whole, unframed 200 responses can be sliced
+    if (header_size < strlen("HTTP/1.x 200\r\n\r\n") ||
+        strncmp(header, "HTTP/1.", strlen("HTTP/1.")) ||
+        strncmp(header + strlen("HTTP/1.x"), " 200", strlen(" 200")) ||
+        find_header(header, header_end, "Transfer-Encoding", &value,
+                    &value_len)) {
+        return -1;
+    }
+    size_t length = body_size;
+
+    if (find_header(headers, headers_end, "If-Range", &value, &value_len) &&
+        !validator_matches(header, header_end, value, value_len)) {
+        return -1;
+    }
+
+    byte_range_t ranges[MAX_RANGES];
+    int nranges = parse_ranges(range, range_len, length, ranges, MAX_RANGES);
+    if (nranges < 0) {
+        return -1;
+    }
+    if (nranges == 0) {
+        return send_unsatisfiable(fd, header, length);
+    }
+
+    // status line, header runs, new headers, and two iovecs per part plus
+    // the closing boundary
+    int nlines = 0;
+    for (const char *p = header; p < header_end; p++) {
+        nlines += *p == '\n';
+    }
+    struct iovec *iov =
+        (struct iovec *)malloc((nlines + 3 + 2 * nranges) * sizeof(*iov));
+    if (iov == NULL) {
+        return -1;
+    }
+    int iovcnt = 0;
+
+    char status[MAXLINE];
+    int status_len = snprintf(status, sizeof(status),
+                              "%.8s 206 Partial Content\r\n", header);
+    iov[iovcnt].iov_base = status;
+    iov[iovcnt].iov_len = status_len;
+    iovcnt++;
+
+    bool multipart = nranges > 1;
+    iovcnt = add_header_lines(iov, iovcnt, header, header_end, multipart);
+
+    char extra[MAXLINE];
+    char *parts = NULL;
+    char closing[MAXLINE];
+    ssize_t n;
+
+    if (!multipart) {
+        int extra_len = snprintf(extra, sizeof(extra),
+                                 "Content-Range: bytes %zu-%zu/%zu\r\n"
+                                 "Content-Length: %zu\r\n\r\n",
+                                 ranges[0].first, ranges[0].last, length,
+                                 ranges[0].last - ranges[0].first + 1);
+        iov[iovcnt].iov_base = extra;
+        iov[iovcnt].iov_len = extra_len;
+        iovcnt++;
+        iov[iovcnt].iov_base = (char *)body + ranges[0].first;
+        iov[iovcnt].iov_len = ranges[0].last - ranges[0].first + 1;
+        iovcnt++;
+    } else {
+        char boundary[64];
+        snprintf(boundary, sizeof(boundary), "%010d%010lu", (int)getpid(),
+                 __atomic_fetch_add(&boundary_counter, 1, __ATOMIC_RELAXED));
+
+        const char *type = NULL;
+        size_t type_len = 0;
+        find_header(header, header_end, "Content-Type", &type, &type_len);
+
+        // every part header is the boundary, the type and the range
+        size_t part_size = type_len + 160;
+        parts = (char *)malloc(nranges * part_size);
+        if (parts == NULL) {
+            free(iov);
+            return -1;
+        }
+
+        size_t content_length = 0;
+        int part_iov = iovcnt + 1;
+        for (int i = 0; i < nranges; i++) {
+            char *part = parts + i * part_size;
+            int part_len;
+            if (type != NULL) {
+                part_len = snprintf(part, part_size,
+                                    "\r\n--%s\r\n"
+                                    "Content-Type: %.*s\r\n"
+                                    "Content-Range: bytes %zu-%zu/%zu\r\n\r\n",
+                                    boundary, (int)type_len, type,
+                                    ranges[i].first, ranges[i].last, length);
+            } else {
+                part_len = snprintf(part, part_size,
+                                    "\r\n--%s\r\n"
+                                    "Content-Range: bytes %zu-%zu/%zu\r\n\r\n",
+                                    boundary, ranges[i].first, ranges[i].last,
+                                    length);
+            }
+            iov[part_iov].iov_base = part;
+            iov[part_iov].iov_len = part_len;
+            part_iov++;
+            iov[part_iov].iov_base = (char *)body + ranges[i].first;
+            iov[part_iov].iov_len = ranges[i].last - ranges[i].first + 1;
+            part_iov++;
+            content_length += part_len + ranges[i].last - ranges[i].first + 1;
+        }
+        int closing_len =
+            snprintf(closing, sizeof(closing), "\r\n--%s--\r\n", boundary);
+        iov[part_iov].iov_base = closing;
+        iov[part_iov].iov_len = closing_len;
+        part_iov++;
+        content_length += closing_len;
+
+        int extra_len = snprintf(extra, sizeof(extra),
+                                 "Content-Type: multipart/byteranges; "
+                                 "boundary=%s\r\n"
+                                 "Content-Length: %zu\r\n\r\n",
+                                 boundary, content_length);
+        iov[iovcnt].iov_base = extra;
+        iov[iovcnt].iov_len = extra_len;
+        iovcnt = part_iov;
+    }
+
+    n = writev_all(fd, iov, iovcnt);
+    free(parts);
+    free(iov);
+    return n < 0 ? 0 : n;
+}
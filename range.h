@@ -0,0 +1,69 @@
+/**
+ * @file range.h
+ * @brief Interface for answering byte-range requests from whole responses
+ *
+ * When the complete response for a URI is at hand (in the cache, or fetched
+ * in full on a miss), requests carrying a Range header are answered from it
+ * with 206 Partial Content, without contacting the server.
+ */
+
+#ifndef RANGE_H
+#define RANGE_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * Max number of ranges served in one multipart/byteranges response; requests
+ * asking for more get the whole object
+ */
+#define MAX_RANGES 16
+
+/**
+ * @brief An inclusive range of body byte positions
+ */
+typedef struct byte_range {
+    size_t first;
+    size_t last;
+} byte_range_t;
+
+/**
+ * @brief Parse the value of a Range header against a body length
+ * @param[in] value Range header value, e.g. "bytes=0-99,-500"
+ * @param[in] value_len Length of the value
+ * @param[in] length Length of the body
+ * @param[out] ranges Satisfiable ranges, clamped to the body
+ * @param[in] max_ranges Capacity of ranges
+ * @return Number of satisfiable ranges
+ * @return 0 if no range is satisfiable
+ * @return -1 if the header is invalid or asks for too many ranges, in which
+ * case it should be ignored
+ */
+int parse_ranges(const char *value, size_t value_len, size_t length,
+                 byte_range_t *ranges, int max_ranges);
+
+/**
+ * @brief Answer a range request from a complete response
+ *
+ * Applies when the request has a Range header, the response is a 200 with a
+ * complete header block, and the request's If-Range (if any) matches the
+ * response's ETag or Last-Modified. Single ranges are sent as a 206 with
+ * Content-Range, several ranges as multipart/byteranges, and unsatisfiable
+ * ones as a 416. The body slices are written straight from the body buffer
+ * with writev.
+ *
+ * @param[in] fd Connected descriptor
+ * @param[in] header Status line and headers of the response, including the
+ * blank line ending them
+ * @param[in] header_size Size of the header block
+ * @param[in] body Body of the response
+ * @param[in] body_size Size of the body
+ * @param[in] headers Request header lines, "Name: value\r\n" each
+ * @return Number of bytes sent, 0 if writing to the client failed
+ * @return -1 if the request is not a range request for this response, in
+ * which case the caller should send the whole response
+ */
+ssize_t send_ranges(int fd, const char *header, size_t header_size,
+                    const char *body, size_t body_size, const char *headers);
+
+#endif /* RANGE_H */
@@ -0,0 +1,181 @@
+/**
+ * @file ratelimit.c
+ * @brief Rate limiting of clients by source address
+ *
+ * A bucket's tokens and the time it was last refilled are packed into one
+ * word, so that taking a token is a single compare-and-swap. Tokens are
+ * counted in thousandths, which makes the refill per millisecond equal to
+ * the rate per second. Times are milliseconds on CLOCK_MONOTONIC, truncated
+ * to 32 bits; differences are taken modulo 2^32.
+ */
+
+#include "ratelimit.h"
+#include "hash.h"
+
+#include <netinet/in.h>
+#include <stdint.h>
+#include <time.h>
+
+/* A client's bucket */
+typedef struct bucket {
+    uint64_t key;         // hash of the client's address, 0 if free
+    uint64_t state;       // refill time << 32 | thousandths of tokens
+    unsigned connections; // connections in flight
+} bucket_t;
+
+static bucket_t buckets[RATELIMIT_TABLE_SIZE];
+static unsigned limit_rate = 0;
+static unsigned limit_connections = 0;
+
+/*
+ * now_ms - the time in milliseconds, truncated to 32 bits
+ */
+static uint32_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+/*
+ * full_bucket - state of a bucket that was refilled to its burst at now
+ */
+static uint64_t full_bucket(uint32_t now) {
+    return (uint64_t)now << 32 | (uint64_t)limit_rate * 2 * 1000;
+}
+
+/*
+ * address_key - hash the host part of an address, never 0
+ */
+static uint64_t address_key(const struct sockaddr *addr) {
+    uint64_t key;
+    if (addr->sa_family == AF_INET6) {
+        const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)addr;
+        key = xxh64(&in6->sin6_addr, sizeof(in6->sin6_addr), AF_INET6);
+    } else if (addr->sa_family == AF_INET) {
+        const struct sockaddr_in *in = (const struct sockaddr_in *)addr;
+        key = xxh64(&in->sin_addr, sizeof(in->sin_addr), AF_INET);
+    } else {
+        key = addr->sa_family;
+    }
+    return key != 0 ? key : 1;
+}
+
+/*
+ * find_bucket - find the slot of a key, taking over a free slot or the
+ * least recently refilled idle one if it has none
+ * Returns -1 if every slot searched is in use by a client with connections.
+ */
+static int find_bucket(uint64_t key, uint32_t now) {
+    int victim = -1;
+    uint32_t victim_age = 0;
+
+    for (int i = 0; i < RATELIMIT_PROBES; i++) {
+        int slot = (key + i) % RATELIMIT_TABLE_SIZE;
+        bucket_t *b = &buckets[slot];
+        uint64_t k = __atomic_load_n(&b->key, __ATOMIC_ACQUIRE);
+        if (k == key) {
+            return slot;
+        }
+        if (k == 0) {
+            if (__atomic_compare_exchange_n(&b->key, &k, key, false,
+                                            __ATOMIC_ACQ_REL,
+                                            __ATOMIC_ACQUIRE)) {
+                __atomic_store_n(&b->state, full_bucket(now),
+                                 __ATOMIC_RELEASE);
+                return slot;
+            }
+            if (k == key) {
+                return slot; // taken by another connection of the client
+            }
+        }
+        if (__atomic_load_n(&b->connections, __ATOMIC_RELAXED) == 0) {
+            uint64_t state = __atomic_load_n(&b->state, __ATOMIC_RELAXED);
+            uint32_t age = now - (uint32_t)(state >> 32);
+            if (victim < 0 || age > victim_age) {
+                victim = slot;
+                victim_age = age;
+            }
+        }
+    }
+
+    // evict; a client racing with the eviction may lose or gain a few
+    // tokens, which is as approximate as the table already is
+    if (victim >= 0) {
+        bucket_t *b = &buckets[victim];
+        uint64_t k = __atomic_load_n(&b->key, __ATOMIC_ACQUIRE);
+        if (__atomic_compare_exchange_n(&b->key, &k, key, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            __atomic_store_n(&b->state, full_bucket(now), __ATOMIC_RELEASE);
+            return victim;
+        }
+    }
+    return -1;
+}
+
+/*
+ * take_token - refill a bucket and take a token from it
+ * Returns false if it has none.
+ */
+static bool take_token(bucket_t *b, uint32_t now) {
+    uint64_t burst = (uint64_t)limit_rate * 2 * 1000;
+    uint64_t state = __atomic_load_n(&b->state, __ATOMIC_ACQUIRE);
+    uint64_t next;
+
+    do {
+        uint32_t elapsed = now - (uint32_t)(state >> 32);
+        uint64_t tokens = (state & UINT32_MAX) + (uint64_t)elapsed * limit_rate;
+        if (tokens > burst) {
+            tokens = burst;
+        }
+        if (tokens < 1000) {
+            return false;
+        }
+        next = (uint64_t)now << 32 | (tokens - 1000);
+    } while (!__atomic_compare_exchange_n(&b->state, &state, next, true,
+                                          __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+    return true;
+}
+
+void ratelimit_set_limits(unsigned rate, unsigned max_connections) {
+    // the burst, in thousandths of tokens, must fit in 32 bits
+    limit_rate = rate < UINT32_MAX / 2000 ? rate : UINT32_MAX / 2000;
+    limit_connections = max_connections;
+}
+
+bool ratelimit_admit(const struct sockaddr *addr, int *slot) {
+    *slot = -1;
+    if (limit_rate == 0 && limit_connections == 0) {
+        return true;
+    }
+
+    uint32_t now = now_ms();
+    int i = find_bucket(address_key(addr), now);
+    if (i < 0) {
+        return true; // table full of busy clients, fail open
+    }
+    bucket_t *b = &buckets[i];
+
+    if (limit_rate > 0 && !take_token(b, now)) {
+        return false;
+    }
+    unsigned n = __atomic_add_fetch(&b->connections, 1, __ATOMIC_RELAXED);
+    if (limit_connections > 0 && n > limit_connections) {
+        __atomic_sub_fetch(&b->connections, 1, __ATOMIC_RELAXED);
+        return false;
+    }
+    *slot = i;
+    return true;
+}
+
+void ratelimit_release(int slot) {
+    if (slot < 0) {
+        return;
+    }
+    // never below 0, should the bucket have been evicted meanwhile
+    unsigned *connections = &buckets[slot].connections;
+    unsigned n = __atomic_load_n(connections, __ATOMIC_RELAXED);
+    while (n > 0 &&
+           !__atomic_compare_exchange_n(connections, &n, n - 1, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
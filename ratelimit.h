@@ -0,0 +1,55 @@
+/**
+ * @file ratelimit.h
+ * @brief Interface for rate limiting of clients by source address
+ *
+ * Each client address has a token bucket, refilled at a fixed rate up to a
+ * burst, which every connection takes a token from, and a count of its
+ * connections in flight. The buckets live in a fixed-size table that is
+ * updated without locks; when the slots an address hashes to are all taken,
+ * the one of them least recently used by an idle client is given over to
+ * it, so the table forgets clients approximately in LRU order.
+ */
+
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <stdbool.h>
+#include <sys/socket.h>
+
+/*
+ * Number of buckets, and of slots searched for an address
+ */
+#define RATELIMIT_TABLE_SIZE 4096
+#define RATELIMIT_PROBES 4
+
+/**
+ * @brief Set the limits per client
+ *
+ * Both are disabled until set.
+ *
+ * @param[in] rate Connections per second, 0 for no limit; bursts of up to
+ * twice as many are let through
+ * @param[in] max_connections Connections in flight, 0 for no limit
+ */
+void ratelimit_set_limits(unsigned rate, unsigned max_connections);
+
+/**
+ * @brief Admit a connection from a client that has just been accepted
+ *
+ * An admitted connection is counted until ratelimit_release() is called
+ * with the slot.
+ *
+ * @param[in] addr Address of the client
+ * @param[out] slot Slot of the client's bucket, to release the connection
+ * @return true if the connection is admitted, false if the client is over
+ * its limits
+ */
+bool ratelimit_admit(const struct sockaddr *addr, int *slot);
+
+/**
+ * @brief Stop counting an admitted connection once it is closed
+ * @param[in] slot Slot given by ratelimit_admit()
+ */
+void ratelimit_release(int slot);
+
+#endif /* RATELIMIT_H */
@@ -0,0 +1,155 @@
+/**
+ * @file reader.c
+ * @brief Buffered line reader that returns views
+ *
+ * Bytes are read into the reader's buffer as large as it allows, and lines
+ * are found in it with memchr(). How far the search for the current line
+ * has got is kept, so bytes that arrive a few at a time are scanned once.
+ * When a line runs into the end of the buffer, the unread bytes are moved to
+ * its start, and if they already fill it, the buffer is replaced by one of
+ * the next size class.
+ */
+
+#include "reader.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+
+void reader_init(reader_t *r, int fd, size_t max_size) {
+    r->fd = fd;
+    r->buf = NULL;
+    r->start = 0;
+    r->end = 0;
+    r->scanned = 0;
+    r->max_size = max_size;
+}
+
+void reader_free(reader_t *r) {
+    buffer_put(r->buf);
+    r->buf = NULL;
+    r->start = 0;
+    r->end = 0;
+    r->scanned = 0;
+}
+
+/*
+ * make_room - make sure there is room after the buffered bytes to read into,
+ * getting, compacting or growing the buffer
+ * Returns -1 with errno set if out of memory or the buffer is at max_size.
+ */
+static int make_room(reader_t *r) {
+    if (r->buf == NULL) {
+        size_t size = READER_INITIAL_SIZE < r->max_size ? READER_INITIAL_SIZE
+                                                         : r->max_size;
+        if ((r->buf = buffer_get(size)) == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        return 0;
+    }
+    if (r->end < r->buf->size) {
+        return 0;
+    }
+
+    size_t unread = r->end - r->start;
+    if (r->start > 0) {
+        memmove(r->buf->data, r->buf->data + r->start, unread);
+        r->start = 0;
+        r->end = unread;
+        return 0;
+    }
+    if (r->buf->size >= r->max_size) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    buffer_t *grown = buffer_grow(r->buf, unread, r->buf->size + 1);
+    if (grown == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    r->buf = grown;
+    return 0;
+}
+
+/*
+ * fill - read what has arrived into the buffer
+ * Returns the number of bytes read, 0 on EOF, or -1 on error.
+ */
+static ssize_t fill(reader_t *r) {
+    if (make_room(r) < 0) {
+        return -1;
+    }
+
+    // a line may not run past max_size, however large the size class
+    size_t limit = r->start + r->max_size;
+    if (limit > r->buf->size) {
+        limit = r->buf->size;
+    }
+    if (limit <= r->end) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    ssize_t n;
+    while ((n = read(r->fd, r->buf->data + r->end, limit - r->end)) < 0 &&
+           errno == EINTR) {
+    }
+    if (n > 0) {
+        r->end += n;
+    }
+    return n;
+}
+
+ssize_t reader_readline(reader_t *r, const char **line) {
+    while (true) {
+        if (r->buf != NULL) {
+            char *start = r->buf->data + r->start;
+            size_t unread = r->end - r->start;
+            char *nl = memchr(start + r->scanned, '\n', unread - r->scanned);
+            if (nl != NULL) {
+                size_t len = nl + 1 - start;
+                *line = start;
+                r->start += len;
+                r->scanned = 0;
+                if (r->start == r->end) {
+                    r->start = r->end = 0; // nothing left to move later
+                }
+                return len;
+            }
+            r->scanned = unread;
+        }
+
+        ssize_t n = fill(r);
+        if (n < 0) {
+            return -1;
+        }
+        if (n == 0) {
+            // EOF, the rest is the last line
+            size_t len = r->buf != NULL ? r->end - r->start : 0;
+            if (len > 0) {
+                *line = r->buf->data + r->start;
+                r->start = r->end;
+                r->scanned = 0;
+            }
+            return len;
+        }
+    }
+}
+
+ssize_t reader_read(reader_t *r, void *usrbuf, size_t n) {
+    if (r->buf == NULL || r->start == r->end) {
+        // nothing buffered, read directly into the caller's buffer
+        ssize_t nread;
+        while ((nread = read(r->fd, usrbuf, n)) < 0 && errno == EINTR) {
+        }
+        return nread;
+    }
+
+    size_t cnt = r->end - r->start < n ? r->end - r->start : n;
+    memcpy(usrbuf, r->buf->data + r->start, cnt);
+    r->start += cnt;
+    r->scanned = r->scanned > cnt ? r->scanned - cnt : 0;
+    return cnt;
+}
@@ -0,0 +1,77 @@
+/**
+ * @file reader.h
+ * @brief Interface for a buffered line reader that returns views
+ *
+ * Unlike rio_readlineb(), which copies every line into the caller's buffer,
+ * reader_readline() hands out a pointer into the reader's own buffer. The
+ * buffer comes from the buffer pool on the first read, and grows, up to a
+ * limit given at initialization, when a line does not fit; a reader that has
+ * not read anything yet holds no buffer.
+ */
+
+#ifndef READER_H
+#define READER_H
+
+#include "buffer.h"
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * Initial size of a reader's buffer
+ */
+#define READER_INITIAL_SIZE (4 * 1024)
+
+/**
+ * @brief Buffered reader of a descriptor
+ */
+typedef struct reader {
+    int fd;
+    buffer_t *buf;   // NULL until the first read
+    size_t start;    // offset of the first unread byte
+    size_t end;      // offset past the last byte read
+    size_t scanned;  // bytes after start known to hold no newline
+    size_t max_size; // size the buffer may grow to
+} reader_t;
+
+/**
+ * @brief Associate a descriptor with a reader
+ * @param[out] r The reader
+ * @param[in] fd Descriptor to read from
+ * @param[in] max_size Longest line the reader accepts, newline included
+ */
+void reader_init(reader_t *r, int fd, size_t max_size);
+
+/**
+ * @brief Give back the reader's buffer
+ * @param[in] r The reader
+ */
+void reader_free(reader_t *r);
+
+/**
+ * @brief Read a line, up to and including its newline
+ *
+ * A last line cut short by EOF is returned without a newline. The line is
+ * not NUL-terminated, and stays valid until the next call on the reader.
+ *
+ * @param[in] r The reader
+ * @param[out] line Start of the line in the reader's buffer
+ * @return Length of the line, 0 on EOF, or -1 on error, with errno set to
+ * EMSGSIZE if the line is longer than the reader's max_size
+ */
+ssize_t reader_readline(reader_t *r, const char **line);
+
+/**
+ * @brief Read up to n bytes, taking buffered ones first
+ *
+ * Reads from the descriptor only if nothing is buffered, and then at most
+ * once, like read().
+ *
+ * @param[in] r The reader
+ * @param[out] usrbuf Buffer to copy the bytes to
+ * @param[in] n Max number of bytes
+ * @return Number of bytes copied, 0 on EOF, or -1 on error
+ */
+ssize_t reader_read(reader_t *r, void *usrbuf, size_t n);
+
+#endif /* READER_H */
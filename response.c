@@ -0,0 +1,108 @@
+/**
+ * @file response.c
+ * @brief The proxy's own, pre-rendered responses
+ *
+ * Error pages keep the look of the ones Tiny sends, but leave out the
+ * client's request line, so that they can be rendered ahead of time and do
+ * not echo whatever a client sent back into HTML.
+ */
+
+#include "response.h"
+#include "csapp.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* A response, and its rendering once init_responses() has run */
+typedef struct response {
+    const char *status;       // status code and reason phrase
+    const char *content_type; // NULL for an HTML error page
+    const char *content;      // body, or message of an error page
+    char *data;               // the whole response
+    size_t size;
+} response_t;
+
+static response_t responses[NRESPONSES] = {
+    [RESPONSE_HEALTH] = {"200 OK", "text/plain", "OK\n", NULL, 0},
+    [RESPONSE_BAD_REQUEST] = {"400 Bad Request", NULL,
+                              "Tiny could not handle this request (ERROR)",
+                              NULL, 0},
+    [RESPONSE_BAD_VERSION] =
+        {"400 Bad Request", NULL,
+         "Tiny could not handle this request (HTTP_VERSION)", NULL, 0},
+    [RESPONSE_NOT_FOUND] = {"404 Not Found", NULL,
+                            "Tiny could not find this resource", NULL, 0},
+    [RESPONSE_NOT_IMPLEMENTED] = {"501 Not implemented", NULL,
+                                  "Tiny does not implement this method", NULL,
+                                  0},
+    [RESPONSE_TOO_MANY] = {"429 Too Many Requests", NULL,
+                           "Tiny is getting too many requests from you", NULL,
+                           0},
+    [RESPONSE_UNAVAILABLE] = {"503 Service Unavailable", NULL,
+                              "Tiny is overloaded, try again later", NULL, 0},
+    [RESPONSE_BAD_GATEWAY] = {"502 Bad Gateway", NULL,
+                              "Tiny could not get a response to relay", NULL,
+                              0},
+    [RESPONSE_GATEWAY_TIMEOUT] = {"504 Gateway Timeout", NULL,
+                                  "Tiny timed out waiting for the server",
+                                  NULL, 0},
+};
+
+/*
+ * render - render a response into one buffer
+ * Returns -1 if out of memory.
+ */
+static int render(response_t *response) {
+    char body[MAXBUF];
+    int bodylen;
+
+    if (response->content_type != NULL) {
+        bodylen = snprintf(body, sizeof(body), "%s", response->content);
+    } else {
+        bodylen = snprintf(body, sizeof(body),
+                           "<html>\r\n"
+                           "<head><title>Tiny Error</title></head>\r\n"
+                           "<body bgcolor=\"ffffff\">\r\n"
+                           "<h1>%s</h1>\r\n"
+                           "<p>%s</p>\r\n"
+                           "<hr><em>The Tiny Web server</em>\r\n"
+                           "</body></html>\r\n",
+                           response->status, response->content);
+    }
+
+    char *data = (char *)malloc(MAXLINE + bodylen);
+    if (data == NULL) {
+        return -1;
+    }
+    int size = snprintf(data, MAXLINE + bodylen,
+                        "HTTP/1.0 %s\r\n"
+                        "Content-Type: %s\r\n"
+                        "Content-Length: %d\r\n"
+                        "Connection: close\r\n\r\n"
+                        "%s",
+                        response->status,
+                        response->content_type != NULL
+                            ? response->content_type
+                            : "text/html",
+                        bodylen, body);
+    response->data = data;
+    response->size = size;
+    return 0;
+}
+
+void init_responses(void) {
+    for (int i = 0; i < NRESPONSES; i++) {
+        if (render(&responses[i]) < 0) {
+            fprintf(stderr, "Failed to render response %d\n", i);
+            exit(1);
+        }
+    }
+}
+
+ssize_t send_response(int fd, response_id_t id) {
+    if (id < 0 || id >= NRESPONSES || responses[id].data == NULL) {
+        return -1;
+    }
+    return rio_writen(fd, responses[id].data, responses[id].size);
+}
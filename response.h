@@ -0,0 +1,46 @@
+/**
+ * @file response.h
+ * @brief Interface for the proxy's own, pre-rendered responses
+ *
+ * Responses that do not depend on the request, such as errors and the health
+ * check, are rendered once into a table, status line to body, and each is
+ * sent with a single write.
+ */
+
+#ifndef RESPONSE_H
+#define RESPONSE_H
+
+#include <sys/types.h>
+
+/**
+ * @brief The proxy's own responses
+ */
+typedef enum response_id {
+    RESPONSE_HEALTH,          // 200, to GET /health
+    RESPONSE_BAD_REQUEST,     // 400, for requests that do not parse
+    RESPONSE_BAD_VERSION,     // 400, for HTTP versions other than 1.0 and 1.1
+    RESPONSE_NOT_FOUND,       // 404, for other paths on the proxy itself
+    RESPONSE_NOT_IMPLEMENTED, // 501, for methods other than GET
+    RESPONSE_TOO_MANY,        // 429, for clients over their rate limits
+    RESPONSE_UNAVAILABLE,     // 503, for requests shed under overload
+    RESPONSE_BAD_GATEWAY,     // 502, for responses that cannot be relayed
+    RESPONSE_GATEWAY_TIMEOUT, // 504, for web servers that timed out
+    NRESPONSES
+} response_id_t;
+
+/**
+ * @brief Render the table of responses
+ *
+ * Must be called once before send_response().
+ */
+void init_responses(void);
+
+/**
+ * @brief Send one of the proxy's own responses
+ * @param[in] fd Connected descriptor
+ * @param[in] id The response
+ * @return Number of bytes written, or -1 on error
+ */
+ssize_t send_response(int fd, response_id_t id);
+
+#endif /* RESPONSE_H */
@@ -0,0 +1,82 @@
+/**
+ * @file stages.c
+ * @brief Latency histograms of the stages of requests
+ *
+ * The proxy starts a thread per connection, so histograms are sharded by
+ * thread ID rather than kept per thread; a short-lived thread would
+ * otherwise leave its histograms behind, or have to merge them on exit.
+ */
+
+#include "stages.h"
+#include "hash.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+static histogram_t shards[NSTAGES][STAGE_SHARDS];
+
+static const char *stage_names[NSTAGES] = {
+    [STAGE_ACCEPT] = "accept",         [STAGE_PARSE] = "parse",
+    [STAGE_LOOKUP] = "lookup",         [STAGE_HIT] = "hit",
+    [STAGE_DNS] = "dns",               [STAGE_CONNECT] = "connect",
+    [STAGE_FIRST_BYTE] = "first_byte", [STAGE_TRANSFER] = "transfer",
+    [STAGE_INSERT] = "insert",         [STAGE_TOTAL] = "total",
+};
+
+uint64_t stage_time(const struct timespec *ts) {
+    return (uint64_t)ts->tv_sec * 1000000 + ts->tv_nsec / 1000;
+}
+
+uint64_t stage_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return stage_time(&ts);
+}
+
+uint64_t stage_record(stage_t stage, uint64_t start) {
+    uint64_t now = stage_clock();
+    histogram_record(&shards[stage][thread_shard(STAGE_SHARDS)],
+                     now > start ? now - start : 0);
+    return now;
+}
+
+void stage_histogram(stage_t stage, histogram_t *h) {
+    histogram_reset(h);
+    for (int i = 0; i < STAGE_SHARDS; i++) {
+        histogram_merge(h, &shards[stage][i]);
+    }
+}
+
+const char *stage_name(stage_t stage) {
+    return stage_names[stage];
+}
+
+size_t stage_report(char *buf, size_t len) {
+    static histogram_t h; // too large for a thread's stack to spare
+    static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    size_t pos = 0;
+    int n;
+
+    pthread_mutex_lock(&mutex);
+    n = snprintf(buf, len, "%-10s %10s %9s %9s %9s %9s %9s %9s\n", "stage",
+                 "count", "mean us", "p50", "p90", "p99", "p99.9", "max");
+    for (int s = 0; s < NSTAGES && n > 0 && pos + n < len; s++) {
+        pos += n;
+        stage_histogram((stage_t)s, &h);
+        n = snprintf(buf + pos, len - pos,
+                     "%-10s %10lu %9.0f %9lu %9lu %9lu %9lu %9lu\n",
+                     stage_names[s], (unsigned long)h.total,
+                     histogram_mean(&h),
+                     (unsigned long)histogram_percentile(&h, 50),
+                     (unsigned long)histogram_percentile(&h, 90),
+                     (unsigned long)histogram_percentile(&h, 99),
+                     (unsigned long)histogram_percentile(&h, 99.9),
+                     (unsigned long)h.max);
+    }
+    if (n > 0 && pos + n < len) {
+        pos += n;
+    }
+    pthread_mutex_unlock(&mutex);
+    return pos;
+}
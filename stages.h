@@ -0,0 +1,87 @@
+/**
+ * @file stages.h
+ * @brief Interface for latency histograms of the stages of requests
+ *
+ * The proxy times each stage of a request with the monotonic clock and
+ * records the duration, in microseconds, into a histogram per stage. Each
+ * histogram is split into shards that threads pick by their thread ID, so
+ * that threads rarely share the cache lines they count into; the shards are
+ * merged when the histograms are reported. Recording costs a clock read and
+ * a few relaxed atomic increments, so the histograms are always kept.
+ */
+
+#ifndef STAGES_H
+#define STAGES_H
+
+#include "histogram.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Number of shards of each stage's histogram
+ */
+#define STAGE_SHARDS 8
+
+/**
+ * @brief Stages of a request
+ */
+typedef enum stage {
+    STAGE_ACCEPT,     // accepting the connection to the request's first byte
+    STAGE_PARSE,      // the first byte to the request parsed
+    STAGE_LOOKUP,     // looking up a miss in the cache
+    STAGE_HIT,        // looking up and sending a hit
+    STAGE_DNS,        // resolving the web server's name
+    STAGE_CONNECT,    // connecting to the web server
+    STAGE_FIRST_BYTE, // the request sent to the response's first byte
+    STAGE_TRANSFER,   // the response's first byte to its last, relayed
+    STAGE_INSERT,     // storing the response in the cache
+    STAGE_TOTAL,      // accepting the connection to closing it
+    NSTAGES
+} stage_t;
+
+/**
+ * @brief Read the clock stages are timed with
+ * @return CLOCK_MONOTONIC, in microseconds
+ */
+uint64_t stage_clock(void);
+
+/**
+ * @brief Convert a CLOCK_MONOTONIC time to stage_clock() microseconds
+ * @param[in] ts The time
+ * @return The time in microseconds
+ */
+uint64_t stage_time(const struct timespec *ts);
+
+/**
+ * @brief Record the duration of a stage that ends now
+ * @param[in] stage The stage
+ * @param[in] start When the stage started, from stage_clock()
+ * @return The time now, for the start of the next stage
+ */
+uint64_t stage_record(stage_t stage, uint64_t start);
+
+/**
+ * @brief Merge the shards of a stage's histogram
+ * @param[in] stage The stage
+ * @param[out] h Histogram the shards are merged into
+ */
+void stage_histogram(stage_t stage, histogram_t *h);
+
+/**
+ * @brief Name of a stage
+ * @param[in] stage The stage
+ * @return The name, e.g. "first_byte"
+ */
+const char *stage_name(stage_t stage);
+
+/**
+ * @brief Render a table of the count and percentiles of every stage
+ * @param[out] buf Buffer for the table
+ * @param[in] len Size of the buffer
+ * @return Length of the table, truncated to fit the buffer
+ */
+size_t stage_report(char *buf, size_t len);
+
+#endif /* STAGES_H */
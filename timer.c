@@ -0,0 +1,159 @@
+/**
+ * @file timer.c
+ * @brief I/O deadlines on descriptors, kept in a hashed timer wheel
+ *
+ * Time is counted in ticks of TIMER_TICK_MS since the timer thread started.
+ * An armed deadline sits in the slot of its expiry tick modulo the number of
+ * slots. Every tick, the timer thread walks the slot of that tick, firing
+ * the deadlines that are due and leaving those of later turns in place.
+ * Everything is under one lock, which the timer thread holds only for the
+ * slots it walks.
+ */
+
+#include "timer.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <time.h>
+
+static deadline_t *wheel[TIMER_WHEEL_SLOTS];
+static uint64_t current_tick = 0; // last tick the timer thread has walked
+static struct timespec epoch;     // when tick 0 started
+static pthread_mutex_t timer_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#define TICK_NS ((uint64_t)TIMER_TICK_MS * 1000000)
+
+/*
+ * elapsed_ns - nanoseconds since tick 0 started
+ */
+static uint64_t elapsed_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)(ts.tv_sec - epoch.tv_sec) * 1000000000 + ts.tv_nsec -
+           epoch.tv_nsec;
+}
+
+/*
+ * now_tick - the tick the clock is in
+ */
+static uint64_t now_tick(void) {
+    return elapsed_ns() / TICK_NS;
+}
+
+/*
+ * unlink_deadline - take an armed deadline out of its slot
+ * Must be called with the lock held.
+ */
+static void unlink_deadline(deadline_t *d) {
+    if (d->prev != NULL) {
+        d->prev->next = d->next;
+    } else {
+        wheel[d->expires % TIMER_WHEEL_SLOTS] = d->next;
+    }
+    if (d->next != NULL) {
+        d->next->prev = d->prev;
+    }
+    d->next = NULL;
+    d->prev = NULL;
+    d->armed = false;
+}
+
+/*
+ * timer_thread - walk the slot of every tick as it passes, firing the
+ * deadlines that are due
+ */
+static void *timer_thread(void *vargp) {
+    (void)vargp;
+    struct timespec tick = {0, TIMER_TICK_MS * 1000000L};
+
+    while (true) {
+        nanosleep(&tick, NULL);
+        uint64_t now = now_tick();
+
+        pthread_mutex_lock(&timer_mutex);
+        while (current_tick < now) {
+            current_tick++;
+            deadline_t *d = wheel[current_tick % TIMER_WHEEL_SLOTS];
+            while (d != NULL) {
+                deadline_t *next = d->next;
+                if (d->expires <= current_tick) {
+                    unlink_deadline(d);
+                    d->fired = true;
+                    shutdown(d->fd, SHUT_RDWR);
+                }
+                d = next;
+            }
+        }
+        pthread_mutex_unlock(&timer_mutex);
+    }
+    return NULL;
+}
+
+void timer_init(void) {
+    pthread_t tid;
+    clock_gettime(CLOCK_MONOTONIC, &epoch);
+    if (pthread_create(&tid, NULL, timer_thread, NULL) != 0) {
+        fprintf(stderr, "Failed to start the timer thread\n");
+        exit(1);
+    }
+    pthread_detach(tid);
+}
+
+void deadline_init(deadline_t *d) {
+    d->next = NULL;
+    d->prev = NULL;
+    d->expires = 0;
+    d->fd = -1;
+    d->armed = false;
+    d->fired = false;
+}
+
+void deadline_arm(deadline_t *d, int fd, unsigned ms) {
+    if (ms == 0) {
+        deadline_cancel(d);
+        return;
+    }
+
+    // the timer thread walks a tick once the clock reaches its start; the
+    // expiry time is rounded up to a tick start so the deadline never fires
+    // early
+    uint64_t expires = (elapsed_ns() + (uint64_t)ms * 1000000 + TICK_NS - 1) /
+                       TICK_NS;
+
+    pthread_mutex_lock(&timer_mutex);
+    if (d->armed) {
+        unlink_deadline(d);
+    }
+    if (expires <= current_tick) {
+        expires = current_tick + 1; // the timer thread is behind the clock
+    }
+    d->expires = expires;
+    d->fd = fd;
+    d->fired = false;
+    d->armed = true;
+    deadline_t **slot = &wheel[expires % TIMER_WHEEL_SLOTS];
+    d->prev = NULL;
+    d->next = *slot;
+    if (*slot != NULL) {
+        (*slot)->prev = d;
+    }
+    *slot = d;
+    pthread_mutex_unlock(&timer_mutex);
+}
+
+void deadline_cancel(deadline_t *d) {
+    pthread_mutex_lock(&timer_mutex);
+    if (d->armed) {
+        unlink_deadline(d);
+    }
+    pthread_mutex_unlock(&timer_mutex);
+}
+
+bool deadline_fired(deadline_t *d) {
+    pthread_mutex_lock(&timer_mutex);
+    bool fired = d->fired;
+    pthread_mutex_unlock(&timer_mutex);
+    return fired;
+}
@@ -0,0 +1,80 @@
+/**
+ * @file timer.h
+ * @brief Interface for I/O deadlines on descriptors, kept in a timer wheel
+ *
+ * A deadline names a descriptor and a time. If the deadline is still armed
+ * when the time comes, a timer thread shuts the descriptor down, so that the
+ * thread blocked reading or writing it returns with EOF or an error and can
+ * give up on the connection. Arming, re-arming and cancelling take constant
+ * time, however many deadlines are pending.
+ */
+
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Resolution of deadlines, in milliseconds
+ */
+#define TIMER_TICK_MS 100
+
+/*
+ * Number of slots of the wheel; deadlines further away than one turn of the
+ * wheel wait in their slot for later turns
+ */
+#define TIMER_WHEEL_SLOTS 512
+
+/**
+ * @brief A deadline, owned by the caller and linked into the wheel while
+ * armed
+ */
+typedef struct deadline {
+    struct deadline *next; // next deadline in the same slot
+    struct deadline *prev; // previous deadline in the same slot
+    uint64_t expires;      // tick at which it fires
+    int fd;                // descriptor to shut down
+    bool armed;            // whether it is in the wheel
+    bool fired;            // whether it has fired since it was last armed
+} deadline_t;
+
+/**
+ * @brief Start the timer thread
+ *
+ * Must be called once before any deadline is armed.
+ */
+void timer_init(void);
+
+/**
+ * @brief Initialize a deadline, not armed
+ * @param[out] d The deadline
+ */
+void deadline_init(deadline_t *d);
+
+/**
+ * @brief Arm a deadline, or move it if it is already armed
+ * @param[in] d The deadline
+ * @param[in] fd Descriptor to shut down when it fires
+ * @param[in] ms Milliseconds from now; 0 cancels the deadline instead
+ */
+void deadline_arm(deadline_t *d, int fd, unsigned ms);
+
+/**
+ * @brief Cancel a deadline
+ *
+ * Must be called before the descriptor is closed, or the deadline goes out
+ * of scope; once it returns, the deadline will not fire.
+ *
+ * @param[in] d The deadline
+ */
+void deadline_cancel(deadline_t *d);
+
+/**
+ * @brief Check whether a deadline has fired since it was last armed
+ * @param[in] d The deadline
+ * @return true if its descriptor was shut down
+ */
+bool deadline_fired(deadline_t *d);
+
+#endif /* TIMER_H */
@@ -1,24 +1,76 @@
 /*
  * adder.c - a minimal CGI program that adds two numbers together
+ *
+ * Run by tiny as a persistent CGI program (see ../cgi.h), it answers
+ * requests in a loop instead of exiting after one.
  */
 /* $begin adder */
 #include "csapp.h"
+#include "../cgi.h"
 
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
-int main(void) {
-    char *buf, *p;
+/*
+ * read_full - read exactly n bytes
+ * Returns false on error or end of file.
+ */
+static bool read_full(int fd, void *buf, size_t n) {
+    char *p = buf;
+    while (n > 0) {
+        ssize_t nread = read(fd, p, n);
+        if (nread < 0 && errno == EINTR) {
+            continue;
+        }
+        if (nread <= 0) {
+            return false;
+        }
+        p += nread;
+        n -= nread;
+    }
+    return true;
+}
+
+/*
+ * write_full - write exactly n bytes
+ * Returns false on error.
+ */
+static bool write_full(int fd, const void *buf, size_t n) {
+    const char *p = buf;
+    while (n > 0) {
+        ssize_t nwritten = write(fd, p, n);
+        if (nwritten < 0 && errno == EINTR) {
+            continue;
+        }
+        if (nwritten <= 0) {
+            return false;
+        }
+        p += nwritten;
+        n -= nwritten;
+    }
+    return true;
+}
+
+/*
+ * respond - render the response to a query string into buf
+ * Returns the length of the response.
+ */
+static size_t respond(char *query, char *buf, size_t size) {
+    char *p;
     char content[MAXLINE];
     int n1=0, n2=0;
 
     /* Extract the two arguments */
-    if ((buf = getenv("QUERY_STRING")) != NULL) {
-        p = strchr(buf, '&');
+    if (query != NULL) {
+        p = strchr(query, '&');
         if (p != NULL) {
             *p = '\0';
-            n1 = atoi(buf);
+            n1 = atoi(query);
             n2 = atoi(p+1);
         }
     }
@@ -32,11 +84,52 @@ int main(void) {
         n1, n2, n1 + n2);
 
     /* Generate the HTTP response */
-    printf("Connection: close\r\n");
-    printf("Content-length: %zu\r\n", strlen(content));
-    printf("Content-type: text/html\r\n");
-    printf("\r\n");
-    printf("%s", content);
+    return snprintf(buf, size,
+        "Connection: close\r\n"
+        "Content-length: %zu\r\n"
+        "Content-type: text/html\r\n"
+        "\r\n"
+        "%s", strlen(content), content);
+}
+
+/*
+ * serve_frames - answer framed requests from tiny until it hangs up
+ */
+static void serve_frames(void) {
+    char query[MAXLINE];
+    char buf[MAXBUF];
+    uint32_t len;
+
+    if (!write_full(STDOUT_FILENO, CGI_HELLO, CGI_HELLO_LEN)) {
+        return;
+    }
+    while (read_full(STDIN_FILENO, &len, sizeof(len))) {
+        if (len >= sizeof(query) || !read_full(STDIN_FILENO, query, len)) {
+            return;
+        }
+        query[len] = '\0';
+
+        uint32_t size = respond(query, buf, sizeof(buf));
+        uint32_t end = 0;
+        if (size >= sizeof(buf)
+                || !write_full(STDOUT_FILENO, &size, sizeof(size))
+                || !write_full(STDOUT_FILENO, buf, size)
+                || !write_full(STDOUT_FILENO, &end, sizeof(end))) {
+            return;
+        }
+    }
+}
+
+int main(void) {
+    char buf[MAXBUF];
+
+    if (getenv(TINY_CGI_ENV) != NULL) {
+        serve_frames();
+        exit(0);
+    }
+
+    size_t size = respond(getenv("QUERY_STRING"), buf, sizeof(buf));
+    fwrite(buf, 1, size, stdout);
     fflush(stdout);
 
     exit(0);
@@ -0,0 +1,23 @@
+/*
+ * cgi.h - framing of requests to persistent CGI programs
+ *
+ * With -c, tiny keeps CGI programs running instead of starting one per
+ * request. Such a program is started with TINY_CGI_ENV set in its
+ * environment, and its stdin and stdout both connected to a socket to tiny.
+ * It first writes CGI_HELLO; a program that writes anything else is taken
+ * not to speak this protocol, and is run once per request as before.
+ *
+ * Then, for each request, tiny writes a frame holding the query string, and
+ * the program answers with frames holding what a CGI program would write to
+ * its stdout, followed by an empty frame. A frame is its length, as a
+ * uint32_t in host order, and that many bytes.
+ */
+
+#ifndef CGI_H
+#define CGI_H
+
+#define TINY_CGI_ENV "TINY_CGI"
+#define CGI_HELLO "TINYCGI1"
+#define CGI_HELLO_LEN 8
+
+#endif /* CGI_H */
@@ -2,33 +2,71 @@
  * tiny.c - A simple, iterative HTTP/1.0 Web server that uses the
  *     GET method to serve static and dynamic content.
  *
+ * With -t, connections are served concurrently by a pool of threads that
+ * each accept from the listening socket, so that tiny can stand in for an
+ * origin server when load-testing the proxy.
+ *
  * Updated 04/2017 - Stanley Zhang <szz@andrew.cmu.edu>
  * Fixed some style issues, stop using csapp functions where not appropriate
  */
 
+/* For syscall(), to close a CGI child's descriptors */
+#define _DEFAULT_SOURCE
+
 #include "csapp.h"
+#include "reader.h"
+#include "cgi.h"
+#include "range.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <stdbool.h>
 #include <unistd.h>
 #include <ctype.h>
+#include <limits.h>
+#include <time.h>
+#include <errno.h>
 
 #include <fcntl.h>
+#include <stdint.h>
 #include <sys/stat.h>
-#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <netinet/in.h>
 #include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 
 #define HOSTLEN 256
 #define SERVLEN 8
 
+/*
+ * How long a kept-alive connection may sit idle between requests, and how
+ * many requests it may carry
+ */
+#define KEEPALIVE_TIMEOUT_SEC 5
+#define KEEPALIVE_MAX_REQUESTS 100
+
 /* Typedef for convenience */
 typedef struct sockaddr SA;
 
+/* Headers of a request that tiny acts on; empty strings if absent. */
+typedef struct {
+    char version;               // Minor HTTP version, '0' or '1'
+    bool keep_alive;            // Whether the client asks to keep the
+                                // connection open
+    char if_none_match[MAXLINE];
+    char if_modified_since[MAXLINE];
+    char range[MAXLINE];
+    char if_range[MAXLINE];
+} request_info;
+
 /* Information about a connected client. */
 typedef struct {
     struct sockaddr_in addr;    // Socket address
@@ -36,6 +74,8 @@ typedef struct {
     int connfd;                 // Client connection file descriptor
     char host[HOSTLEN];         // Client host
     char serv[SERVLEN];         // Client service (port)
+    reader_t reader;            // Buffered reader of the connection
+    request_info request;       // The request being served
 } client_info;
 
 /* URI parsing results. */
@@ -106,89 +146,838 @@ parse_result parse_uri(char *uri, char *filename, char *cgiargs) {
     return PARSE_STATIC;
 }
 
+/* MIME types by file name extension. */
+typedef struct {
+    const char *ext;
+    const char *type;
+} mime_type;
+
+static const mime_type mime_types[] = {
+    {"html", "text/html"},
+    {"htm", "text/html"},
+    {"gif", "image/gif"},
+    {"png", "image/png"},
+    {"jpg", "image/jpeg"},
+    {"jpeg", "image/jpeg"},
+    {"css", "text/css"},
+    {"js", "text/javascript"},
+};
+
+#define NMIME_TYPES (sizeof(mime_types) / sizeof(mime_types[0]))
+
+/* Hash table of mime_types, open addressing; a power of 2 */
+#define MIME_TABLE_SIZE 32
+
+static const mime_type *mime_table[MIME_TABLE_SIZE];
+
 /*
- * get_filetype - derive file type from file name
+ * hash_ext - FNV-1a hash of a file name extension
+ */
+static unsigned hash_ext(const char *ext) {
+    unsigned h = 2166136261u;
+    for (; *ext != '\0'; ext++) {
+        h = (h ^ (unsigned char) *ext) * 16777619u;
+    }
+    return h;
+}
+
+/*
+ * init_mime_types - build the hash table of MIME types
+ */
+void init_mime_types(void) {
+    for (size_t i = 0; i < NMIME_TYPES; i++) {
+        unsigned h = hash_ext(mime_types[i].ext);
+        while (mime_table[h % MIME_TABLE_SIZE] != NULL) {
+            h++;
+        }
+        mime_table[h % MIME_TABLE_SIZE] = &mime_types[i];
+    }
+}
+
+/*
+ * get_filetype - derive file type from the extension of a file name
  *
  * filename - The file name. Must be a NUL-terminated string.
- * filetype - The buffer in which the file type will be storaged. Must be at
- * least MAXLINE bytes. Will be a NUL-terminated string.
- */
-void get_filetype(char *filename, char *filetype) {
-    if (strstr(filename, ".html")) {
-        strcpy(filetype, "text/html");
-    } else if (strstr(filename, ".gif")) {
-        strcpy(filetype, "image/gif");
-    } else if (strstr(filename, ".png")) {
-        strcpy(filetype, "image/png");
-    } else if (strstr(filename, ".jpg")) {
-        strcpy(filetype, "image/jpeg");
+ *
+ * Returns the MIME type, text/plain if the extension is not known.
+ */
+const char *get_filetype(const char *filename) {
+    const char *dot = strrchr(filename, '.');
+    if (dot == NULL || strchr(dot, '/') != NULL) {
+        return "text/plain";
+    }
+
+    const char *ext = dot + 1;
+    unsigned h = hash_ext(ext);
+    const mime_type *m;
+    while ((m = mime_table[h % MIME_TABLE_SIZE]) != NULL) {
+        if (strcmp(m->ext, ext) == 0) {
+            return m->type;
+        }
+        h++;
+    }
+    return "text/plain";
+}
+
+/*
+ * format_http_date - format a time as an HTTP date, e.g.
+ * "Sun, 06 Nov 1994 08:49:37 GMT"
+ */
+static void format_http_date(time_t t, char *buf, size_t size) {
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    strftime(buf, size, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+/*
+ * parse_http_date - parse an HTTP date
+ * Returns false if it is not one.
+ */
+static bool parse_http_date(const char *s, time_t *t) {
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    const char *end = strptime(s, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if (end == NULL || *end != '\0') {
+        return false;
+    }
+
+    /* Days since the epoch of a date in the proleptic Gregorian calendar,
+     * since timegm() is not POSIX */
+    long y = tm.tm_year + 1900 - (tm.tm_mon < 2);
+    long era = (y >= 0 ? y : y - 399) / 400;
+    long yoe = y - era * 400;
+    long doy = (153 * (tm.tm_mon + (tm.tm_mon < 2 ? 10 : -2)) + 2) / 5
+        + tm.tm_mday - 1;
+    long doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    long days = era * 146097 + doe - 719468;
+
+    *t = (time_t) days * 86400 + tm.tm_hour * 3600 + tm.tm_min * 60
+        + tm.tm_sec;
+    return true;
+}
+
+/*
+ * etag_matches - whether an If-None-Match list names an entity tag, by
+ * weak comparison
+ */
+static bool etag_matches(const char *list, const char *etag) {
+    if (strncmp(etag, "W/", 2) == 0) {
+        etag += 2;
+    }
+    size_t len = strlen(etag);
+
+    while (*list != '\0') {
+        while (*list == ' ' || *list == ',') {
+            list++;
+        }
+        const char *end = list;
+        while (*end != '\0' && *end != ',') {
+            end++;
+        }
+        const char *tag_end = end;
+        while (tag_end > list && tag_end[-1] == ' ') {
+            tag_end--;
+        }
+        const char *tag = list;
+        if (strncmp(tag, "W/", 2) == 0) {
+            tag += 2;
+        }
+        if ((tag_end - tag == 1 && *tag == '*')
+                || ((size_t) (tag_end - tag) == len
+                    && strncmp(tag, etag, len) == 0)) {
+            return true;
+        }
+        list = end;
+    }
+    return false;
+}
+
+/*
+ * not_modified - whether a conditional request can be answered with 304
+ *
+ * etag - The current entity tag
+ * mtime - The current modification time, or -1 if there is none
+ */
+static bool not_modified(const request_info *req, const char *etag,
+                         time_t mtime) {
+    /* If-None-Match takes precedence over If-Modified-Since */
+    if (req->if_none_match[0] != '\0') {
+        return etag[0] != '\0' && etag_matches(req->if_none_match, etag);
+    }
+    time_t since;
+    return req->if_modified_since[0] != '\0' && mtime >= 0
+        && parse_http_date(req->if_modified_since, &since) && mtime <= since;
+}
+
+/*
+ * send_not_modified - send a 304 with the validators of the current
+ * representation
+ *
+ * Returns true if the connection can be kept open.
+ */
+static bool send_not_modified(client_info *client, const char *etag,
+                              const char *last_modified) {
+    char buf[MAXBUF];
+    bool keep_alive = client->request.keep_alive;
+    size_t buflen = snprintf(buf, MAXBUF,
+            "HTTP/1.%c 304 Not Modified\r\n" \
+            "Server: Tiny Web Server\r\n" \
+            "Connection: %s\r\n" \
+            "%s%s%s" \
+            "%s%s%s" \
+            "\r\n", \
+            client->request.version, keep_alive ? "keep-alive" : "close",
+            etag[0] ? "ETag: " : "", etag, etag[0] ? "\r\n" : "",
+            last_modified[0] ? "Last-Modified: " : "", last_modified,
+            last_modified[0] ? "\r\n" : "");
+    if (buflen >= MAXBUF) {
+        return false; // Overflow!
+    }
+
+    printf("Response headers:\n%s", buf);
+    return rio_writen(client->connfd, buf, buflen) >= 0 && keep_alive;
+}
+
+/*
+ * Number of open files kept by the file cache
+ */
+#define FILE_CACHE_SIZE 64
+
+/* An open file and its response headers, kept in the file cache. */
+typedef struct file_entry {
+    char *filename;             // Name the file was requested by
+    int fd;                     // Open descriptor of the file
+    struct stat sbuf;           // Status of the file when it was opened
+    char *header;               // Content-Type and validator headers
+    size_t headerlen;
+    char etag[64];              // Entity tag, from the status
+    char last_modified[64];     // Modification time, as an HTTP date
+    int refcnt;                 // The cache's and every sender's
+    struct file_entry *prev;    // Toward the most recently used
+    struct file_entry *next;    // Toward the least recently used
+} file_entry;
+
+/* The file cache, an LRU list of open files. */
+static file_entry *file_head = NULL;
+static file_entry *file_tail = NULL;
+static int file_count = 0;
+static pthread_mutex_t file_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * same_file - whether a cached file is unchanged since it was opened
+ */
+static bool same_file(const struct stat *a, const struct stat *b) {
+    return a->st_dev == b->st_dev && a->st_ino == b->st_ino
+        && a->st_size == b->st_size
+        && a->st_mtim.tv_sec == b->st_mtim.tv_sec
+        && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+/*
+ * put_entry - drop a reference to a cached file, closing it with the last
+ * Must be called with the file cache locked.
+ */
+static void put_entry(file_entry *e) {
+    if (--e->refcnt == 0) {
+        close(e->fd);
+        free(e->filename);
+        free(e->header);
+        free(e);
+    }
+}
+
+/*
+ * unlink_entry - take a file out of the file cache, dropping its reference
+ * Must be called with the file cache locked.
+ */
+static void unlink_entry(file_entry *e) {
+    if (e->prev != NULL) {
+        e->prev->next = e->next;
+    } else {
+        file_head = e->next;
+    }
+    if (e->next != NULL) {
+        e->next->prev = e->prev;
+    } else {
+        file_tail = e->prev;
+    }
+    file_count--;
+    put_entry(e);
+}
+
+/*
+ * open_entry - open a file and render its response headers
+ * Returns NULL on error.
+ */
+static file_entry *open_entry(const char *filename) {
+    file_entry *e = calloc(1, sizeof(file_entry));
+    if (e == NULL) {
+        return NULL;
+    }
+
+    e->fd = open(filename, O_RDONLY, 0);
+    if (e->fd < 0) {
+        perror(filename);
+        free(e);
+        return NULL;
+    }
+    e->filename = strdup(filename);
+    e->header = malloc(MAXBUF);
+    if (e->filename == NULL || e->header == NULL
+            || fstat(e->fd, &e->sbuf) < 0) {
+        close(e->fd);
+        free(e->filename);
+        free(e->header);
+        free(e);
+        return NULL;
+    }
+
+    /* The validators change whenever the file does */
+    snprintf(e->etag, sizeof(e->etag), "\"%llx-%llx-%llx\"",
+             (unsigned long long) e->sbuf.st_ino,
+             (unsigned long long) e->sbuf.st_size,
+             (unsigned long long) e->sbuf.st_mtim.tv_sec * 1000000000ULL
+                 + e->sbuf.st_mtim.tv_nsec);
+    format_http_date(e->sbuf.st_mtim.tv_sec, e->last_modified,
+                     sizeof(e->last_modified));
+
+    e->headerlen = snprintf(e->header, MAXBUF,
+            "Content-Type: %s\r\n" \
+            "ETag: %s\r\n" \
+            "Last-Modified: %s\r\n" \
+            "Accept-Ranges: bytes\r\n", \
+            get_filetype(filename), e->etag, e->last_modified);
+    e->refcnt = 1;
+    return e;
+}
+
+/*
+ * find_entry - look a file up in the file cache, which must be locked,
+ * dropping the entry if the file has changed since it was opened
+ *
+ * Returns the entry, moved to the front and referenced, or NULL.
+ */
+static file_entry *find_entry(const char *filename, const struct stat *sbuf) {
+    file_entry *e;
+
+    for (e = file_head; e != NULL; e = e->next) {
+        if (strcmp(e->filename, filename) == 0) {
+            break;
+        }
+    }
+    if (e != NULL && !same_file(&e->sbuf, sbuf)) {
+        unlink_entry(e);
+        e = NULL;
+    }
+    if (e == NULL) {
+        return NULL;
+    }
+
+    /* Move to the front */
+    if (e != file_head) {
+        e->prev->next = e->next;
+        if (e->next != NULL) {
+            e->next->prev = e->prev;
+        } else {
+            file_tail = e->prev;
+        }
+        e->prev = NULL;
+        e->next = file_head;
+        file_head->prev = e;
+        file_head = e;
+    }
+    e->refcnt++;
+    return e;
+}
+
+/*
+ * get_file - get an open file from the file cache, opening it if it is not
+ * there or has changed since it was opened
+ *
+ * filename - The file name
+ * sbuf - The file's current status
+ *
+ * Returns the file, to be given back with release_file(), or NULL on error.
+ */
+file_entry *get_file(const char *filename, const struct stat *sbuf) {
+    file_entry *e;
+    file_entry *cached;
+
+    pthread_mutex_lock(&file_mutex);
+    e = find_entry(filename, sbuf);
+    pthread_mutex_unlock(&file_mutex);
+    if (e != NULL) {
+        return e;
+    }
+
+    /* Open outside the lock, then insert at the front */
+    if ((e = open_entry(filename)) == NULL) {
+        return NULL;
+    }
+    if (e->headerlen >= MAXBUF) {
+        put_entry(e); // Overflow!
+        return NULL;
+    }
+
+    pthread_mutex_lock(&file_mutex);
+
+    /* Another thread may have opened the file meanwhile; use its entry */
+    if ((cached = find_entry(filename, sbuf)) != NULL) {
+        put_entry(e);
+        pthread_mutex_unlock(&file_mutex);
+        return cached;
+    }
+
+    e->refcnt++;
+    e->next = file_head;
+    if (file_head != NULL) {
+        file_head->prev = e;
     } else {
-        strcpy(filetype, "text/plain");
+        file_tail = e;
+    }
+    file_head = e;
+    if (++file_count > FILE_CACHE_SIZE) {
+        unlink_entry(file_tail);
     }
+    pthread_mutex_unlock(&file_mutex);
+    return e;
 }
 
+/*
+ * release_file - give back a file got with get_file()
+ */
+void release_file(file_entry *e) {
+    pthread_mutex_lock(&file_mutex);
+    put_entry(e);
+    pthread_mutex_unlock(&file_mutex);
+}
 
 /*
- * serve_static - copy a file back to the client
+ * serve_static - send a file, or a byte range of it, back to the client
+ *
+ * The file comes from the file cache, with its headers rendered; its
+ * contents go from the page cache to the socket with sendfile().
+ * Conditional requests are answered with 304 when the file is unchanged.
+ *
+ * Returns true if the connection can be kept open.
  */
-void serve_static(int fd, char *filename, int filesize) {
-    int srcfd;
-    char *srcp;
-    char filetype[MAXLINE];
+bool serve_static(client_info *client, char *filename,
+                  const struct stat *sbuf) {
+    request_info *req = &client->request;
+    int fd = client->connfd;
     char buf[MAXBUF];
     size_t buflen;
 
-    get_filetype(filename, filetype);
+    file_entry *file = get_file(filename, sbuf);
+    if (file == NULL) {
+        return false;
+    }
+
+    if (not_modified(req, file->etag, file->sbuf.st_mtim.tv_sec)) {
+        bool keep_alive = send_not_modified(client, file->etag,
+                                            file->last_modified);
+        release_file(file);
+        return keep_alive;
+    }
+
+    /* A single byte range is served as such, if the file is still the one
+     * If-Range names; several ranges get the whole file */
+    size_t size = file->sbuf.st_size;
+    byte_range_t range = { 0, size - 1 };
+    int nranges = -1;
+    if (req->range[0] != '\0'
+            && (req->if_range[0] == '\0'
+                || strcmp(req->if_range, file->etag) == 0
+                || strcmp(req->if_range, file->last_modified) == 0)) {
+        nranges = parse_ranges(req->range, strlen(req->range), size,
+                               &range, 1);
+    }
+
+    const char *status = "200 OK";
+    char content_range[128] = "";
+    size_t length = size;
+    if (nranges == 0) {
+        status = "416 Range Not Satisfiable";
+        snprintf(content_range, sizeof(content_range),
+                 "Content-Range: bytes */%zu\r\n", size);
+        length = 0;
+    } else if (nranges == 1) {
+        status = "206 Partial Content";
+        snprintf(content_range, sizeof(content_range),
+                 "Content-Range: bytes %zu-%zu/%zu\r\n",
+                 range.first, range.last, size);
+        length = range.last - range.first + 1;
+    }
 
     /* Send response headers to client */
+    bool keep_alive = req->keep_alive;
     buflen = snprintf(buf, MAXBUF,
-            "HTTP/1.0 200 OK\r\n" \
+            "HTTP/1.%c %s\r\n" \
             "Server: Tiny Web Server\r\n" \
-            "Connection: close\r\n" \
-            "Content-Length: %d\r\n" \
-            "Content-Type: %s\r\n\r\n", \
-            filesize, filetype);
+            "Connection: %s\r\n" \
+            "Content-Length: %zu\r\n" \
+            "%s%s\r\n", \
+            req->version, status, keep_alive ? "keep-alive" : "close",
+            length, content_range, file->header);
     if (buflen >= MAXBUF) {
-        return; // Overflow!
+        release_file(file);
+        return false; // Overflow!
     }
 
     printf("Response headers:\n%s", buf);
 
     if (rio_writen(fd, buf, buflen) < 0) {
         fprintf(stderr, "Error writing static response headers to client\n");
+        release_file(file);
+        return false;
+    }
+
+    /* Send response body to client; the offset is our own, so workers can
+     * share the descriptor */
+    off_t offset = range.first;
+    off_t end = range.first + length;
+    while (offset < end) {
+        ssize_t n = sendfile(fd, file->fd, &offset, end - offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            fprintf(stderr, "Error writing static file \"%s\" to client\n",
+                    filename);
+            keep_alive = false;
+            break;
+        }
+    }
+
+    release_file(file);
+    return keep_alive;
+}
+
+/*
+ * Max number of CGI programs kept running, and how long a program has to
+ * say hello when started
+ */
+#define MAX_CGI_PROGRAMS 16
+#define CGI_HELLO_TIMEOUT_MS 1000
+
+/* A running persistent CGI program. */
+typedef struct {
+    pid_t pid;
+    int fd;                     // Tiny's end of its socket, -1 if not running
+    bool busy;                  // Whether it is serving a request
+} cgi_worker;
+
+/* A CGI program and its pool of workers. */
+typedef struct {
+    char filename[MAXLINE];
+    bool persistent;            // Whether it speaks the framed protocol
+    cgi_worker *workers;        // cgi_pool_size of them
+} cgi_program;
+
+/* Number of workers per CGI program, 0 to start one per request */
+static int cgi_pool_size = 0;
+
+static cgi_program cgi_programs[MAX_CGI_PROGRAMS];
+static int ncgi_programs = 0;
+static pthread_mutex_t cgi_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cgi_cond = PTHREAD_COND_INITIALIZER;
+
+/* Environment of persistent CGI programs, built before forking */
+static char **cgi_environ = NULL;
+
+/* Number of descriptors a process can have, for close_other_fds() */
+static long max_fds = 0;
+
+/* A directory entry as returned by getdents64 */
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+/*
+ * close_listed_fds - close the descriptors above stderr listed in
+ * /proc/self/fd
+ * Returns false if the directory cannot be read.
+ *
+ * Uses raw system calls only: after fork, a child of a threaded tiny may
+ * not call opendir(), which allocates.
+ */
+static bool close_listed_fds(void) {
+#ifdef SYS_getdents64
+    char buf[4096] __attribute__((aligned(8)));
+    int dirfd = open("/proc/self/fd", O_RDONLY | O_DIRECTORY);
+    if (dirfd < 0) {
+        return false;
+    }
+    long n;
+    while ((n = syscall(SYS_getdents64, dirfd, buf, sizeof(buf))) > 0) {
+        for (long pos = 0; pos < n; ) {
+            struct linux_dirent64 *entry =
+                    (struct linux_dirent64 *) (buf + pos);
+            pos += entry->d_reclen;
+
+            int fd = 0;
+            const char *c = entry->d_name;
+            for (; *c >= '0' && *c <= '9'; c++) {
+                fd = fd * 10 + (*c - '0');
+            }
+            if (c != entry->d_name && *c == '\0' && fd > STDERR_FILENO
+                    && fd != dirfd) {
+                close(fd);
+            }
+        }
+    }
+    close(dirfd);
+    return n == 0;
+#else
+    return false;
+#endif
+}
+
+/*
+ * close_other_fds - in a child about to run a CGI program, close every
+ * descriptor but stdin, stdout and stderr
+ *
+ * With -t, other workers' client connections and cached files are open
+ * when tiny forks; a program holding a client's connection would keep that
+ * client from seeing the end of its response. Only the open descriptors are
+ * closed, with close_range or by listing them, since the limit on
+ * descriptors can be in the tens of thousands; closing each number up to
+ * it is the last resort.
+ */
+static void close_other_fds(void) {
+#ifdef SYS_close_range
+    if (syscall(SYS_close_range, STDERR_FILENO + 1, ~0U, 0) == 0) {
         return;
     }
+#endif
+    if (close_listed_fds()) {
+        return;
+    }
+    for (long i = STDERR_FILENO + 1; i < max_fds; i++) {
+        close(i);
+    }
+}
 
+/*
+ * read_full - read exactly n bytes
+ * Returns false on error or end of file.
+ */
+static bool read_full(int fd, void *buf, size_t n) {
+    return rio_readn(fd, buf, n) == (ssize_t) n;
+}
 
-    /* Send response body to client */
-    srcfd = open(filename, O_RDONLY, 0);
-    if (srcfd < 0) {
+/* Outcomes of starting a worker */
+typedef enum {
+    WORKER_STARTED,
+    WORKER_FAILED,              // Could not start it now, e.g. fork failed
+    WORKER_NOT_PERSISTENT       // It does not speak the framed protocol
+} worker_start;
+
+/*
+ * start_worker - start a persistent CGI program and wait for its hello
+ */
+static worker_start start_worker(const char *filename, cgi_worker *w) {
+    char *argv[] = { (char *) filename, NULL };
+    char hello[CGI_HELLO_LEN];
+    int sv[2];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        perror("socketpair");
+        return WORKER_FAILED;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) { /* Child */
+        dup2(sv[1], STDIN_FILENO);
+        dup2(sv[1], STDOUT_FILENO);
+        close_other_fds();
+        signal(SIGPIPE, SIG_DFL);
+        execve(filename, argv, cgi_environ);
         perror(filename);
-        return;
+        _exit(1);
+    }
+    close(sv[1]);
+    if (pid == -1) {
+        perror("fork");
+        close(sv[0]);
+        return WORKER_FAILED;
     }
 
-    srcp = mmap(0, filesize, PROT_READ, MAP_PRIVATE, srcfd, 0);
-    if (srcp == MAP_FAILED) {
-        perror("mmap");
-        close(srcfd);
-        return;
+    /* A program that does not say hello is stopped */
+    struct pollfd pfd = { sv[0], POLLIN, 0 };
+    if (poll(&pfd, 1, CGI_HELLO_TIMEOUT_MS) != 1
+            || !read_full(sv[0], hello, CGI_HELLO_LEN)
+            || memcmp(hello, CGI_HELLO, CGI_HELLO_LEN) != 0) {
+        close(sv[0]);
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        return WORKER_NOT_PERSISTENT;
     }
-    close(srcfd);
 
-    if (rio_writen(fd, srcp, filesize) < 0) {
-        fprintf(stderr, "Error writing static file \"%s\" to client\n",
-                filename);
-        // Fall through to cleanup
+    w->pid = pid;
+    w->fd = sv[0];
+    return WORKER_STARTED;
+}
+
+/*
+ * stop_worker - stop a worker that failed, so it is started again when
+ * next needed
+ */
+static void stop_worker(cgi_worker *w) {
+    close(w->fd);
+    kill(w->pid, SIGKILL);
+    waitpid(w->pid, NULL, 0);
+    w->fd = -1;
+}
+
+/*
+ * get_worker - get an idle worker of a CGI program, starting the program's
+ * workers on first use and waiting while they are all busy
+ *
+ * Returns the worker, to be given back with put_worker(), or NULL if the
+ * program is to be run once per request instead.
+ */
+static cgi_worker *get_worker(const char *filename) {
+    cgi_program *prog = NULL;
+    cgi_worker *w = NULL;
+
+    pthread_mutex_lock(&cgi_mutex);
+    for (int i = 0; i < ncgi_programs; i++) {
+        if (strcmp(cgi_programs[i].filename, filename) == 0) {
+            prog = &cgi_programs[i];
+            break;
+        }
+    }
+    if (prog == NULL) {
+        cgi_worker *workers = calloc(cgi_pool_size, sizeof(cgi_worker));
+        if (ncgi_programs == MAX_CGI_PROGRAMS || workers == NULL
+                || strlen(filename) >= MAXLINE) {
+            free(workers);
+            pthread_mutex_unlock(&cgi_mutex);
+            return NULL;
+        }
+        prog = &cgi_programs[ncgi_programs++];
+        strcpy(prog->filename, filename);
+        prog->persistent = true;
+        prog->workers = workers;
+        for (int i = 0; i < cgi_pool_size; i++) {
+            workers[i].fd = -1;
+        }
     }
 
-    if (munmap(srcp, filesize) < 0) {
-        perror("munmap");
-        return;
+    while (prog->persistent && w == NULL) {
+        for (int i = 0; i < cgi_pool_size; i++) {
+            if (!prog->workers[i].busy) {
+                w = &prog->workers[i];
+                break;
+            }
+        }
+        if (w == NULL) {
+            pthread_cond_wait(&cgi_cond, &cgi_mutex);
+        }
+    }
+    if (w != NULL) {
+        w->busy = true;
+    }
+    pthread_mutex_unlock(&cgi_mutex);
+
+    /* Start it outside the lock, since that takes a while; a program is
+     * only run the old way for good if it does not speak the protocol,
+     * and is tried again on the next request if it just failed to start */
+    worker_start started;
+    if (w != NULL && w->fd < 0
+            && (started = start_worker(filename, w)) != WORKER_STARTED) {
+        pthread_mutex_lock(&cgi_mutex);
+        if (started == WORKER_NOT_PERSISTENT) {
+            prog->persistent = false;
+        }
+        w->busy = false;
+        pthread_cond_broadcast(&cgi_cond);
+        pthread_mutex_unlock(&cgi_mutex);
+        return NULL;
+    }
+    return w;
+}
+
+/*
+ * put_worker - give back a worker got with get_worker()
+ */
+static void put_worker(cgi_worker *w) {
+    pthread_mutex_lock(&cgi_mutex);
+    w->busy = false;
+    pthread_cond_signal(&cgi_cond);
+    pthread_mutex_unlock(&cgi_mutex);
+}
+
+/* Outcomes of asking a worker */
+typedef enum {
+    CGI_ANSWERED,
+    CGI_UNANSWERED,             // The worker failed before answering
+    CGI_BROKEN                  // The worker failed partway through
+} cgi_result;
+
+/*
+ * serve_persistent - have a worker answer a CGI request, copying its
+ * frames to the client
+ *
+ * An unanswered request can still be run the old way; a broken response
+ * has been partly sent, so the client can only be cut off.
+ */
+static cgi_result serve_persistent(int fd, cgi_worker *w, char *cgiargs) {
+    char buf[MAXBUF];
+    uint32_t len = strlen(cgiargs);
+    bool answered = false;
+    bool client_ok = true;
+
+    if (rio_writen(w->fd, &len, sizeof(len)) < 0
+            || rio_writen(w->fd, cgiargs, len) < 0) {
+        stop_worker(w);
+        return CGI_UNANSWERED;
+    }
+
+    /* Copy frames until the empty one; the rest of a response is still
+     * read if the client goes away, to keep the worker in step */
+    while (read_full(w->fd, &len, sizeof(len))) {
+        answered = true;
+        if (len == 0) {
+            return CGI_ANSWERED;
+        }
+        while (len > 0) {
+            size_t n = len < sizeof(buf) ? len : sizeof(buf);
+            if (!read_full(w->fd, buf, n)) {
+                stop_worker(w);
+                return CGI_BROKEN;
+            }
+            if (client_ok && rio_writen(fd, buf, n) < 0) {
+                client_ok = false;
+            }
+            len -= n;
+        }
     }
+    stop_worker(w);
+    return answered ? CGI_BROKEN : CGI_UNANSWERED;
+}
+
+/*
+ * abort_connection - have a connection end with a reset rather than an
+ * orderly close once it is closed, so the client cannot take a cut-off
+ * response for a whole one
+ */
+static void abort_connection(int fd) {
+    struct linger linger = { 1, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
 }
 
 /*
  * serve_dynamic - run a CGI program on behalf of the client
+ *
+ * With -c, the program is kept running and asked over its socket, if it
+ * speaks the framed protocol of cgi.h; otherwise it is started for the
+ * request.
  */
 void serve_dynamic(int fd, char *filename, char *cgiargs) {
     char buf[MAXLINE];
@@ -209,6 +998,23 @@ void serve_dynamic(int fd, char *filename, char *cgiargs) {
         return;
     }
 
+    if (cgi_pool_size > 0) {
+        cgi_worker *w = get_worker(filename);
+        if (w != NULL) {
+            cgi_result result = serve_persistent(fd, w, cgiargs);
+            put_worker(w);
+            if (result == CGI_BROKEN) {
+                fprintf(stderr, "%s failed partway through a response\n",
+                        filename);
+                abort_connection(fd);
+                return;
+            }
+            if (result == CGI_ANSWERED) {
+                return;
+            }
+        }
+    }
+
     pid_t pid = fork();
     if (pid == 0) { /* Child */
         /* Real server would set all CGI vars here */
@@ -216,7 +1022,8 @@ void serve_dynamic(int fd, char *filename, char *cgiargs) {
 
         /* Redirect stdout to client */
         dup2(fd, STDOUT_FILENO);
-        close(fd);
+        close_other_fds();
+        signal(SIGPIPE, SIG_DFL);
 
         /* Run CGI program */
         if (execve(filename, emptylist, environ) < 0) {
@@ -229,8 +1036,8 @@ void serve_dynamic(int fd, char *filename, char *cgiargs) {
         return;
     }
 
-    /* Parent waits for and reaps child */
-    if (wait(NULL) < 0) {
+    /* Parent waits for and reaps its own child, not another thread's */
+    if (waitpid(pid, NULL, 0) < 0) {
         perror("wait");
         return;
     }
@@ -284,68 +1091,328 @@ void clienterror(int fd, const char *errnum, const char *shortmsg,
     }
 }
 
+/*
+ * Largest object and longest delay /gen takes
+ */
+#define GEN_MAX_SIZE (1L << 30)
+#define GEN_MAX_DELAY_MS 60000
+
+/* Number of /gen responses sent, which numbers each in its X-Gen-Id, so
+ * that a client can tell a response the origin sent again from one a cache
+ * replayed */
+static unsigned long gen_responses = 0;
+
+/* Parameters of a synthetic object, from the query string of /gen. */
+typedef struct {
+    long size;                  // size=: bytes of content (default 1024)
+    uint64_t seed;              // seed=: which content (default 0)
+    long delay;                 // delay=: ms before responding (default 0)
+    bool chunked;               // chunked=1: chunked instead of a length
+    char cache[MAXLINE];        // cache=: Cache-Control value, if any
+    char etag[MAXLINE];         // etag=: ETag value, if any
+} gen_params;
+
+/*
+ * url_decode - decode %XX escapes and '+' in place
+ */
+static void url_decode(char *s) {
+    char *out = s;
+    for (; *s != '\0'; s++) {
+        if (*s == '%' && isxdigit((unsigned char) s[1])
+                && isxdigit((unsigned char) s[2])) {
+            char hex[3] = { s[1], s[2], '\0' };
+            *out++ = (char) strtol(hex, NULL, 16);
+            s += 2;
+        } else if (*s == '+') {
+            *out++ = ' ';
+        } else {
+            *out++ = *s;
+        }
+    }
+    *out = '\0';
+}
+
+/*
+ * parse_number - parse a whole query value as a number in [0, max]
+ * Returns false if it is not one.
+ */
+static bool parse_number(const char *value, long max, long *n) {
+    char *end;
+    errno = 0;
+    long v = strtol(value, &end, 10);
+    if (errno != 0 || end == value || *end != '\0' || v < 0 || v > max) {
+        return false;
+    }
+    *n = v;
+    return true;
+}
+
+/*
+ * parse_gen_query - parse the query string of /gen, which is modified
+ * Returns false if a parameter is malformed.
+ */
+static bool parse_gen_query(char *query, gen_params *params) {
+    params->size = 1024;
+    params->seed = 0;
+    params->delay = 0;
+    params->chunked = false;
+    params->cache[0] = '\0';
+    params->etag[0] = '\0';
+
+    char *saveptr;
+    for (char *param = strtok_r(query, "&", &saveptr); param != NULL;
+            param = strtok_r(NULL, "&", &saveptr)) {
+        char *value = strchr(param, '=');
+        if (value == NULL) {
+            return false;
+        }
+        *value++ = '\0';
+        url_decode(value);
+
+        /* Values may go into headers, which they must not break */
+        if (strpbrk(value, "\r\n") != NULL) {
+            return false;
+        }
+
+        long n;
+        if (strcmp(param, "size") == 0) {
+            if (!parse_number(value, GEN_MAX_SIZE, &params->size)) {
+                return false;
+            }
+        } else if (strcmp(param, "seed") == 0) {
+            if (!parse_number(value, LONG_MAX, &n)) {
+                return false;
+            }
+            params->seed = n;
+        } else if (strcmp(param, "delay") == 0) {
+            if (!parse_number(value, GEN_MAX_DELAY_MS, &params->delay)) {
+                return false;
+            }
+        } else if (strcmp(param, "chunked") == 0) {
+            params->chunked = strcmp(value, "1") == 0;
+        } else if (strcmp(param, "cache") == 0) {
+            snprintf(params->cache, MAXLINE, "%s", value);
+        } else if (strcmp(param, "etag") == 0) {
+            /* Quote it unless it is already an entity tag */
+            bool quoted = value[0] == '"' || strncmp(value, "W/\"", 3) == 0;
+            snprintf(params->etag, MAXLINE, quoted ? "%s" : "\"%s\"", value);
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * gen_fill - fill a buffer with the next bytes of the content of a seed
+ *
+ * The content is lowercase letters from a xorshift64* generator, so the
+ * same seed always gives the same bytes, whatever the size asked for.
+ */
+static void gen_fill(uint64_t *state, char *buf, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        uint64_t x = *state;
+        x ^= x >> 12;
+        x ^= x << 25;
+        x ^= x >> 27;
+        *state = x;
+        buf[i] = 'a' + (x * 0x2545F4914F6CDD1DULL >> 32) % 26;
+    }
+}
+
+/*
+ * serve_gen - serve a synthetic object, generated as it is sent
+ *
+ * query - The query string of the request, modified
+ *
+ * Returns true if the connection can be kept open.
+ */
+bool serve_gen(client_info *client, char *query) {
+    request_info *req = &client->request;
+    int fd = client->connfd;
+    gen_params params;
+    char buf[MAXBUF];
+    size_t buflen;
+
+    if (!parse_gen_query(query, &params)) {
+        clienterror(fd, "400", "Bad Request",
+                    "Tiny could not parse the /gen parameters");
+        return false;
+    }
+
+    if (params.delay > 0) {
+        struct timespec ts = { params.delay / 1000,
+                               params.delay % 1000 * 1000000L };
+        while (nanosleep(&ts, &ts) < 0 && errno == EINTR) {
+        }
+    }
+
+    /* The object never changes, so its ETag validates it */
+    if (params.etag[0] != '\0' && not_modified(req, params.etag, -1)) {
+        return send_not_modified(client, params.etag, "");
+    }
+
+    /* Chunked encoding needs an HTTP/1.1 client */
+    char length[64];
+    bool keep_alive = req->keep_alive;
+    params.chunked = params.chunked && req->version == '1';
+    if (params.chunked) {
+        snprintf(length, sizeof(length), "Transfer-Encoding: chunked\r\n");
+    } else {
+        snprintf(length, sizeof(length), "Content-Length: %ld\r\n",
+                 params.size);
+    }
+    buflen = snprintf(buf, MAXBUF,
+            "HTTP/1.%c 200 OK\r\n" \
+            "Server: Tiny Web Server\r\n" \
+            "Connection: %s\r\n" \
+            "%s" \
+            "Content-Type: text/plain\r\n" \
+            "X-Gen-Id: %d-%lu\r\n" \
+            "%s%s%s" \
+            "%s%s%s" \
+            "\r\n", \
+            req->version, keep_alive ? "keep-alive" : "close", length,
+            (int) getpid(),
+            __atomic_add_fetch(&gen_responses, 1, __ATOMIC_RELAXED),
+            params.cache[0] ? "Cache-Control: " : "", params.cache,
+            params.cache[0] ? "\r\n" : "",
+            params.etag[0] ? "ETag: " : "", params.etag,
+            params.etag[0] ? "\r\n" : "");
+    if (buflen >= MAXBUF) {
+        return false; // Overflow!
+    }
+    if (rio_writen(fd, buf, buflen) < 0) {
+        return false;
+    }
+
+    /* Stream the content, a buffer at a time */
+    uint64_t state = params.seed ^ 0x9E3779B97F4A7C15ULL;
+    long left = params.size;
+    while (left > 0) {
+        size_t n = left < MAXBUF ? left : MAXBUF;
+        gen_fill(&state, buf, n);
+        if (params.chunked) {
+            char size[32];
+            int len = snprintf(size, sizeof(size), "%zx\r\n", n);
+            if (rio_writen(fd, size, len) < 0) {
+                return false;
+            }
+        }
+        if (rio_writen(fd, buf, n) < 0
+                || (params.chunked && rio_writen(fd, "\r\n", 2) < 0)) {
+            return false;
+        }
+        left -= n;
+    }
+    if (params.chunked && rio_writen(fd, "0\r\n\r\n", 5) < 0) {
+        return false;
+    }
+    return keep_alive;
+}
+
+/*
+ * save_header - keep the value of a header tiny acts on
+ */
+static void save_header(request_info *req, const char *name, size_t namelen,
+                        const char *value, size_t valuelen) {
+    char *dst = NULL;
+    if (namelen == strlen("connection")
+            && strncasecmp(name, "connection", namelen) == 0) {
+        if (valuelen == strlen("close")
+                && strncasecmp(value, "close", valuelen) == 0) {
+            req->keep_alive = false;
+        } else if (valuelen == strlen("keep-alive")
+                && strncasecmp(value, "keep-alive", valuelen) == 0) {
+            req->keep_alive = true;
+        }
+    } else if (namelen == strlen("if-none-match")
+            && strncasecmp(name, "if-none-match", namelen) == 0) {
+        dst = req->if_none_match;
+    } else if (namelen == strlen("if-modified-since")
+            && strncasecmp(name, "if-modified-since", namelen) == 0) {
+        dst = req->if_modified_since;
+    } else if (namelen == strlen("range")
+            && strncasecmp(name, "range", namelen) == 0) {
+        dst = req->range;
+    } else if (namelen == strlen("if-range")
+            && strncasecmp(name, "if-range", namelen) == 0) {
+        dst = req->if_range;
+    }
+    if (dst != NULL) {
+        snprintf(dst, MAXLINE, "%.*s", (int) valuelen, value);
+    }
+}
+
 /*
  * read_requesthdrs - read HTTP request headers
  * Returns true if an error occurred, or false otherwise.
  */
-bool read_requesthdrs(client_info *client, rio_t *rp) {
-    char buf[MAXLINE];
-    char name[MAXLINE];
-    char value[MAXLINE];
+bool read_requesthdrs(client_info *client) {
+    const char *line;
+    ssize_t len;
 
     while (true) {
-        if (rio_readlineb(rp, buf, sizeof(buf)) <= 0) {
+        if ((len = reader_readline(&client->reader, &line)) <= 0) {
             return true;
         }
 
         /* Check for end of request headers */
-        if (strcmp(buf, "\r\n") == 0) {
+        if (len == 2 && line[0] == '\r' && line[1] == '\n') {
             return false;
         }
 
-        /* Parse header into name and value */
-        if (sscanf(buf, "%[^:]: %[^\r\n]", name, value) != 2) {
+        /* Parse header into name and value, in the reader's buffer */
+        const char *end = line + len;
+        const char *colon = memchr(line, ':', len);
+        const char *value = colon != NULL ? colon + 1 : end;
+        while (value < end && isspace((unsigned char)*value)) {
+            value++;
+        }
+        const char *value_end = value;
+        while (value_end < end && *value_end != '\r' && *value_end != '\n') {
+            value_end++;
+        }
+        if (colon == NULL || colon == line || value_end == value) {
             /* Error parsing header */
             clienterror(client->connfd, "400", "Bad Request",
                         "Tiny could not parse request headers");
             return true;
         }
 
-        /* Convert name to lowercase */
-        for (size_t i = 0; name[i] != '\0'; i++) {
-            name[i] = tolower(name[i]);
+        /* Print name in lowercase */
+        for (const char *c = line; c < colon; c++) {
+            putchar(tolower((unsigned char)*c));
         }
+        printf(": %.*s\n", (int)(value_end - value), value);
 
-        printf("%s: %s\n", name, value);
+        save_header(&client->request, line, colon - line, value,
+                    value_end - value);
     }
 }
 
 /*
- * serve - handle one HTTP request/response transaction
+ * Whether connections may be kept alive. Only with the thread pool: served
+ * one at a time, an idle client would hold up every other one.
  */
-void serve(client_info *client) {
-    // Get some extra info about the client (hostname/port)
-    // This is optional, but it's nice to know who's connected
-    int res = getnameinfo(
-            (SA *) &client->addr, client->addrlen,
-            client->host, sizeof(client->host),
-            client->serv, sizeof(client->serv),
-            0);
-    if (res == 0) {
-        printf("Accepted connection from %s:%s\n", client->host, client->serv);
-    }
-    else {
-        fprintf(stderr, "getnameinfo failed: %s\n", gai_strerror(res));
-    }
-
-    rio_t rio;
-    rio_readinitb(&rio, client->connfd);
+static bool keep_alive_allowed = false;
 
+/*
+ * serve - handle one HTTP request/response transaction
+ *
+ * Returns true if the connection can be kept open for another request:
+ * the client asked for that, and the response had a known length.
+ */
+bool serve(client_info *client) {
     /* Read request line */
     char buf[MAXLINE];
-    if (rio_readlineb(&rio, buf, sizeof(buf)) <= 0) {
-        return;
+    const char *line;
+    ssize_t len = reader_readline(&client->reader, &line);
+    if (len <= 0) {
+        return false;
     }
+    memcpy(buf, line, len);
+    buf[len] = '\0';
 
     printf("%s", buf);
 
@@ -360,19 +1427,34 @@ void serve(client_info *client) {
             || (version != '0' && version != '1')) {
         clienterror(client->connfd, "400", "Bad Request",
                     "Tiny received a malformed request");
-        return;
+        return false;
     }
 
     /* Check that the method is GET */
     if (strcmp(method, "GET") != 0) {
         clienterror(client->connfd, "501", "Not Implemented",
                     "Tiny does not implement this method");
-        return;
+        return false;
     }
 
+    /* HTTP/1.1 connections persist unless the client says otherwise */
+    request_info *req = &client->request;
+    memset(req, 0, sizeof(request_info));
+    req->version = version;
+    req->keep_alive = version == '1';
+
     /* Check if reading request headers caused an error */
-    if (read_requesthdrs(client, &rio)) {
-        return;
+    if (read_requesthdrs(client)) {
+        return false;
+    }
+    if (!keep_alive_allowed) {
+        req->keep_alive = false;
+    }
+
+    /* Serve synthetic objects for load testing */
+    if (strncmp(uri, "/gen", strlen("/gen")) == 0
+            && (uri[4] == '\0' || uri[4] == '?')) {
+        return serve_gen(client, uri + 4 + (uri[4] == '?'));
     }
 
     /* Parse URI from GET request */
@@ -381,7 +1463,7 @@ void serve(client_info *client) {
     if (result == PARSE_ERROR) {
         clienterror(client->connfd, "400", "Bad Request",
                     "Tiny could not parse the request URI");
-        return;
+        return false;
     }
 
     /* Attempt to stat the file */
@@ -389,41 +1471,33 @@ void serve(client_info *client) {
     if (stat(filename, &sbuf) < 0) {
         clienterror(client->connfd, "404", "Not found",
                     "Tiny couldn't find this file");
-        return;
+        return false;
     }
 
     if (result == PARSE_STATIC) { /* Serve static content */
         if (!(S_ISREG(sbuf.st_mode)) || !(S_IRUSR & sbuf.st_mode)) {
             clienterror(client->connfd, "403", "Forbidden",
                         "Tiny couldn't read the file");
-            return;
+            return false;
         }
-        serve_static(client->connfd, filename, sbuf.st_size);
+        return serve_static(client, filename, &sbuf);
     } else { /* Serve dynamic content */
         if (!(S_ISREG(sbuf.st_mode)) || !(S_IXUSR & sbuf.st_mode)) {
             clienterror(client->connfd, "403", "Forbidden",
                         "Tiny couldn't run the CGI program");
-            return;
+            return false;
         }
+        /* The end of a CGI program's output is the end of the
+         * connection */
         serve_dynamic(client->connfd, filename, cgiargs);
+        return false;
     }
 }
 
-int main(int argc, char **argv) {
-    int listenfd;
-
-    /* Check command line args */
-    if (argc != 2) {
-        fprintf(stderr, "usage: %s <port>\n", argv[0]);
-        exit(1);
-    }
-
-    listenfd = open_listenfd(argv[1]);
-    if (listenfd < 0) {
-        fprintf(stderr, "Failed to listen on port: %s\n", argv[1]);
-        exit(1);
-    }
-
+/*
+ * serve_forever - accept connections and serve them one at a time
+ */
+void serve_forever(int listenfd) {
     while (1) {
         /* Allocate space on the stack for client info */
         client_info client_data;
@@ -440,9 +1514,131 @@ int main(int argc, char **argv) {
             continue;
         }
 
-        /* Connection is established; serve client */
-        serve(client);
+        // Get some extra info about the client (hostname/port)
+        // This is optional, but it's nice to know who's connected
+        int res = getnameinfo(
+                (SA *) &client->addr, client->addrlen,
+                client->host, sizeof(client->host),
+                client->serv, sizeof(client->serv),
+                0);
+        if (res == 0) {
+            printf("Accepted connection from %s:%s\n",
+                   client->host, client->serv);
+        }
+        else {
+            fprintf(stderr, "getnameinfo failed: %s\n", gai_strerror(res));
+        }
+
+        /* Connection is established; serve client, as long as it keeps
+         * the connection open and sends requests in time */
+        reader_init(&client->reader, client->connfd, MAXLINE - 1);
+        struct timeval timeout = { KEEPALIVE_TIMEOUT_SEC, 0 };
+        for (int i = 0; serve(client); i++) {
+            if (i + 1 == KEEPALIVE_MAX_REQUESTS) {
+                break;
+            }
+            if (i == 0) {
+                setsockopt(client->connfd, SOL_SOCKET, SO_RCVTIMEO,
+                           &timeout, sizeof(timeout));
+            }
+        }
+        reader_free(&client->reader);
         close(client->connfd);
     }
 }
 
+/*
+ * worker - thread routine of the pool, serving connections as they come
+ */
+void *worker(void *vargp) {
+    serve_forever(*(int *) vargp);
+    return NULL;
+}
+
+void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-t threads] [-c workers] <port>\n", prog);
+    exit(1);
+}
+
+/*
+ * init_cgi_environ - build the environment of persistent CGI programs: ours,
+ * with TINY_CGI_ENV set
+ */
+void init_cgi_environ(void) {
+    size_t n = 0;
+    while (environ[n] != NULL) {
+        n++;
+    }
+    cgi_environ = calloc(n + 2, sizeof(char *));
+    if (cgi_environ == NULL) {
+        fprintf(stderr, "Failed to build the CGI environment\n");
+        exit(1);
+    }
+    memcpy(cgi_environ, environ, n * sizeof(char *));
+    cgi_environ[n] = TINY_CGI_ENV "=1";
+}
+
+int main(int argc, char **argv) {
+    int listenfd;
+    int nthreads = 1;
+    int c;
+
+    /* Check command line args */
+    while ((c = getopt(argc, argv, "t:c:")) != -1) {
+        switch (c) {
+        case 't':
+            nthreads = atoi(optarg);
+            if (nthreads < 1) {
+                usage(argv[0]);
+            }
+            break;
+        case 'c':
+            cgi_pool_size = atoi(optarg);
+            if (cgi_pool_size < 1) {
+                usage(argv[0]);
+            }
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+    }
+
+    init_mime_types();
+    max_fds = sysconf(_SC_OPEN_MAX);
+    if (cgi_pool_size > 0) {
+        init_cgi_environ();
+    }
+
+    listenfd = open_listenfd(argv[optind]);
+    if (listenfd < 0) {
+        fprintf(stderr, "Failed to listen on port: %s\n", argv[optind]);
+        exit(1);
+    }
+
+    /* A client hanging up must not take down the whole pool, nor a
+     * persistent CGI program exiting take down tiny; CGI programs get the
+     * default action back */
+    if (nthreads > 1 || cgi_pool_size > 0) {
+        signal(SIGPIPE, SIG_IGN);
+    }
+
+    if (nthreads > 1) {
+        keep_alive_allowed = true;
+
+        /* The main thread is one of the workers */
+        for (int i = 1; i < nthreads; i++) {
+            pthread_t tid;
+            if (pthread_create(&tid, NULL, worker, &listenfd) != 0) {
+                fprintf(stderr, "Failed to start worker %d\n", i);
+                exit(1);
+            }
+            pthread_detach(tid);
+        }
+    }
+
+    serve_forever(listenfd);
+}
+